@@ -1,15 +1,45 @@
 #include <atomic_queue/atomic_queue.h>
+#include <atomic_queue/atomic_queue_mutex.h>
 #include <benchmark/benchmark.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
+#include <algorithm>
+#include <array>
 #include <atomic>
 #include <barrier>
+#include <bit>
+#include <chrono>
+#include <cmath>
 #include <concepts>
+#include <condition_variable>
+#include <coroutine>
+#include <ctime>
+#include <deque>
+#include <limits>
 #include <memory>
+#include <mutex>
 #include <optional>
 #include <semaphore>
+#include <span>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <utility>
 
+#include "cpu_topology.h"
+#include "lane_mpsc_queue.h"
 #include "mpmc_queue.h"
 #include "mpsc_queue.h"
+#include "numa_sharded_queue.h"
+#include "object_pool.h"
+#include "priority_queue.h"
+#include "shared_memory_queue.h"
+#include "spilling_queue.h"
+#include "thread_pool.h"
+#include "unbounded_mpmc_queue.h"
+#include "work_stealing_deque.h"
 
 namespace theta {
 
@@ -21,16 +51,279 @@ concept QueueType = std::default_initializable<Q> && requires(Q q, int* v) {
   { q.pop() } -> std::same_as<int*>;
 };
 
+template <typename Q>
+concept BatchQueueType
+    = QueueType<Q> && requires(Q q, std::span<int* const> vals, int** out) {
+        q.push_n(vals);
+        { q.try_push_n(vals) } -> std::same_as<size_t>;
+        q.pop_n(out, size_t{});
+        { q.try_pop_n(out, size_t{}) } -> std::same_as<size_t>;
+      };
+
+// kBufferSize == kRuntimeBufferSize sizes the ring from the QueueOpts, which
+// gives the same capacity as the compile-time-sized variant.
+template <size_t kBufferSize,
+          bool kMinimizeContention = false,
+          WaitStrategy Waiter = ParkWait,
+          Cardinality kProducers = Cardinality::kMany,
+          Cardinality kConsumers = Cardinality::kMany>
 struct MPMCQueueAdaptor {
   std::optional<int*> try_pop() { return queue.try_pop(); }
 
   bool try_push(int* v) { return queue.try_push(v); }
 
-  void push(int* v) { return queue.push(v); }
+  void push(int* v) { queue.push(v); }
+
+  int* pop() { return *queue.pop(); }
+
+  void push_n(std::span<int* const> vals) { queue.push_n(vals); }
+
+  size_t try_push_n(std::span<int* const> vals) {
+    return queue.try_push_n(vals);
+  }
+
+  void pop_n(int** out, size_t n) { queue.pop_n(out, n); }
+
+  size_t try_pop_n(int** out, size_t max) { return queue.try_pop_n(out, max); }
+
+  MPMCQueue<int*,
+            kBufferSize,
+            kMinimizeContention,
+            Waiter,
+            kProducers,
+            kConsumers>
+      queue{QueueOpts{}.set_max_size(1024)};
+};
+
+// MPSCQueue only has non-blocking operations, so the blocking ones yield
+// until they succeed. With kUnbounded, pushes never need to.
+template <bool kUnbounded, size_t kCapacity = 1024>
+struct MPSCQueueAdaptor {
+  std::optional<int*> try_pop() { return queue.try_pop(); }
+
+  bool try_push(int* v) { return queue.try_push(v); }
+
+  void push(int* v) {
+    while (!queue.try_push(v)) {
+      std::this_thread::yield();
+    }
+  }
+
+  int* pop() {
+    while (true) {
+      auto v = queue.try_pop();
+      if (v.has_value()) {
+        return v.value();
+      }
+      std::this_thread::yield();
+    }
+  }
+
+  void push_n(std::span<int* const> vals) {
+    while (true) {
+      vals = vals.subspan(queue.try_push_n(vals));
+      if (vals.empty()) {
+        return;
+      }
+      std::this_thread::yield();
+    }
+  }
+
+  size_t try_push_n(std::span<int* const> vals) {
+    return queue.try_push_n(vals);
+  }
+
+  void pop_n(int** out, size_t n) {
+    while (true) {
+      size_t popped = queue.try_pop_n(out, n);
+      out += popped;
+      n -= popped;
+      if (n == 0) {
+        return;
+      }
+      std::this_thread::yield();
+    }
+  }
+
+  size_t try_pop_n(int** out, size_t max) { return queue.try_pop_n(out, max); }
+
+  MPSCQueue<int*, kUnbounded> queue{QueueOpts{}.set_max_size(kCapacity)};
+};
+
+// Uses the machine's real topology, so on a single node this measures the cost
+// of looking up the current node on top of MPMCQueue.
+struct NumaShardedQueueAdaptor {
+  std::optional<int*> try_pop() { return queue.try_pop(); }
+
+  bool try_push(int* v) { return queue.try_push(v); }
+
+  void push(int* v) { queue.push(v); }
+
+  int* pop() { return *queue.pop(); }
+
+  NumaShardedQueue<int*, 1024> queue{QueueOpts{}};
+};
+
+// Rings of the same size as the bounded adaptors' buffer. Pushes never fail.
+struct UnboundedMPMCQueueAdaptor {
+  std::optional<int*> try_pop() { return queue.try_pop(); }
+
+  bool try_push(int* v) {
+    queue.push(v);
+    return true;
+  }
+
+  void push(int* v) { queue.push(v); }
+
+  int* pop() { return queue.pop(); }
+
+  UnboundedMPMCQueue<int*> queue{QueueOpts{}.set_max_size(1024)};
+};
+
+// Registers every thread as a producer the first time it pushes.
+struct LaneMPSCQueueAdaptor {
+  using Queue = LaneMPSCQueue<int*>;
+
+  std::optional<int*> try_pop() { return queue.try_pop(); }
+
+  bool try_push(int* v) { return queue.try_push(token(), v); }
+
+  void push(int* v) {
+    while (!try_push(v)) {
+      std::this_thread::yield();
+    }
+  }
+
+  int* pop() {
+    while (true) {
+      auto v = queue.try_pop();
+      if (v.has_value()) {
+        return v.value();
+      }
+      std::this_thread::yield();
+    }
+  }
+
+  Queue::ProducerToken& token() {
+    // The main thread pushes to one adaptor after another, so the cached token
+    // only belongs to the adaptor with the matching id.
+    thread_local uint64_t owner = 0;
+    thread_local Queue::ProducerToken* cached = nullptr;
+    if (owner != id) {
+      std::lock_guard l{mu};
+      cached = &tokens.emplace_back(*queue.register_producer());
+      owner = id;
+    }
+    return *cached;
+  }
+
+  static inline std::atomic<uint64_t> next_id{1};
+  const uint64_t id = next_id.fetch_add(1, std::memory_order::relaxed);
+  // Room for 24 producers and the main thread.
+  Queue queue{QueueOpts{}.set_max_size(1024).set_max_producers(32)};
+  std::mutex mu;
+  // Destroyed before the queue.
+  std::deque<Queue::ProducerToken> tokens;
+};
+
+// The vendored atomic_queue containers, whose try_pop() takes an out
+// parameter. Their push() and pop() spin until they succeed. Containers sized
+// at runtime get kCapacity slots.
+template <typename Q, unsigned kCapacity = 1024>
+struct AtomicQueueAdaptor {
+  std::optional<int*> try_pop() {
+    int* v;
+    if (queue.try_pop(v)) {
+      return v;
+    }
+    return {};
+  }
+
+  bool try_push(int* v) { return queue.try_push(v); }
+
+  void push(int* v) { queue.push(v); }
 
   int* pop() { return queue.pop(); }
 
-  MPMCQueue<int*> queue{QueueOpts{}.set_max_size(1024)};
+  Q queue = []() {
+    if constexpr (std::is_constructible_v<Q, unsigned>) {
+      return Q{kCapacity};
+    } else {
+      return Q{};
+    }
+  }();
+};
+
+template <unsigned kCapacity = 1024>
+using AtomicQueueAdaptor1
+    = AtomicQueueAdaptor<atomic_queue::AtomicQueue<int*, kCapacity>>;
+template <unsigned kCapacity = 1024>
+using AtomicQueueAdaptor2
+    = AtomicQueueAdaptor<atomic_queue::AtomicQueue2<int*, kCapacity>>;
+template <unsigned kCapacity = 1024>
+using AtomicQueueBAdaptor
+    = AtomicQueueAdaptor<atomic_queue::AtomicQueueB<int*>, kCapacity>;
+template <unsigned kCapacity = 1024>
+using AtomicQueueB2Adaptor
+    = AtomicQueueAdaptor<atomic_queue::AtomicQueueB2<int*>, kCapacity>;
+// AtomicQueueMutex only has try_push() and try_pop(), which RetryDecorator
+// spins on.
+template <typename Lock, unsigned kCapacity = 1024>
+using AtomicQueueMutexAdaptor
+    = AtomicQueueAdaptor<atomic_queue::RetryDecorator<
+        atomic_queue::AtomicQueueMutex<int*, kCapacity, Lock>>>;
+
+// The baseline: a std::deque behind a std::mutex, where the blocking
+// operations wait on condition variables.
+template <size_t kCapacity = 1024>
+struct MutexDequeAdaptor {
+  std::optional<int*> try_pop() {
+    std::unique_lock l{mu};
+    if (queue.empty()) {
+      return {};
+    }
+    return take(l);
+  }
+
+  bool try_push(int* v) {
+    std::unique_lock l{mu};
+    if (queue.size() >= kCapacity) {
+      return false;
+    }
+    put(l, v);
+    return true;
+  }
+
+  void push(int* v) {
+    std::unique_lock l{mu};
+    not_full.wait(l, [this]() { return queue.size() < kCapacity; });
+    put(l, v);
+  }
+
+  int* pop() {
+    std::unique_lock l{mu};
+    not_empty.wait(l, [this]() { return !queue.empty(); });
+    return take(l);
+  }
+
+  void put(std::unique_lock<std::mutex>& l, int* v) {
+    queue.push_back(v);
+    l.unlock();
+    not_empty.notify_one();
+  }
+
+  int* take(std::unique_lock<std::mutex>& l) {
+    int* v = queue.front();
+    queue.pop_front();
+    l.unlock();
+    not_full.notify_one();
+    return v;
+  }
+
+  std::mutex mu;
+  std::condition_variable not_empty;
+  std::condition_variable not_full;
+  std::deque<int*> queue;
 };
 
 #define BENCH_MOODYCAMEL 0
@@ -61,11 +354,26 @@ struct MoodycamelAdaptor {
 };
 #endif
 
+static const CpuTopology& bench_topology() {
+  static const CpuTopology topology = CpuTopology::from_sysfs();
+  return topology;
+}
+
+// Pins producers to the first CPUs that `placement` picks and consumers to
+// the rest.
 template <QueueType QType, bool kUseTry>
 static void producer_consumer(benchmark::State& state,
                               int num_producers,
-                              int num_consumers) {
+                              int num_consumers,
+                              Placement placement = Placement::kNone) {
   QType queue{};
+  std::vector<int> cpus
+      = bench_topology().place(placement, num_producers, num_consumers);
+  auto pin = [&cpus](size_t thread) {
+    if (thread < cpus.size()) {
+      CpuTopology::pin_to(cpus[thread]);
+    }
+  };
 
   std::atomic<bool> done{false};
   int end_sentinel;
@@ -94,7 +402,10 @@ static void producer_consumer(benchmark::State& state,
 
   std::vector<std::thread> consumers;
   for (int64_t i = 0; i < num_consumers; i++) {
-    consumers.push_back(std::thread{consumer_work});
+    consumers.push_back(std::thread{[&, i]() {
+      pin(num_producers + i);
+      consumer_work();
+    }});
   }
 
   auto producer_work = [&]() {
@@ -124,7 +435,10 @@ static void producer_consumer(benchmark::State& state,
 
   std::vector<std::thread> producers;
   for (int64_t i = 0; i < num_producers; i++) {
-    producers.push_back(std::thread{producer_work});
+    producers.push_back(std::thread{[&, i]() {
+      pin(i);
+      producer_work();
+    }});
   }
 
   for (auto& p : producers) {
@@ -140,6 +454,99 @@ static void producer_consumer(benchmark::State& state,
   }
 }
 
+// Like producer_consumer, but every push and pop moves `batch_size` elements
+// with one ticket reservation.
+template <BatchQueueType QType, bool kUseTry>
+static void batched_producer_consumer(benchmark::State& state,
+                                      int num_producers,
+                                      int num_consumers,
+                                      size_t batch_size) {
+  QType queue{};
+
+  std::atomic<bool> done{false};
+  std::atomic<int> live_consumers{num_consumers};
+  int end_sentinel;
+  std::mutex mu;
+
+  auto consumer_work = [&]() {
+    std::vector<int*> out(batch_size);
+    while (true) {
+      size_t n = batch_size;
+      if constexpr (kUseTry) {
+        while ((n = queue.try_pop_n(out.data(), batch_size)) == 0) {
+          std::this_thread::yield();
+        }
+      } else {
+        queue.pop_n(out.data(), batch_size);
+      }
+
+      if (std::find(out.begin(), out.begin() + n, &end_sentinel)
+          != out.begin() + n) {
+        live_consumers.fetch_sub(1, std::memory_order::release);
+        return;
+      }
+    }
+  };
+
+  std::vector<std::thread> consumers;
+  for (int64_t i = 0; i < num_consumers; i++) {
+    consumers.push_back(std::thread{consumer_work});
+  }
+
+  auto producer_work = [&]() {
+    const size_t kBatchSize = 10000;
+    int foo;
+    std::vector<int*> vals(batch_size, &foo);
+    while (true) {
+      {
+        std::lock_guard l{mu};
+        if (done.load(std::memory_order::acquire)
+            || !state.KeepRunningBatch(kBatchSize)) {
+          done.store(true, std::memory_order::release);
+          return;
+        }
+      }
+
+      for (size_t i = 0; i < kBatchSize; i += batch_size) {
+        std::span<int* const> batch{vals.data(),
+                                    std::min(batch_size, kBatchSize - i)};
+        if constexpr (kUseTry) {
+          while (!batch.empty()) {
+            batch = batch.subspan(queue.try_push_n(batch));
+            if (!batch.empty()) {
+              std::this_thread::yield();
+            }
+          }
+        } else {
+          queue.push_n(batch);
+        }
+      }
+    }
+  };
+
+  std::vector<std::thread> producers;
+  for (int64_t i = 0; i < num_producers; i++) {
+    producers.push_back(std::thread{producer_work});
+  }
+
+  for (auto& p : producers) {
+    p.join();
+  }
+
+  // A batch can sweep up sentinels meant for other consumers, and a blocking
+  // consumer only returns once its whole batch is filled, so keep feeding
+  // sentinels until every consumer has seen one.
+  while (live_consumers.load(std::memory_order::acquire) > 0) {
+    if (!queue.try_push(&end_sentinel)) {
+      std::this_thread::yield();
+    }
+  }
+
+  for (auto& p : consumers) {
+    p.join();
+  }
+}
+
 template <typename QType>
 static void BM_multi_producer_single_consumer(benchmark::State& state) {
   producer_consumer<QType, /*kUseTry=*/false>(state, state.range(0), 1);
@@ -153,7 +560,7 @@ static void BM_multi_producer_single_consumer(benchmark::State& state) {
 //    ->Args({12})
 //    ->Args({24});
 //#endif
-//BENCHMARK_TEMPLATE(BM_multi_producer_single_consumer, MPMCQueueAdaptor)
+//BENCHMARK_TEMPLATE(BM_multi_producer_single_consumer, MPMCQueueAdaptor<1024>)
 //    ->Args({1})
 //    ->Args({2})
 //    ->Args({4})
@@ -174,7 +581,7 @@ static void BM_multi_producer_single_consumer_try(benchmark::State& state) {
 //    ->Args({12})
 //    ->Args({24});
 //#endif
-//BENCHMARK_TEMPLATE(BM_multi_producer_single_consumer_try, MPMCQueueAdaptor)
+//BENCHMARK_TEMPLATE(BM_multi_producer_single_consumer_try, MPMCQueueAdaptor<1024>)
 //    ->Args({1})
 //    ->Args({2})
 //    ->Args({4})
@@ -182,6 +589,23 @@ static void BM_multi_producer_single_consumer_try(benchmark::State& state) {
 //    ->Args({12})
 //    ->Args({24});
 
+// One shared index word against a lane per producer.
+BENCHMARK_TEMPLATE(BM_multi_producer_single_consumer_try,
+                   MPSCQueueAdaptor</*kUnbounded=*/false>)
+    ->Args({1})
+    ->Args({2})
+    ->Args({4})
+    ->Args({8})
+    ->Args({12})
+    ->Args({24});
+BENCHMARK_TEMPLATE(BM_multi_producer_single_consumer_try, LaneMPSCQueueAdaptor)
+    ->Args({1})
+    ->Args({2})
+    ->Args({4})
+    ->Args({8})
+    ->Args({12})
+    ->Args({24});
+
 template <typename QType>
 static void BM_multi_producer_multi_consumer_try(benchmark::State& state) {
   producer_consumer<QType, /*kUseTry=*/true>(
@@ -197,7 +621,15 @@ BENCHMARK_TEMPLATE(BM_multi_producer_multi_consumer_try, MoodycamelAdaptor)
     ->Args({12})
     ->Args({24});
 #endif
-BENCHMARK_TEMPLATE(BM_multi_producer_multi_consumer_try, MPMCQueueAdaptor)
+BENCHMARK_TEMPLATE(BM_multi_producer_multi_consumer_try, MPMCQueueAdaptor<1024>)
+    ->Args({1})
+    ->Args({2})
+    ->Args({4})
+    ->Args({6})
+    ->Args({8})
+    ->Args({12})
+    ->Args({24});
+BENCHMARK_TEMPLATE(BM_multi_producer_multi_consumer_try, MPMCQueueAdaptor<kRuntimeBufferSize>)
     ->Args({1})
     ->Args({2})
     ->Args({4})
@@ -205,6 +637,13 @@ BENCHMARK_TEMPLATE(BM_multi_producer_multi_consumer_try, MPMCQueueAdaptor)
     ->Args({8})
     ->Args({12})
     ->Args({24});
+BENCHMARK_TEMPLATE(BM_multi_producer_multi_consumer_try,
+                   MPMCQueueAdaptor<1024, /*kMinimizeContention=*/true>)
+    ->Args({4})
+    ->Args({6})
+    ->Args({8})
+    ->Args({12})
+    ->Args({24});
 
 template <typename QType>
 static void BM_multi_producer_multi_consumer(benchmark::State& state) {
@@ -221,7 +660,38 @@ BENCHMARK_TEMPLATE(BM_multi_producer_multi_consumer, MoodycamelAdaptor)
     ->Args({12})
     ->Args({24});
 #endif
-BENCHMARK_TEMPLATE(BM_multi_producer_multi_consumer, MPMCQueueAdaptor)
+BENCHMARK_TEMPLATE(BM_multi_producer_multi_consumer, MPMCQueueAdaptor<1024>)
+    ->Args({1})
+    ->Args({2})
+    ->Args({4})
+    ->Args({6})
+    ->Args({8})
+    ->Args({12})
+    ->Args({24});
+BENCHMARK_TEMPLATE(BM_multi_producer_multi_consumer, MPMCQueueAdaptor<kRuntimeBufferSize>)
+    ->Args({1})
+    ->Args({2})
+    ->Args({4})
+    ->Args({6})
+    ->Args({8})
+    ->Args({12})
+    ->Args({24});
+BENCHMARK_TEMPLATE(BM_multi_producer_multi_consumer,
+                   MPMCQueueAdaptor<1024, /*kMinimizeContention=*/true>)
+    ->Args({4})
+    ->Args({6})
+    ->Args({8})
+    ->Args({12})
+    ->Args({24});
+BENCHMARK_TEMPLATE(BM_multi_producer_multi_consumer, NumaShardedQueueAdaptor)
+    ->Args({1})
+    ->Args({2})
+    ->Args({4})
+    ->Args({6})
+    ->Args({8})
+    ->Args({12})
+    ->Args({24});
+BENCHMARK_TEMPLATE(BM_multi_producer_multi_consumer, UnboundedMPMCQueueAdaptor)
     ->Args({1})
     ->Args({2})
     ->Args({4})
@@ -230,6 +700,1300 @@ BENCHMARK_TEMPLATE(BM_multi_producer_multi_consumer, MPMCQueueAdaptor)
     ->Args({12})
     ->Args({24});
 
+// Blocking pushes and pops with each wait strategy.
+BENCHMARK_TEMPLATE(BM_multi_producer_multi_consumer,
+                   MPMCQueueAdaptor<1024, false, SpinWait>)
+    ->Args({1})
+    ->Args({2})
+    ->Args({4})
+    ->Args({8});
+BENCHMARK_TEMPLATE(BM_multi_producer_multi_consumer,
+                   MPMCQueueAdaptor<1024, false, SpinYieldParkWait<>>)
+    ->Args({1})
+    ->Args({2})
+    ->Args({4})
+    ->Args({8});
+BENCHMARK_TEMPLATE(BM_multi_producer_multi_consumer,
+                   MPMCQueueAdaptor<1024, false, EventCountWait>)
+    ->Args({1})
+    ->Args({2})
+    ->Args({4})
+    ->Args({8});
+
+// Each role specialization next to the general queue with the same number of
+// producers and consumers.
+template <typename QType>
+static void BM_roles(benchmark::State& state) {
+  producer_consumer<QType, /*kUseTry=*/false>(
+      state, state.range(0), state.range(1));
+}
+template <Cardinality kProducers, Cardinality kConsumers>
+using RoleAdaptor
+    = MPMCQueueAdaptor<1024, false, ParkWait, kProducers, kConsumers>;
+BENCHMARK_TEMPLATE(BM_roles, MPMCQueueAdaptor<1024>)
+    ->ArgNames({"producers", "consumers"})
+    ->Args({1, 1})
+    ->Args({1, 4})
+    ->Args({4, 1});
+BENCHMARK_TEMPLATE(BM_roles,
+                   RoleAdaptor<Cardinality::kSingle, Cardinality::kSingle>)
+    ->ArgNames({"producers", "consumers"})
+    ->Args({1, 1});
+BENCHMARK_TEMPLATE(BM_roles,
+                   RoleAdaptor<Cardinality::kSingle, Cardinality::kMany>)
+    ->ArgNames({"producers", "consumers"})
+    ->Args({1, 4});
+BENCHMARK_TEMPLATE(BM_roles,
+                   RoleAdaptor<Cardinality::kMany, Cardinality::kSingle>)
+    ->ArgNames({"producers", "consumers"})
+    ->Args({4, 1});
+
+// Every queue under each producer:consumer ratio, at a small and a large
+// capacity, with blocking and with try operations. Filter on a slice of it,
+// e.g. --benchmark_filter='BM_matrix<.*<64>, true>'.
+template <typename QType, bool kUseTry>
+static void BM_matrix(benchmark::State& state) {
+  producer_consumer<QType, kUseTry>(state, state.range(0), state.range(1));
+}
+
+// 1:N, N:1 and N:N.
+static void matrix_ratios(benchmark::internal::Benchmark* b) {
+  b->ArgNames({"producers", "consumers"})->Args({1, 1});
+  for (int64_t n : {2, 4, 8}) {
+    b->Args({1, n})->Args({n, 1})->Args({n, n});
+  }
+}
+
+// For queues that only allow a single consumer.
+static void matrix_single_consumer(benchmark::internal::Benchmark* b) {
+  b->ArgNames({"producers", "consumers"});
+  for (int64_t n : {1, 2, 4, 8}) {
+    b->Args({n, 1});
+  }
+}
+
+template <size_t kCapacity>
+using BoundedMPSCQueueAdaptor
+    = MPSCQueueAdaptor</*kUnbounded=*/false, kCapacity>;
+template <unsigned kCapacity>
+using SpinlockQueueAdaptor
+    = AtomicQueueMutexAdaptor<atomic_queue::Spinlock, kCapacity>;
+template <unsigned kCapacity>
+using TicketSpinlockQueueAdaptor
+    = AtomicQueueMutexAdaptor<atomic_queue::TicketSpinlock, kCapacity>;
+template <unsigned kCapacity>
+using UnfairSpinlockQueueAdaptor
+    = AtomicQueueMutexAdaptor<atomic_queue::UnfairSpinlock, kCapacity>;
+
+#define MATRIX_BENCHMARKS(QType, args)                                    \
+  BENCHMARK_TEMPLATE(BM_matrix, QType, /*kUseTry=*/false)->Apply(args); \
+  BENCHMARK_TEMPLATE(BM_matrix, QType, /*kUseTry=*/true)->Apply(args)
+
+#define MATRIX_CAPACITY(N)                                         \
+  MATRIX_BENCHMARKS(MPMCQueueAdaptor<N>, matrix_ratios);           \
+  MATRIX_BENCHMARKS(BoundedMPSCQueueAdaptor<N>,                    \
+                    matrix_single_consumer);                       \
+  MATRIX_BENCHMARKS(AtomicQueueAdaptor1<N>, matrix_ratios);        \
+  MATRIX_BENCHMARKS(AtomicQueueAdaptor2<N>, matrix_ratios);        \
+  MATRIX_BENCHMARKS(AtomicQueueBAdaptor<N>, matrix_ratios);        \
+  MATRIX_BENCHMARKS(AtomicQueueB2Adaptor<N>, matrix_ratios);       \
+  MATRIX_BENCHMARKS(SpinlockQueueAdaptor<N>, matrix_ratios);       \
+  MATRIX_BENCHMARKS(TicketSpinlockQueueAdaptor<N>, matrix_ratios); \
+  MATRIX_BENCHMARKS(UnfairSpinlockQueueAdaptor<N>, matrix_ratios); \
+  MATRIX_BENCHMARKS(MutexDequeAdaptor<N>, matrix_ratios)
+
+MATRIX_CAPACITY(64);
+MATRIX_CAPACITY(1024);
+
+// Producers and consumers pinned along each hardware boundary, with the
+// placement in the label.
+template <typename QType, Placement kPlacement>
+static void BM_placement(benchmark::State& state) {
+  state.SetLabel(std::string{placement_name(kPlacement)});
+  producer_consumer<QType, /*kUseTry=*/false>(
+      state, state.range(0), state.range(1), kPlacement);
+}
+
+// Placements that need a boundary the machine doesn't have, like SMT siblings
+// or a second L3, aren't registered at all, so that they don't show up as
+// failed runs.
+template <typename QType, Placement kPlacement>
+static void register_placement(const std::string& queue_name) {
+  if (!bench_topology().supports(kPlacement)) {
+    return;
+  }
+  std::string name = "BM_placement<" + queue_name + ", "
+                   + std::string{placement_name(kPlacement)} + ">";
+  benchmark::RegisterBenchmark(name.c_str(), BM_placement<QType, kPlacement>)
+      ->ArgNames({"producers", "consumers"})
+      ->Args({1, 1})
+      ->Args({2, 2})
+      ->Args({4, 4})
+      ->UseRealTime();
+}
+
+template <typename QType>
+static void register_placements(const std::string& queue_name) {
+  register_placement<QType, Placement::kNone>(queue_name);
+  register_placement<QType, Placement::kCompact>(queue_name);
+  register_placement<QType, Placement::kScatter>(queue_name);
+  register_placement<QType, Placement::kSmtPairs>(queue_name);
+  register_placement<QType, Placement::kCrossL3>(queue_name);
+}
+
+static const bool placement_benchmarks_registered = []() {
+  register_placements<MPMCQueueAdaptor<1024>>("MPMCQueueAdaptor<1024>");
+  register_placements<AtomicQueueAdaptor1<>>("AtomicQueueAdaptor1<>");
+  register_placements<MutexDequeAdaptor<>>("MutexDequeAdaptor<>");
+  return true;
+}();
+
+template <typename QType>
+static void BM_batched_multi_producer_single_consumer_try(
+    benchmark::State& state) {
+  batched_producer_consumer<QType, /*kUseTry=*/true>(
+      state, state.range(0), 1, state.range(1));
+}
+BENCHMARK_TEMPLATE(BM_batched_multi_producer_single_consumer_try,
+                   MPSCQueueAdaptor</*kUnbounded=*/false>)
+    ->ArgNames({"producers", "batch"})
+    ->ArgsProduct({{1, 2, 4, 8, 12, 24}, {1, 4, 16, 64, 256}});
+BENCHMARK_TEMPLATE(BM_batched_multi_producer_single_consumer_try,
+                   MPSCQueueAdaptor</*kUnbounded=*/true>)
+    ->ArgNames({"producers", "batch"})
+    ->ArgsProduct({{1, 2, 4, 8, 12, 24}, {1, 4, 16, 64, 256}});
+BENCHMARK_TEMPLATE(BM_batched_multi_producer_single_consumer_try,
+                   MPMCQueueAdaptor<1024>)
+    ->ArgNames({"producers", "batch"})
+    ->ArgsProduct({{1, 2, 4, 8, 12, 24}, {1, 4, 16, 64, 256}});
+
+template <typename QType>
+static void BM_batched_multi_producer_multi_consumer_try(
+    benchmark::State& state) {
+  batched_producer_consumer<QType, /*kUseTry=*/true>(
+      state, state.range(0), state.range(0), state.range(1));
+}
+BENCHMARK_TEMPLATE(BM_batched_multi_producer_multi_consumer_try,
+                   MPMCQueueAdaptor<1024>)
+    ->ArgNames({"threads", "batch"})
+    ->ArgsProduct({{1, 2, 4, 8, 12, 24}, {1, 4, 16, 64, 256}});
+
+template <typename QType>
+static void BM_batched_multi_producer_multi_consumer(benchmark::State& state) {
+  batched_producer_consumer<QType, /*kUseTry=*/false>(
+      state, state.range(0), state.range(0), state.range(1));
+}
+BENCHMARK_TEMPLATE(BM_batched_multi_producer_multi_consumer,
+                   MPMCQueueAdaptor<1024>)
+    ->ArgNames({"threads", "batch"})
+    ->ArgsProduct({{1, 2, 4, 8, 12, 24}, {1, 4, 16, 64, 256}});
+
+// The queue never holds more than one item, so an unbounded queue never leaves
+// its lock-free fast mode. This should cost the same as a bounded queue.
+template <typename QType>
+static void BM_push_pop_no_spill(benchmark::State& state) {
+  QType queue{};
+  int foo;
+  for (auto _ : state) {
+    queue.try_push(&foo);
+    benchmark::DoNotOptimize(queue.try_pop());
+  }
+}
+BENCHMARK_TEMPLATE(BM_push_pop_no_spill, MPSCQueueAdaptor</*kUnbounded=*/false>);
+BENCHMARK_TEMPLATE(BM_push_pop_no_spill, MPSCQueueAdaptor</*kUnbounded=*/true>);
+
+static int64_t now_ns() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+static int64_t thread_cpu_ns() {
+  timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return int64_t{ts.tv_sec} * 1'000'000'000 + ts.tv_nsec;
+}
+
+// A producer pushes a timestamp every 50us to a consumer that is idle in
+// between. kTimed parks the consumer in pop_for(), and otherwise it polls
+// try_pop() and yields. Reports how long each item took to reach the consumer
+// and the fraction of a core the consumer used.
+template <bool kTimed>
+static void BM_idle_consumer_wakeup(benchmark::State& state) {
+  using namespace std::chrono_literals;
+  MPMCQueue<int64_t, 1024> queue;
+
+  int64_t total_latency_ns = 0;
+  int64_t consumer_cpu_ns = 0;
+  std::thread consumer{[&]() {
+    int64_t cpu_start = thread_cpu_ns();
+    while (true) {
+      std::optional<int64_t> pushed_at;
+      if constexpr (kTimed) {
+        while (!(pushed_at = queue.pop_for(1s))) {
+        }
+      } else {
+        while (!(pushed_at = queue.try_pop())) {
+          std::this_thread::yield();
+        }
+      }
+      if (*pushed_at < 0) {
+        break;
+      }
+      total_latency_ns += now_ns() - *pushed_at;
+    }
+    consumer_cpu_ns = thread_cpu_ns() - cpu_start;
+  }};
+
+  int64_t start = now_ns();
+  for (auto _ : state) {
+    std::this_thread::sleep_for(50us);
+    queue.push(now_ns());
+  }
+  queue.push(-1);
+  consumer.join();
+  int64_t elapsed_ns = now_ns() - start;
+
+  state.counters["wake_latency_ns"] = benchmark::Counter(
+      total_latency_ns, benchmark::Counter::kAvgIterations);
+  state.counters["consumer_cpu"]
+      = static_cast<double>(consumer_cpu_ns) / elapsed_ns;
+}
+BENCHMARK_TEMPLATE(BM_idle_consumer_wakeup, /*kTimed=*/true)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_idle_consumer_wakeup, /*kTimed=*/false)->UseRealTime();
+
+// An HdrHistogram-style log-linear histogram of nanosecond latencies. Values
+// below 2^kSubBits get a bucket each, and every power of two above that is
+// split into 2^(kSubBits - 1) buckets, so a bucket is never wider than 1/64th
+// of the values in it.
+class LatencyHistogram {
+ public:
+  void record(int64_t ns) {
+    uint64_t v = std::max<int64_t>(ns, 0);
+    counts_[bucket_of(v)]++;
+    count_++;
+    max_ = std::max(max_, v);
+  }
+
+  void merge(const LatencyHistogram& other) {
+    for (size_t i = 0; i < counts_.size(); i++) {
+      counts_[i] += other.counts_[i];
+    }
+    count_ += other.count_;
+    max_ = std::max(max_, other.max_);
+  }
+
+  // The highest value in the bucket that holds the `p`th percentile.
+  uint64_t percentile(double p) const {
+    uint64_t rank = std::max<uint64_t>(1, std::ceil(p / 100 * count_));
+    uint64_t seen = 0;
+    for (size_t i = 0; i < counts_.size(); i++) {
+      seen += counts_[i];
+      if (seen >= rank) {
+        return std::min(highest_in(i), max_);
+      }
+    }
+    return max_;
+  }
+
+  uint64_t max() const { return max_; }
+
+  uint64_t count() const { return count_; }
+
+ private:
+  static constexpr int kSubBits = 7;
+  static constexpr uint64_t kLinear = uint64_t{1} << kSubBits;
+  static constexpr uint64_t kHalf = kLinear / 2;
+
+  std::array<uint64_t, kLinear + (64 - kSubBits) * kHalf> counts_{};
+  uint64_t count_{0};
+  uint64_t max_{0};
+
+  static size_t bucket_of(uint64_t v) {
+    if (v < kLinear) {
+      return v;
+    }
+    int shift = std::bit_width(v) - kSubBits;
+    return kLinear + (shift - 1) * kHalf + ((v >> shift) - kHalf);
+  }
+
+  static uint64_t highest_in(size_t bucket) {
+    if (bucket < kLinear) {
+      return bucket;
+    }
+    int shift = (bucket - kLinear) / kHalf + 1;
+    uint64_t top = (bucket - kLinear) % kHalf + kHalf;
+    return ((top + 1) << shift) - 1;
+  }
+};
+
+static void report_latency(benchmark::State& state,
+                           const LatencyHistogram& histogram) {
+  state.counters["p50_ns"] = histogram.percentile(50);
+  state.counters["p99_ns"] = histogram.percentile(99);
+  state.counters["p99.9_ns"] = histogram.percentile(99.9);
+  state.counters["max_ns"] = histogram.max();
+}
+
+// The latency benchmarks pass a value's push time as the pointer itself. No
+// queue dereferences what it holds, and the time is never zero, which the
+// queues that reserve a null value need.
+static int* stamp() { return reinterpret_cast<int*>(now_ns()); }
+
+static int64_t age_ns(int* v) {
+  return now_ns() - reinterpret_cast<int64_t>(v);
+}
+
+template <bool kUseTry, QueueType QType>
+static void push_one(QType& queue, int* v) {
+  if constexpr (kUseTry) {
+    while (!queue.try_push(v)) {
+      std::this_thread::yield();
+    }
+  } else {
+    queue.push(v);
+  }
+}
+
+template <bool kUseTry, QueueType QType>
+static int* pop_one(QType& queue) {
+  if constexpr (kUseTry) {
+    while (true) {
+      if (auto v = queue.try_pop()) {
+        return *v;
+      }
+      std::this_thread::yield();
+    }
+  } else {
+    return queue.pop();
+  }
+}
+
+// Every iteration, range(0) producers each push a burst of timestamps as fast
+// as the queue takes them, so that it fills up, and one consumer records how
+// long each one took to come out.
+template <QueueType QType, bool kUseTry>
+static void BM_latency_one_way(benchmark::State& state) {
+  static constexpr int64_t kBurst = 256;
+  const int64_t num_producers = state.range(0);
+  QType queue{};
+  LatencyHistogram histogram;
+  // Starts and ends each burst, with the main thread in the middle.
+  std::barrier sync{num_producers + 2};
+  bool done = false;
+
+  std::vector<std::thread> threads;
+  threads.emplace_back([&]() {
+    while (true) {
+      sync.arrive_and_wait();
+      if (done) {
+        return;
+      }
+      for (int64_t i = 0; i < num_producers * kBurst; i++) {
+        histogram.record(age_ns(pop_one<kUseTry>(queue)));
+      }
+      sync.arrive_and_wait();
+    }
+  });
+  for (int64_t p = 0; p < num_producers; p++) {
+    threads.emplace_back([&]() {
+      while (true) {
+        sync.arrive_and_wait();
+        if (done) {
+          return;
+        }
+        for (int64_t i = 0; i < kBurst; i++) {
+          push_one<kUseTry>(queue, stamp());
+        }
+        sync.arrive_and_wait();
+      }
+    });
+  }
+
+  for (auto _ : state) {
+    sync.arrive_and_wait();
+    sync.arrive_and_wait();
+  }
+  done = true;
+  sync.arrive_and_wait();
+  for (auto& t : threads) {
+    t.join();
+  }
+
+  state.SetItemsProcessed(histogram.count());
+  report_latency(state, histogram);
+}
+
+// Round trips through two queues and a thread that echoes every value back,
+// with one value in flight at a time.
+template <QueueType QType, bool kUseTry>
+static void BM_latency_ping_pong(benchmark::State& state) {
+  QType down{};
+  QType up{};
+  int end_sentinel;
+  std::thread echo{[&]() {
+    while (true) {
+      int* v = pop_one<kUseTry>(down);
+      if (v == &end_sentinel) {
+        return;
+      }
+      push_one<kUseTry>(up, v);
+    }
+  }};
+
+  LatencyHistogram histogram;
+  for (auto _ : state) {
+    push_one<kUseTry>(down, stamp());
+    histogram.record(age_ns(pop_one<kUseTry>(up)));
+  }
+  push_one<kUseTry>(down, &end_sentinel);
+  echo.join();
+
+  report_latency(state, histogram);
+}
+
+#define LATENCY_BENCHMARKS(QType)                                       \
+  BENCHMARK_TEMPLATE(BM_latency_one_way, QType, /*kUseTry=*/false)      \
+      ->Arg(1)                                                          \
+      ->Arg(4)                                                          \
+      ->UseRealTime();                                                  \
+  BENCHMARK_TEMPLATE(BM_latency_one_way, QType, /*kUseTry=*/true)       \
+      ->Arg(1)                                                          \
+      ->Arg(4)                                                          \
+      ->UseRealTime();                                                  \
+  BENCHMARK_TEMPLATE(BM_latency_ping_pong, QType, /*kUseTry=*/false)    \
+      ->UseRealTime();                                                  \
+  BENCHMARK_TEMPLATE(BM_latency_ping_pong, QType, /*kUseTry=*/true)     \
+      ->UseRealTime()
+
+LATENCY_BENCHMARKS(MPMCQueueAdaptor<1024>);
+LATENCY_BENCHMARKS(MPSCQueueAdaptor</*kUnbounded=*/false>);
+LATENCY_BENCHMARKS(AtomicQueueAdaptor1<>);
+LATENCY_BENCHMARKS(AtomicQueueAdaptor2<>);
+LATENCY_BENCHMARKS(AtomicQueueBAdaptor<>);
+LATENCY_BENCHMARKS(AtomicQueueB2Adaptor<>);
+
+// Releases every thread at once. Parking barriers wake their waiters one
+// after another, which gives the first ones a head start.
+class SpinBarrier {
+ public:
+  explicit SpinBarrier(int64_t count) : count_(count) {}
+
+  void arrive_and_wait() {
+    uint64_t generation = generation_.load(std::memory_order::acquire);
+    if (arrived_.fetch_add(1, std::memory_order::acq_rel) + 1 == count_) {
+      arrived_.store(0, std::memory_order::relaxed);
+      generation_.fetch_add(1, std::memory_order::release);
+      return;
+    }
+    // Yield once in a while, for machines with fewer cores than threads.
+    for (int spins = 1;
+         generation_.load(std::memory_order::acquire) == generation;
+         spins++) {
+      if (spins % 1024 == 0) {
+        std::this_thread::yield();
+      } else {
+        atomic_queue::spin_loop_pause();
+      }
+    }
+  }
+
+ private:
+  const int64_t count_;
+  alignas(hardware_destructive_interference_size) std::atomic<int64_t>
+      arrived_{0};
+  alignas(hardware_destructive_interference_size) std::atomic<uint64_t>
+      generation_{0};
+};
+
+// Each of range(0) producers pushes range(2) values to range(1) consumers.
+// Every round starts with a fresh queue and a warmup of a tenth as many
+// values, after which a SpinBarrier starts every thread's timed work at once.
+// The round's time runs from the first thread's start to the last thread's
+// finish.
+//
+// Reports every thread's rate, and the smallest and largest share of the
+// total that one producer's rate or one consumer's pops made up. With
+// --benchmark_out=<file> --benchmark_out_format=json, all of these land in
+// machine-readable JSON next to the aggregate items_per_second.
+template <QueueType QType, bool kUseTry>
+static void BM_fixed_work(benchmark::State& state) {
+  const int64_t num_producers = state.range(0);
+  const int64_t num_consumers = state.range(1);
+  const int64_t ops = state.range(2);
+  const int64_t warmup_ops = ops / 10;
+
+  struct Times {
+    int64_t start_ns;
+    int64_t end_ns;
+    int64_t ops;
+  };
+  std::vector<int64_t> producer_ns(num_producers);
+  std::vector<int64_t> consumer_ns(num_consumers);
+  std::vector<int64_t> consumer_ops(num_consumers);
+
+  for (auto _ : state) {
+    QType queue{};
+    int end_sentinel;
+    int value;
+    std::atomic<int64_t> warmup_left{num_producers * warmup_ops};
+    SpinBarrier start{num_producers + num_consumers};
+    std::vector<Times> producer_times(num_producers);
+    std::vector<Times> consumer_times(num_consumers);
+
+    std::vector<std::thread> consumers;
+    for (int64_t i = 0; i < num_consumers; i++) {
+      consumers.emplace_back([&, i]() {
+        while (warmup_left.load(std::memory_order::relaxed) > 0) {
+          if (queue.try_pop()) {
+            warmup_left.fetch_sub(1, std::memory_order::relaxed);
+          } else {
+            std::this_thread::yield();
+          }
+        }
+        start.arrive_and_wait();
+        Times& times = consumer_times[i];
+        times = {.start_ns = now_ns(), .end_ns = 0, .ops = 0};
+        while (pop_one<kUseTry>(queue) != &end_sentinel) {
+          times.ops++;
+        }
+        times.end_ns = now_ns();
+      });
+    }
+
+    std::vector<std::thread> producers;
+    for (int64_t i = 0; i < num_producers; i++) {
+      producers.emplace_back([&, i]() {
+        for (int64_t j = 0; j < warmup_ops; j++) {
+          push_one<kUseTry>(queue, &value);
+        }
+        start.arrive_and_wait();
+        Times& times = producer_times[i];
+        times = {.start_ns = now_ns(), .end_ns = 0, .ops = ops};
+        for (int64_t j = 0; j < ops; j++) {
+          push_one<kUseTry>(queue, &value);
+        }
+        times.end_ns = now_ns();
+      });
+    }
+
+    for (auto& p : producers) {
+      p.join();
+    }
+    for (int64_t i = 0; i < num_consumers; i++) {
+      push_one<kUseTry>(queue, &end_sentinel);
+    }
+    for (auto& c : consumers) {
+      c.join();
+    }
+
+    int64_t first_start = std::numeric_limits<int64_t>::max();
+    int64_t last_end = 0;
+    for (const auto* group : {&producer_times, &consumer_times}) {
+      for (const Times& times : *group) {
+        first_start = std::min(first_start, times.start_ns);
+        last_end = std::max(last_end, times.end_ns);
+      }
+    }
+    state.SetIterationTime((last_end - first_start) / 1e9);
+    for (int64_t i = 0; i < num_producers; i++) {
+      producer_ns[i] += producer_times[i].end_ns - producer_times[i].start_ns;
+    }
+    for (int64_t i = 0; i < num_consumers; i++) {
+      consumer_ns[i] += consumer_times[i].end_ns - consumer_times[i].start_ns;
+      consumer_ops[i] += consumer_times[i].ops;
+    }
+  }
+
+  const int64_t produced = state.iterations() * ops;
+  state.SetItemsProcessed(num_producers * produced);
+
+  std::vector<double> producer_rates;
+  for (int64_t i = 0; i < num_producers; i++) {
+    producer_rates.push_back(produced * 1e9
+                             / std::max<int64_t>(producer_ns[i], 1));
+    state.counters["producer" + std::to_string(i) + "_ops_per_sec"]
+        = producer_rates.back();
+  }
+  for (int64_t i = 0; i < num_consumers; i++) {
+    state.counters["consumer" + std::to_string(i) + "_ops_per_sec"]
+        = consumer_ops[i] * 1e9 / std::max<int64_t>(consumer_ns[i], 1);
+  }
+
+  double rate_sum = 0;
+  for (double rate : producer_rates) {
+    rate_sum += rate;
+  }
+  auto [min_rate, max_rate]
+      = std::minmax_element(producer_rates.begin(), producer_rates.end());
+  state.counters["producer_min_share"] = *min_rate / rate_sum;
+  state.counters["producer_max_share"] = *max_rate / rate_sum;
+  auto [min_ops, max_ops]
+      = std::minmax_element(consumer_ops.begin(), consumer_ops.end());
+  state.counters["consumer_min_share"]
+      = static_cast<double>(*min_ops) / (num_producers * produced);
+  state.counters["consumer_max_share"]
+      = static_cast<double>(*max_ops) / (num_producers * produced);
+}
+
+static void fixed_work_args(benchmark::internal::Benchmark* b) {
+  b->ArgNames({"producers", "consumers", "ops"});
+  for (auto [producers, consumers] :
+       {std::pair{1, 1}, std::pair{4, 1}, std::pair{1, 4}, std::pair{4, 4}}) {
+    b->Args({producers, consumers, 100000});
+  }
+}
+
+static void fixed_work_single_consumer_args(
+    benchmark::internal::Benchmark* b) {
+  b->ArgNames({"producers", "consumers", "ops"})
+      ->Args({1, 1, 100000})
+      ->Args({4, 1, 100000});
+}
+
+#define FIXED_WORK_BENCHMARKS(QType, args)                            \
+  BENCHMARK_TEMPLATE(BM_fixed_work, QType, /*kUseTry=*/false)         \
+      ->Apply(args)                                                   \
+      ->UseManualTime();                                              \
+  BENCHMARK_TEMPLATE(BM_fixed_work, QType, /*kUseTry=*/true)          \
+      ->Apply(args)                                                   \
+      ->UseManualTime()
+
+FIXED_WORK_BENCHMARKS(MPMCQueueAdaptor<1024>, fixed_work_args);
+FIXED_WORK_BENCHMARKS(BoundedMPSCQueueAdaptor<1024>,
+                      fixed_work_single_consumer_args);
+FIXED_WORK_BENCHMARKS(AtomicQueueAdaptor1<>, fixed_work_args);
+FIXED_WORK_BENCHMARKS(MutexDequeAdaptor<>, fixed_work_args);
+
+template <size_t kBytes>
+struct Message {
+  std::array<uint64_t, kBytes / sizeof(uint64_t)> words{};
+};
+
+// Stores each message in its slot.
+template <size_t kBytes>
+struct InPlaceMessageAdaptor {
+  void push(const Message<kBytes>& m) { queue.push(m); }
+
+  Message<kBytes> pop() { return *queue.pop(); }
+
+  MPMCQueue<Message<kBytes>, 1024> queue;
+};
+
+// Heap-allocates each message and passes a pointer to it, which is what
+// MPMCQueue required before it could hold values larger than 8 bytes.
+template <size_t kBytes>
+struct PointerMessageAdaptor {
+  void push(const Message<kBytes>& m) {
+    queue.push(new Message<kBytes>{m});
+  }
+
+  Message<kBytes> pop() {
+    std::unique_ptr<Message<kBytes>> m{*queue.pop()};
+    return *m;
+  }
+
+  MPMCQueue<Message<kBytes>*, 1024> queue;
+};
+
+// Like PointerMessageAdaptor, but the messages come from an ObjectPool, so a
+// consumer's frees go back to the producer in batches.
+template <size_t kBytes>
+struct PooledMessageAdaptor {
+  void push(const Message<kBytes>& m) { queue.push(pool.make(m)); }
+
+  Message<kBytes> pop() {
+    Message<kBytes>* p = *queue.pop();
+    Message<kBytes> m = *p;
+    pool.destroy(p);
+    return m;
+  }
+
+  ObjectPool<Message<kBytes>> pool;
+  MPMCQueue<Message<kBytes>*, 1024> queue;
+};
+
+// Like producer_consumer, but the consumers read every word of each message.
+template <typename QType, size_t kBytes>
+static void message_producer_consumer(benchmark::State& state, int threads) {
+  static constexpr uint64_t kEnd = ~uint64_t{0};
+  QType queue{};
+
+  std::atomic<bool> done{false};
+  std::mutex mu;
+
+  auto consumer_work = [&]() {
+    uint64_t sum = 0;
+    while (true) {
+      Message<kBytes> m = queue.pop();
+      if (m.words[0] == kEnd) {
+        break;
+      }
+      for (uint64_t w : m.words) {
+        sum += w;
+      }
+    }
+    benchmark::DoNotOptimize(sum);
+  };
+
+  std::vector<std::thread> consumers;
+  for (int i = 0; i < threads; i++) {
+    consumers.push_back(std::thread{consumer_work});
+  }
+
+  auto producer_work = [&]() {
+    const size_t kBatchSize = 10000;
+    Message<kBytes> m;
+    while (true) {
+      {
+        std::lock_guard l{mu};
+        if (done.load(std::memory_order::acquire)
+            || !state.KeepRunningBatch(kBatchSize)) {
+          done.store(true, std::memory_order::release);
+          return;
+        }
+      }
+
+      for (size_t i = 0; i < kBatchSize; i++) {
+        m.words[0] = i;
+        queue.push(m);
+      }
+    }
+  };
+
+  std::vector<std::thread> producers;
+  for (int i = 0; i < threads; i++) {
+    producers.push_back(std::thread{producer_work});
+  }
+
+  for (auto& p : producers) {
+    p.join();
+  }
+
+  Message<kBytes> end;
+  end.words[0] = kEnd;
+  for (int i = 0; i < threads; i++) {
+    queue.push(end);
+  }
+
+  for (auto& c : consumers) {
+    c.join();
+  }
+
+  state.SetBytesProcessed(state.iterations() * kBytes);
+}
+
+template <template <size_t> typename QType, size_t kBytes>
+static void BM_message_size(benchmark::State& state) {
+  message_producer_consumer<QType<kBytes>, kBytes>(state, state.range(0));
+}
+BENCHMARK_TEMPLATE(BM_message_size, InPlaceMessageAdaptor, 16)
+    ->ArgName("threads")
+    ->Arg(1)->Arg(2)->Arg(4)->Arg(8);
+BENCHMARK_TEMPLATE(BM_message_size, PointerMessageAdaptor, 16)
+    ->ArgName("threads")
+    ->Arg(1)->Arg(2)->Arg(4)->Arg(8);
+BENCHMARK_TEMPLATE(BM_message_size, PooledMessageAdaptor, 16)
+    ->ArgName("threads")
+    ->Arg(1)->Arg(2)->Arg(4)->Arg(8);
+BENCHMARK_TEMPLATE(BM_message_size, InPlaceMessageAdaptor, 64)
+    ->ArgName("threads")
+    ->Arg(1)->Arg(2)->Arg(4)->Arg(8);
+BENCHMARK_TEMPLATE(BM_message_size, PointerMessageAdaptor, 64)
+    ->ArgName("threads")
+    ->Arg(1)->Arg(2)->Arg(4)->Arg(8);
+BENCHMARK_TEMPLATE(BM_message_size, PooledMessageAdaptor, 64)
+    ->ArgName("threads")
+    ->Arg(1)->Arg(2)->Arg(4)->Arg(8);
+BENCHMARK_TEMPLATE(BM_message_size, InPlaceMessageAdaptor, 256)
+    ->ArgName("threads")
+    ->Arg(1)->Arg(2)->Arg(4)->Arg(8);
+BENCHMARK_TEMPLATE(BM_message_size, PointerMessageAdaptor, 256)
+    ->ArgName("threads")
+    ->Arg(1)->Arg(2)->Arg(4)->Arg(8);
+BENCHMARK_TEMPLATE(BM_message_size, PooledMessageAdaptor, 256)
+    ->ArgName("threads")
+    ->Arg(1)->Arg(2)->Arg(4)->Arg(8);
+
+// The owner of a WorkStealingDeque pushes every item and pops one after every
+// `pop_every` pushes (never if 0), while `thieves` threads steal. Like a
+// fork/join worker, the owner also pops whenever more than 1024 items are
+// waiting. Reports the fraction of items that were stolen.
+static void deque_workload(benchmark::State& state,
+                           int thieves,
+                           int pop_every,
+                           bool steal_half) {
+  WorkStealingDeque<int*> deque{QueueOpts{}.set_max_size(1024)};
+  std::atomic<bool> done{false};
+  std::atomic<int64_t> stolen{0};
+
+  auto thief_work = [&]() {
+    std::array<int*, 32> out;
+    int64_t count = 0;
+    while (!done.load(std::memory_order::relaxed)) {
+      size_t n = 0;
+      if (steal_half) {
+        n = deque.steal_half(out.data(), out.size());
+      } else if (deque.steal()) {
+        n = 1;
+      }
+      if (n == 0) {
+        atomic_queue::spin_loop_pause();
+      }
+      count += n;
+    }
+    stolen.fetch_add(count, std::memory_order::relaxed);
+  };
+  std::vector<std::thread> threads;
+  for (int i = 0; i < thieves; i++) {
+    threads.emplace_back(thief_work);
+  }
+
+  const size_t kBatchSize = 10000;
+  int foo;
+  while (state.KeepRunningBatch(kBatchSize)) {
+    for (size_t i = 0; i < kBatchSize; i++) {
+      deque.push(&foo);
+      if ((pop_every > 0 && i % pop_every == 0) || deque.size() > 1024) {
+        benchmark::DoNotOptimize(deque.pop());
+      }
+    }
+  }
+  while (deque.pop()) {
+  }
+  done.store(true, std::memory_order::relaxed);
+  for (auto& t : threads) {
+    t.join();
+  }
+
+  state.counters["stolen"] = benchmark::Counter(
+      static_cast<double>(stolen.load()) / state.iterations());
+}
+
+// A single worker that pushes and pops its own work, against a single thread
+// pushing and popping an MPMCQueue.
+static void BM_deque_owner_only(benchmark::State& state) {
+  deque_workload(state, /*thieves=*/0, /*pop_every=*/1, false);
+}
+BENCHMARK(BM_deque_owner_only);
+
+static void BM_mpmc_owner_only(benchmark::State& state) {
+  MPMCQueue<int*, 1024> queue;
+  int foo;
+  for (auto _ : state) {
+    queue.push(&foo);
+    benchmark::DoNotOptimize(queue.pop());
+  }
+}
+BENCHMARK(BM_mpmc_owner_only);
+
+// The owner only pops when it has fallen behind, so the thieves take most of
+// the work.
+static void BM_deque_steal_heavy(benchmark::State& state) {
+  deque_workload(state, state.range(0), /*pop_every=*/0, state.range(1));
+}
+BENCHMARK(BM_deque_steal_heavy)
+    ->ArgNames({"thieves", "steal_half"})
+    ->ArgsProduct({{1, 2, 4, 8}, {0, 1}});
+
+// The owner pops every other item it pushes while thieves steal the rest.
+static void BM_deque_mixed(benchmark::State& state) {
+  deque_workload(state, state.range(0), /*pop_every=*/2, state.range(1));
+}
+BENCHMARK(BM_deque_mixed)
+    ->ArgNames({"thieves", "steal_half"})
+    ->ArgsProduct({{1, 2, 4, 8}, {0, 1}});
+
+// Busy-waits for kTaskNs, or does nothing if it's 0.
+template <int64_t kTaskNs>
+class SpinTask : public Task {
+ protected:
+  void run() override {
+    if constexpr (kTaskNs > 0) {
+      int64_t end = now_ns() + kTaskNs;
+      while (now_ns() < end) {
+      }
+    }
+  }
+};
+
+// Submits batches of 1024 tasks with one submit_bulk() each and waits for
+// every one of them.
+template <int64_t kTaskNs>
+static void BM_thread_pool_throughput(benchmark::State& state) {
+  ThreadPool pool{ThreadPoolOpts{}.set_num_workers(state.range(0))};
+  std::vector<SpinTask<kTaskNs>> tasks(1024);
+  std::vector<Task*> ptrs;
+  for (auto& task : tasks) {
+    ptrs.push_back(&task);
+  }
+
+  while (state.KeepRunningBatch(tasks.size())) {
+    pool.submit_bulk(ptrs);
+    for (auto& task : tasks) {
+      task.wait();
+    }
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK_TEMPLATE(BM_thread_pool_throughput, 0)
+    ->ArgName("workers")
+    ->RangeMultiplier(2)
+    ->Range(1, 64)
+    ->UseRealTime();
+BENCHMARK_TEMPLATE(BM_thread_pool_throughput, 1000)
+    ->ArgName("workers")
+    ->RangeMultiplier(2)
+    ->Range(1, 64)
+    ->UseRealTime();
+
+// Submits one task at a time and waits for it, so each iteration is the time
+// from submit() until the submitter sees the task done.
+template <int64_t kTaskNs>
+static void BM_thread_pool_latency(benchmark::State& state) {
+  ThreadPool pool{ThreadPoolOpts{}.set_num_workers(state.range(0))};
+  SpinTask<kTaskNs> task;
+  for (auto _ : state) {
+    pool.submit(task);
+    task.wait();
+  }
+}
+BENCHMARK_TEMPLATE(BM_thread_pool_latency, 0)
+    ->ArgName("workers")
+    ->RangeMultiplier(2)
+    ->Range(1, 64)
+    ->UseRealTime();
+BENCHMARK_TEMPLATE(BM_thread_pool_latency, 1000)
+    ->ArgName("workers")
+    ->RangeMultiplier(2)
+    ->Range(1, 64)
+    ->UseRealTime();
+
+// A coroutine that starts right away and destroys itself when it finishes.
+struct Detached {
+  struct promise_type {
+    Detached get_return_object() { return {}; }
+    std::suspend_never initial_suspend() { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception() { std::terminate(); }
+  };
+};
+
+// Resumes coroutines on a thread of its own, which parks in MPMCQueue::pop()
+// while there is nothing to run.
+class ThreadExecutor {
+ public:
+  ThreadExecutor()
+      : thread_([this]() {
+          while (auto h = handles_.pop()) {
+            std::coroutine_handle<>::from_address(*h).resume();
+          }
+        }) {}
+
+  ~ThreadExecutor() {
+    handles_.close();
+    thread_.join();
+  }
+
+  void execute(std::coroutine_handle<> h) { handles_.push(h.address()); }
+
+ private:
+  MPMCQueue<void*, 1024> handles_;
+  std::thread thread_;
+};
+
+// Round trips from the benchmark thread to a consumer and back. The consumer
+// is a thread blocked in pop(), so every request wakes a parked thread.
+static void BM_handoff_thread(benchmark::State& state) {
+  MPMCQueue<int, 16> request;
+  MPMCQueue<int, 16> response;
+  std::thread consumer{[&]() {
+    while (auto v = request.pop()) {
+      response.push(*v);
+    }
+  }};
+
+  for (auto _ : state) {
+    request.push(1);
+    benchmark::DoNotOptimize(response.pop());
+  }
+  request.close();
+  consumer.join();
+}
+BENCHMARK(BM_handoff_thread)->UseRealTime();
+
+// Like BM_handoff_thread, but the consumer is a coroutine suspended in
+// async_pop(). With InlineExecutor it resumes on the benchmark thread, which
+// measures just the suspend and resume. With ThreadExecutor it crosses
+// threads like BM_handoff_thread does.
+template <typename E>
+static void BM_handoff_coroutine(benchmark::State& state) {
+  MPMCQueue<int, 16> request;
+  MPMCQueue<int, 16> response;
+  E executor;
+  auto consumer = [&]() -> Detached {
+    while (auto v = co_await request.async_pop(executor)) {
+      response.push(*v);
+    }
+  };
+  consumer();
+
+  for (auto _ : state) {
+    request.push(1);
+    benchmark::DoNotOptimize(response.pop());
+  }
+  // Completes the consumer's last pop, so it finishes before the queues go.
+  request.close();
+}
+BENCHMARK_TEMPLATE(BM_handoff_coroutine, InlineExecutor)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_handoff_coroutine, ThreadExecutor)->UseRealTime();
+
+// Only the lowest of kLanes lanes has values, which is the worst case for a
+// consumer that tries every lane from the top. PriorityQueue finds it from its
+// bitmap instead.
+template <size_t kLanes>
+static void BM_priority_pop(benchmark::State& state) {
+  PriorityQueue<int*, kLanes, 1024> queue;
+  int foo;
+  for (auto _ : state) {
+    queue.push(0, &foo);
+    benchmark::DoNotOptimize(queue.try_pop());
+  }
+}
+BENCHMARK_TEMPLATE(BM_priority_pop, 1);
+BENCHMARK_TEMPLATE(BM_priority_pop, 2);
+BENCHMARK_TEMPLATE(BM_priority_pop, 4);
+BENCHMARK_TEMPLATE(BM_priority_pop, 8);
+BENCHMARK_TEMPLATE(BM_priority_pop, 16);
+BENCHMARK_TEMPLATE(BM_priority_pop, 32);
+BENCHMARK_TEMPLATE(BM_priority_pop, 64);
+
+// kLanes separate MPMCQueues that a consumer scans from the top.
+template <size_t kLanes>
+static void BM_priority_pop_scan(benchmark::State& state) {
+  std::array<std::optional<MPMCQueue<int*, 1024>>, kLanes> lanes;
+  for (auto& lane : lanes) {
+    lane.emplace();
+  }
+  int foo;
+  for (auto _ : state) {
+    lanes[0]->push(&foo);
+    for (size_t i = kLanes; i-- > 0;) {
+      if (auto v = lanes[i]->try_pop()) {
+        benchmark::DoNotOptimize(v);
+        break;
+      }
+    }
+  }
+}
+BENCHMARK_TEMPLATE(BM_priority_pop_scan, 1);
+BENCHMARK_TEMPLATE(BM_priority_pop_scan, 2);
+BENCHMARK_TEMPLATE(BM_priority_pop_scan, 4);
+BENCHMARK_TEMPLATE(BM_priority_pop_scan, 8);
+BENCHMARK_TEMPLATE(BM_priority_pop_scan, 16);
+BENCHMARK_TEMPLATE(BM_priority_pop_scan, 32);
+BENCHMARK_TEMPLATE(BM_priority_pop_scan, 64);
+
+// Two one-way channels between the benchmark process and a child it forks:
+// "down" to the child and "up" from it.
+class ShmChannel {
+ public:
+  ShmChannel()
+      : down_(SharedMemoryQueue<uint64_t>::create(1024).value()),
+        up_(SharedMemoryQueue<uint64_t>::create(1024).value()) {}
+
+  void send_down(uint64_t v) { down_.push(v); }
+  uint64_t recv_down() { return down_.pop(); }
+  void send_up(uint64_t v) { up_.push(v); }
+  uint64_t recv_up() { return up_.pop(); }
+
+ private:
+  SharedMemoryQueue<uint64_t> down_;
+  SharedMemoryQueue<uint64_t> up_;
+};
+
+// The same over a Unix socketpair, with a syscall for every message.
+class SocketChannel {
+ public:
+  SocketChannel() {
+    int ret = socketpair(AF_UNIX, SOCK_STREAM, 0, fds_);
+    CHECK(ret == 0);
+  }
+
+  ~SocketChannel() {
+    close(fds_[0]);
+    close(fds_[1]);
+  }
+
+  void send_down(uint64_t v) { send(fds_[0], v); }
+  uint64_t recv_down() { return recv(fds_[1]); }
+  void send_up(uint64_t v) { send(fds_[1], v); }
+  uint64_t recv_up() { return recv(fds_[0]); }
+
+ private:
+  int fds_[2];
+
+  static void send(int fd, uint64_t v) {
+    ssize_t n = write(fd, &v, sizeof(v));
+    CHECK(n == sizeof(v));
+  }
+
+  static uint64_t recv(int fd) {
+    uint64_t v;
+    size_t got = 0;
+    while (got < sizeof(v)) {
+      ssize_t n = read(fd, reinterpret_cast<char*>(&v) + got, sizeof(v) - got);
+      CHECK(n > 0);
+      got += n;
+    }
+    return v;
+  }
+};
+
+// Runs `child` in a forked process, which exits when it returns.
+template <typename F>
+static pid_t fork_child(F&& child) {
+  pid_t pid = fork();
+  CHECK(pid >= 0);
+  if (pid == 0) {
+    child();
+    _exit(0);
+  }
+  return pid;
+}
+
+// Streams values to a child process, which acknowledges every batch so that
+// the time covers its pops too.
+template <typename Channel>
+static void BM_interprocess_throughput(benchmark::State& state) {
+  constexpr uint64_t kBatch = 4096;
+  Channel channel;
+  pid_t child = fork_child([&]() {
+    uint64_t received = 0;
+    while (channel.recv_down() != 0) {
+      if (++received % kBatch == 0) {
+        channel.send_up(received);
+      }
+    }
+  });
+
+  uint64_t sent = 0;
+  for (auto _ : state) {
+    for (uint64_t i = 0; i < kBatch; i++) {
+      channel.send_down(++sent);
+    }
+    benchmark::DoNotOptimize(channel.recv_up());
+  }
+  channel.send_down(0);
+  waitpid(child, nullptr, 0);
+  state.SetItemsProcessed(state.iterations() * kBatch);
+}
+BENCHMARK_TEMPLATE(BM_interprocess_throughput, ShmChannel)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_interprocess_throughput, SocketChannel)->UseRealTime();
+
+// Round trips to a child process that echoes every value back.
+template <typename Channel>
+static void BM_interprocess_latency(benchmark::State& state) {
+  Channel channel;
+  pid_t child = fork_child([&]() {
+    while (uint64_t v = channel.recv_down()) {
+      channel.send_up(v);
+    }
+  });
+
+  uint64_t sent = 0;
+  int64_t start = now_ns();
+  for (auto _ : state) {
+    channel.send_down(++sent);
+    benchmark::DoNotOptimize(channel.recv_up());
+  }
+  int64_t elapsed_ns = now_ns() - start;
+  channel.send_down(0);
+  waitpid(child, nullptr, 0);
+  state.counters["one_way_ns"]
+      = static_cast<double>(elapsed_ns) / (2 * state.iterations());
+}
+BENCHMARK_TEMPLATE(BM_interprocess_latency, ShmChannel)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_interprocess_latency, SocketChannel)->UseRealTime();
+
+// Values pushed while the ring is full go to the spill file. Reports the
+// bandwidth of those appends.
+template <size_t kBytes>
+static void BM_spill_write(benchmark::State& state) {
+  constexpr size_t kBatch = 16384;
+  SpillingQueue<Message<kBytes>, 1024> queue;
+  Message<kBytes> m;
+  for (size_t i = 0; i < queue.capacity(); i++) {
+    queue.push(m);
+  }
+  for (auto _ : state) {
+    for (size_t i = 0; i < kBatch; i++) {
+      queue.push(m);
+    }
+    state.PauseTiming();
+    while (queue.spilled() > 0) {
+      queue.try_pop();
+    }
+    state.ResumeTiming();
+  }
+  state.SetBytesProcessed(state.iterations() * kBatch * kBytes);
+}
+BENCHMARK_TEMPLATE(BM_spill_write, 16);
+BENCHMARK_TEMPLATE(BM_spill_write, 256);
+
+// Pops a spilled backlog, which reads the spill file back through the ring.
+template <size_t kBytes>
+static void BM_spill_refill(benchmark::State& state) {
+  constexpr size_t kBatch = 16384;
+  SpillingQueue<Message<kBytes>, 1024> queue;
+  Message<kBytes> m;
+  for (auto _ : state) {
+    state.PauseTiming();
+    for (size_t i = 0; i < kBatch; i++) {
+      queue.push(m);
+    }
+    state.ResumeTiming();
+    for (size_t i = 0; i < kBatch; i++) {
+      benchmark::DoNotOptimize(queue.try_pop());
+    }
+  }
+  state.SetBytesProcessed(state.iterations() * kBatch * kBytes);
+}
+BENCHMARK_TEMPLATE(BM_spill_refill, 16);
+BENCHMARK_TEMPLATE(BM_spill_refill, 256);
+
+// Push and pop while the ring has room, for comparison with a plain
+// MPMCQueue.
+template <typename QType>
+static void BM_spill_fast_path(benchmark::State& state) {
+  QType queue;
+  for (auto _ : state) {
+    queue.push(1);
+    benchmark::DoNotOptimize(queue.try_pop());
+  }
+}
+BENCHMARK_TEMPLATE(BM_spill_fast_path, MPMCQueue<uint64_t, 1024>);
+BENCHMARK_TEMPLATE(BM_spill_fast_path, SpillingQueue<uint64_t, 1024>);
+
+// One thread pushes and pops with a backlog of kBacklog values, so that the
+// unbounded queue keeps filling, linking and reclaiming rings.
+template <typename QType, size_t kBacklog>
+static void BM_steady_backlog(benchmark::State& state) {
+  QType queue;
+  int foo;
+  for (size_t i = 0; i < kBacklog; i++) {
+    queue.push(&foo);
+  }
+  for (auto _ : state) {
+    queue.push(&foo);
+    benchmark::DoNotOptimize(queue.try_pop());
+  }
+}
+BENCHMARK_TEMPLATE(BM_steady_backlog, MPMCQueueAdaptor<1024>, 512);
+BENCHMARK_TEMPLATE(BM_steady_backlog, UnboundedMPMCQueueAdaptor, 512);
+BENCHMARK_TEMPLATE(BM_steady_backlog, UnboundedMPMCQueueAdaptor, 100000);
+
 }  // namespace theta
 
 BENCHMARK_MAIN();
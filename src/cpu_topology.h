@@ -0,0 +1,297 @@
+#pragma once
+
+#include <sched.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <thread>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include "defs.h"
+#include "numa_topology.h"
+
+namespace theta {
+
+// Where to run two groups of threads, such as producers and consumers,
+// relative to each other and to the hardware.
+enum class Placement {
+  // Leaves every thread to the scheduler.
+  kNone,
+  // Fills both SMT siblings of a core, then the other cores under the same L3
+  // cache, before moving on to the next one.
+  kCompact,
+  // Gives every thread a core of its own, alternating between L3 caches, and
+  // only uses SMT siblings once every core has a thread.
+  kScatter,
+  // Runs the ith thread of each group on the two SMT siblings of one core.
+  kSmtPairs,
+  // Runs the first group under one L3 cache and the second under another.
+  kCrossL3,
+};
+
+inline std::string_view placement_name(Placement placement) {
+  switch (placement) {
+    case Placement::kNone:
+      return "unpinned";
+    case Placement::kCompact:
+      return "compact";
+    case Placement::kScatter:
+      return "scatter";
+    case Placement::kSmtPairs:
+      return "smt-pairs";
+    case Placement::kCrossL3:
+      return "cross-l3";
+  }
+  return "unknown";
+}
+
+// The online CPUs of a machine, with the physical core and the L3 cache that
+// each belongs to.
+class CpuTopology {
+ public:
+  struct Cpu {
+    int id;
+    // Dense indices. CPUs with the same core are SMT siblings. Machines
+    // without an L3 cache get one domain per package.
+    int core;
+    int l3;
+  };
+
+  explicit CpuTopology(std::vector<Cpu> cpus) : cpus_(std::move(cpus)) {
+    CHECK(!cpus_.empty());
+  }
+
+  // Reads the CPUs under `root`, which is normally /sys/devices/system/cpu.
+  // Without it, every CPU counts as its own core under a single L3.
+  static CpuTopology from_sysfs(
+      const std::filesystem::path& root = "/sys/devices/system/cpu") {
+    std::vector<int> online
+        = NumaTopology::parse_cpulist(read_line(root / "online"));
+    if (online.empty()) {
+      std::vector<Cpu> cpus;
+      for (unsigned i = 0;
+           i < std::max(1u, std::thread::hardware_concurrency());
+           i++) {
+        cpus.push_back({.id = static_cast<int>(i),
+                        .core = static_cast<int>(i),
+                        .l3 = 0});
+      }
+      return CpuTopology{std::move(cpus)};
+    }
+
+    std::map<std::pair<std::string, std::string>, int> cores;
+    std::map<std::string, int> l3s;
+    std::vector<Cpu> cpus;
+    for (int id : online) {
+      auto dir = root / ("cpu" + std::to_string(id));
+      std::string package = read_line(dir / "topology/physical_package_id");
+      std::string core_id = read_line(dir / "topology/core_id");
+      std::string l3 = "package " + package;
+      std::error_code ec;
+      for (const auto& index :
+           std::filesystem::directory_iterator(dir / "cache", ec)) {
+        if (read_line(index.path() / "level") == "3") {
+          l3 = read_line(index.path() / "shared_cpu_list");
+          break;
+        }
+      }
+      auto core = cores.try_emplace({package, core_id}, cores.size()).first;
+      auto domain = l3s.try_emplace(l3, l3s.size()).first;
+      cpus.push_back({.id = id, .core = core->second, .l3 = domain->second});
+    }
+    return CpuTopology{std::move(cpus)};
+  }
+
+  const std::vector<Cpu>& cpus() const { return cpus_; }
+
+  // Whether the machine has the boundary that `placement` puts threads
+  // across. Other placements still return CPUs, but not ones that cross it.
+  bool supports(Placement placement) const {
+    switch (placement) {
+      case Placement::kSmtPairs:
+        return !smt_cores().empty();
+      case Placement::kCrossL3:
+        return num_l3s() > 1;
+      default:
+        return true;
+    }
+  }
+
+  // The CPUs for `first` threads of one group followed by `second` of the
+  // other, reusing CPUs once there are more threads than fit. Empty for
+  // kNone.
+  std::vector<int> place(Placement placement,
+                         size_t first,
+                         size_t second) const {
+    std::vector<int> result;
+    switch (placement) {
+      case Placement::kNone:
+        break;
+      case Placement::kCompact:
+      case Placement::kScatter: {
+        std::vector<int> order = placement == Placement::kCompact
+                                   ? compact_order()
+                                   : scatter_order();
+        for (size_t i = 0; i < first + second; i++) {
+          result.push_back(order[i % order.size()]);
+        }
+        break;
+      }
+      case Placement::kSmtPairs: {
+        std::vector<std::vector<int>> cores = smt_cores();
+        if (cores.empty()) {
+          // Neighbouring CPUs are the closest there is.
+          std::vector<int> order = compact_order();
+          for (size_t i = 0; i < order.size(); i++) {
+            cores.push_back({order[i], order[(i + 1) % order.size()]});
+          }
+        }
+        for (size_t i = 0; i < first; i++) {
+          result.push_back(cores[i % cores.size()][0]);
+        }
+        for (size_t i = 0; i < second; i++) {
+          result.push_back(cores[i % cores.size()][1]);
+        }
+        break;
+      }
+      case Placement::kCrossL3: {
+        std::vector<int> order = compact_order();
+        std::vector<int> near;
+        std::vector<int> far;
+        int first_l3 = l3_of(order[0]);
+        int second_l3
+            = num_l3s() > 1 ? (first_l3 + 1) % num_l3s() : first_l3;
+        for (int cpu : order) {
+          if (l3_of(cpu) == first_l3) {
+            near.push_back(cpu);
+          }
+          if (l3_of(cpu) == second_l3) {
+            far.push_back(cpu);
+          }
+        }
+        for (size_t i = 0; i < first; i++) {
+          result.push_back(near[i % near.size()]);
+        }
+        for (size_t i = 0; i < second; i++) {
+          // With a single L3, share its CPUs without doubling up early.
+          result.push_back(far[(first_l3 == second_l3 ? first + i : i)
+                               % far.size()]);
+        }
+        break;
+      }
+    }
+    return result;
+  }
+
+  // Pins the calling thread to `cpu`. Returns false if that isn't allowed.
+  static bool pin_to(int cpu) {
+    if (cpu < 0 || cpu >= CPU_SETSIZE) {
+      return false;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return sched_setaffinity(0, sizeof(set), &set) == 0;
+  }
+
+ private:
+  std::vector<Cpu> cpus_;
+
+  int num_l3s() const {
+    int max = 0;
+    for (const Cpu& cpu : cpus_) {
+      max = std::max(max, cpu.l3);
+    }
+    return max + 1;
+  }
+
+  int l3_of(int id) const {
+    for (const Cpu& cpu : cpus_) {
+      if (cpu.id == id) {
+        return cpu.l3;
+      }
+    }
+    return 0;
+  }
+
+  // How many siblings of the same core come before `cpu`.
+  int sibling_rank(const Cpu& cpu) const {
+    return std::count_if(cpus_.begin(), cpus_.end(), [&](const Cpu& other) {
+      return other.core == cpu.core && other.id < cpu.id;
+    });
+  }
+
+  std::vector<int> compact_order() const {
+    std::vector<Cpu> sorted = cpus_;
+    std::sort(sorted.begin(), sorted.end(), [](const Cpu& a, const Cpu& b) {
+      return std::tie(a.l3, a.core, a.id) < std::tie(b.l3, b.core, b.id);
+    });
+    return ids(sorted);
+  }
+
+  std::vector<int> scatter_order() const {
+    // Each core's rank among the cores of its L3, so that the ith core of
+    // every L3 comes before the (i + 1)th of any.
+    std::map<int, int> core_rank;
+    std::map<int, int> cores_in_l3;
+    for (const Cpu& cpu : cpus_) {
+      if (!core_rank.contains(cpu.core)) {
+        core_rank[cpu.core] = cores_in_l3[cpu.l3]++;
+      }
+    }
+    std::vector<Cpu> sorted = cpus_;
+    std::sort(sorted.begin(), sorted.end(), [&](const Cpu& a, const Cpu& b) {
+      return std::tuple{sibling_rank(a), core_rank[a.core], a.l3, a.id}
+           < std::tuple{sibling_rank(b), core_rank[b.core], b.l3, b.id};
+    });
+    return ids(sorted);
+  }
+
+  // The first two siblings of every core that has them, in compact order.
+  std::vector<std::vector<int>> smt_cores() const {
+    std::map<int, std::vector<int>> siblings;
+    std::vector<int> core_order;
+    for (int id : compact_order()) {
+      int core = std::find_if(cpus_.begin(),
+                              cpus_.end(),
+                              [&](const Cpu& cpu) { return cpu.id == id; })
+                     ->core;
+      if (siblings[core].empty()) {
+        core_order.push_back(core);
+      }
+      siblings[core].push_back(id);
+    }
+    std::vector<std::vector<int>> cores;
+    for (int core : core_order) {
+      if (siblings[core].size() >= 2) {
+        cores.push_back({siblings[core][0], siblings[core][1]});
+      }
+    }
+    return cores;
+  }
+
+  static std::vector<int> ids(const std::vector<Cpu>& cpus) {
+    std::vector<int> result;
+    for (const Cpu& cpu : cpus) {
+      result.push_back(cpu.id);
+    }
+    return result;
+  }
+
+  static std::string read_line(const std::filesystem::path& path) {
+    std::ifstream in{path};
+    std::string line;
+    std::getline(in, line);
+    return line;
+  }
+};
+
+}  // namespace theta
@@ -1,5 +1,34 @@
 #pragma once
 
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <type_traits>
+
+// Aborts with the failed condition unless `cond` holds. DCHECK only checks in
+// debug builds. A logging library that defines these first takes precedence.
+#ifndef CHECK
+#define CHECK(cond)                             \
+  do {                                          \
+    if (!(cond)) {                              \
+      std::fprintf(stderr,                      \
+                   "%s:%d: CHECK failed: %s\n", \
+                   __FILE__,                    \
+                   __LINE__,                    \
+                   #cond);                      \
+      std::abort();                             \
+    }                                           \
+  } while (false)
+#endif
+
+#ifndef DCHECK
+#define DCHECK(cond) assert(cond)
+#endif
+
 #ifdef __cpp_lib_hardware_interference_size
 using std::hardware_constructive_interference_size;
 using std::hardware_destructive_interference_size;
@@ -24,6 +53,12 @@ concept AtomType = requires(T t) {
   sizeof(T) <= 8;
 };
 
+// Values that fit in 8 bytes next to a 64 bit tag, so that both can be
+// exchanged as a single 16 byte word.
+template <typename T>
+concept PackableType = std::is_trivially_copyable_v<T>
+                    && std::is_default_constructible_v<T> && sizeof(T) <= 8;
+
 template <typename T>
 static constexpr bool memset0_to_bool() {
   T t;
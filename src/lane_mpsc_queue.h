@@ -0,0 +1,291 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <concepts>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <new>
+#include <optional>
+#include <utility>
+
+#include "defs.h"
+#include "queue_opts.h"
+#include "wait_strategy.h"
+
+namespace theta {
+
+// Multiple-producer, single-consumer, with a private single-producer ring
+// ("lane") for every registered producer. A producer only ever writes its own
+// lane's cache lines, so pushes don't contend with each other. The consumer
+// sweeps the lanes round-robin.
+//
+// Items from one producer are popped in the order they were pushed, but there
+// is no order across producers. Only one thread may pop at a time.
+//
+// QueueOpts::max_size() sets the capacity of each lane, rounded up to a power
+// of two, and QueueOpts::max_producers() sets the number of lanes.
+template <std::movable T>
+class LaneMPSCQueue {
+  struct Slot {
+    alignas(T) std::byte storage[sizeof(T)];
+
+    T* value() { return std::launder(reinterpret_cast<T*>(storage)); }
+  };
+
+  struct Lane {
+    // Written by the lane's producer.
+    alignas(hardware_destructive_interference_size) std::atomic<uint64_t> tail{
+        0};
+    uint64_t cached_head{0};
+    std::atomic<bool> owned{false};
+
+    // Written by the consumer.
+    alignas(hardware_destructive_interference_size) std::atomic<uint64_t> head{
+        0};
+    uint64_t cached_tail{0};
+  };
+
+ public:
+  // Gives its holder the right to push to one lane. A token must not outlive
+  // its queue, and only one thread may use it at a time. Destroying the token
+  // hands the lane to the next producer that registers, after any items that
+  // are still in it.
+  class ProducerToken {
+   public:
+    ProducerToken(ProducerToken&& other)
+        : queue_(other.queue_), lane_(std::exchange(other.lane_, -1)) {}
+
+    ProducerToken& operator=(ProducerToken&& other) {
+      std::swap(queue_, other.queue_);
+      std::swap(lane_, other.lane_);
+      return *this;
+    }
+
+    ~ProducerToken() {
+      if (lane_ >= 0) {
+        queue_->lanes_[lane_].owned.store(false, std::memory_order::release);
+      }
+    }
+
+   private:
+    friend class LaneMPSCQueue;
+
+    ProducerToken(LaneMPSCQueue* queue, int lane)
+        : queue_(queue), lane_(lane) {}
+
+    LaneMPSCQueue* queue_;
+    int lane_;
+  };
+
+  LaneMPSCQueue() : LaneMPSCQueue(QueueOpts{}) {}
+
+  LaneMPSCQueue(QueueOpts opts)
+      : lane_size_(std::bit_ceil(opts.max_size())),
+        num_lanes_(opts.max_producers()),
+        lanes_(std::make_unique<Lane[]>(num_lanes_)),
+        slots_(std::make_unique<Slot[]>(num_lanes_ * lane_size_)) {
+    CHECK(opts.max_size());
+    CHECK(num_lanes_ > 0 && num_lanes_ <= std::numeric_limits<int>::max());
+  }
+
+  ~LaneMPSCQueue() {
+    for (size_t i = 0; i < num_lanes_; i++) {
+      Lane& lane = lanes_[i];
+      uint64_t tail = lane.tail.load(std::memory_order::acquire);
+      for (uint64_t head = lane.head.load(std::memory_order::relaxed);
+           head != tail;
+           head++) {
+        slot(i, head).value()->~T();
+      }
+    }
+  }
+
+  // Claims a free lane. Fails if every lane is already taken.
+  std::optional<ProducerToken> register_producer() {
+    for (size_t i = 0; i < num_lanes_; i++) {
+      bool owned = false;
+      if (lanes_[i].owned.compare_exchange_strong(owned,
+                                                  true,
+                                                  std::memory_order::acquire,
+                                                  std::memory_order::relaxed)) {
+        // Lanes are claimed lowest first, so the consumer only needs to sweep
+        // the lanes below the highest one that was ever claimed.
+        size_t used = used_lanes_.load(std::memory_order::relaxed);
+        while (used <= i
+               && !used_lanes_.compare_exchange_weak(
+                   used, i + 1, std::memory_order::relaxed)) {
+        }
+        return ProducerToken{this, static_cast<int>(i)};
+      }
+    }
+    return {};
+  }
+
+  // Constructs an item from `val` at the back of the token's lane, unless the
+  // lane is full.
+  template <typename V>
+    requires std::constructible_from<T, V&&>
+  bool try_push(ProducerToken& token, V&& val) {
+    DCHECK(token.queue_ == this);
+    Lane& lane = lanes_[token.lane_];
+    uint64_t tail = lane.tail.load(std::memory_order::relaxed);
+    if (tail - lane.cached_head == lane_size_) {
+      lane.cached_head = lane.head.load(std::memory_order::acquire);
+      if (tail - lane.cached_head == lane_size_) {
+        return false;
+      }
+    }
+
+    new (slot(token.lane_, tail).storage) T(std::forward<V>(val));
+    lane.tail.store(tail + 1, std::memory_order::release);
+    pop_waiters_.notify();
+    return true;
+  }
+
+  // Pushes `val`, waiting until `deadline` for room in the token's lane.
+  template <typename V, typename Clock, typename Duration>
+    requires std::constructible_from<T, V&&>
+  bool push_until(ProducerToken& token,
+                  V&& val,
+                  const std::chrono::time_point<Clock, Duration>& deadline) {
+    Lane& lane = lanes_[token.lane_];
+    while (!try_push(token, std::forward<V>(val))) {
+      if (!push_waiters_.wait_until(deadline, [&]() {
+            return lane.tail.load(std::memory_order::relaxed)
+                       - lane.head.load(std::memory_order::acquire)
+                   < lane_size_;
+          })) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  template <typename V, typename Rep, typename Period>
+    requires std::constructible_from<T, V&&>
+  bool push_for(ProducerToken& token,
+                V&& val,
+                const std::chrono::duration<Rep, Period>& timeout) {
+    return push_until(token,
+                      std::forward<V>(val),
+                      std::chrono::steady_clock::now() + timeout);
+  }
+
+  // Pops the oldest item of the next non-empty lane after the one that was
+  // popped from last.
+  std::optional<T> try_pop() {
+    std::optional<T> val;
+    drain([&val](T&& t) { val.emplace(std::move(t)); }, 1);
+    return val;
+  }
+
+  // Pops an item, waiting until `deadline` for one to arrive.
+  template <typename Clock, typename Duration>
+  std::optional<T> pop_until(
+      const std::chrono::time_point<Clock, Duration>& deadline) {
+    while (true) {
+      if (auto val = try_pop()) {
+        return val;
+      }
+      if (!pop_waiters_.wait_until(deadline,
+                                   [this]() { return size() > 0; })) {
+        return {};
+      }
+    }
+  }
+
+  template <typename Rep, typename Period>
+  std::optional<T> pop_for(const std::chrono::duration<Rep, Period>& timeout) {
+    return pop_until(std::chrono::steady_clock::now() + timeout);
+  }
+
+  // Sweeps the lanes once, starting after the one that was popped from last,
+  // and passes up to `max` items to `callback`. Every lane that has items
+  // gives up all of them, so each lane costs one load of its tail and one
+  // store to its head. Returns the number of items drained.
+  template <typename F>
+    requires std::invocable<F&, T&&>
+  size_t drain(F&& callback, size_t max = std::numeric_limits<size_t>::max()) {
+    size_t used = used_lanes_.load(std::memory_order::relaxed);
+    size_t drained = 0;
+    for (size_t i = 0; i < used && drained < max; i++) {
+      size_t index = next_lane_ + i < used ? next_lane_ + i
+                                           : next_lane_ + i - used;
+      Lane& lane = lanes_[index];
+      uint64_t head = lane.head.load(std::memory_order::relaxed);
+      // Only the consumer's own line is touched while the cached tail covers
+      // the request.
+      if (lane.cached_tail - head < max - drained) {
+        lane.cached_tail = lane.tail.load(std::memory_order::acquire);
+        if (head == lane.cached_tail) {
+          continue;
+        }
+      }
+
+      uint64_t count = std::min<uint64_t>(max - drained,
+                                          lane.cached_tail - head);
+      for (uint64_t j = 0; j < count; j++) {
+        T* v = slot(index, head + j).value();
+        callback(std::move(*v));
+        v->~T();
+      }
+      lane.head.store(head + count, std::memory_order::release);
+      drained += count;
+      next_lane_ = index + 1 < used ? index + 1 : 0;
+    }
+
+    if (drained > 0) {
+      push_waiters_.notify();
+    }
+    return drained;
+  }
+
+  size_t try_pop_n(T* out, size_t max) {
+    return drain([&out](T&& t) { *out++ = std::move(t); }, max);
+  }
+
+  size_t size() const {
+    size_t size = 0;
+    size_t used = used_lanes_.load(std::memory_order::relaxed);
+    for (size_t i = 0; i < used; i++) {
+      uint64_t head = lanes_[i].head.load(std::memory_order::acquire);
+      uint64_t tail = lanes_[i].tail.load(std::memory_order::acquire);
+      // Each counter is loaded on its own, so head may have passed the tail
+      // that was seen.
+      size += tail > head ? tail - head : 0;
+    }
+    return size;
+  }
+
+  // The number of items each lane holds.
+  size_t capacity() const { return lane_size_; }
+
+  size_t max_producers() const { return num_lanes_; }
+
+ private:
+  const size_t lane_size_;
+  const size_t num_lanes_;
+  std::unique_ptr<Lane[]> lanes_;
+  std::unique_ptr<Slot[]> slots_;
+
+  // One past the highest lane that was ever claimed.
+  alignas(hardware_destructive_interference_size) std::atomic<size_t>
+      used_lanes_{0};
+  // Only the consumer touches this.
+  alignas(hardware_destructive_interference_size) size_t next_lane_{0};
+
+  // Only the timed operations wait on these.
+  alignas(hardware_destructive_interference_size) DeadlineWaiter pop_waiters_;
+  alignas(hardware_destructive_interference_size) DeadlineWaiter push_waiters_;
+
+  Slot& slot(size_t lane, uint64_t index) {
+    return slots_[lane * lane_size_ + (index & (lane_size_ - 1))];
+  }
+};
+
+}  // namespace theta
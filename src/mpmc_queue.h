@@ -1,21 +1,68 @@
 #pragma once
 
+#include <algorithm>
 #include <atomic>
+#include <chrono>
 #include <cmath>
+#include <concepts>
+#include <coroutine>
+#include <cstddef>
 #include <cstdint>
+#include <limits>
 #include <memory>
+#include <new>
 #include <optional>
+#include <span>
+#include <stop_token>
 #include <type_traits>
 #include <vector>
 
 #include "defs.h"
 #include "queue_opts.h"
+#include "queue_stats.h"
 #include "types.h"
+#include "wait_strategy.h"
 
 namespace theta {
 
-template <AtomType T, size_t kBufferSize = 128>
+// How many threads may be on one side of a queue at the same time.
+enum class Cardinality { kMany, kSingle };
+
+// When kBufferSize is kRuntimeBufferSize, the buffer holds
+// QueueOpts::max_size() elements rounded up to a power of two.
+//
+// With kMinimizeContention, consecutive tickets are spread across cache lines
+// (see remap_index()) so that threads working on adjacent tickets don't
+// contend on the same line.
+//
+// WaitStrategy decides how push() and pop() wait for a slot's previous owner.
+// See wait_strategy.h.
+//
+// kProducers and kConsumers say whether a side can have more than one thread
+// at a time. A single-threaded side owns its counter, so it reserves tickets
+// with plain loads and stores instead of read-modify-writes, and it only
+// rereads the other side's counter when the copy it cached runs out.
+//
+// Stats counts waits, wake-ups, reservation retries and the occupancy
+// high-water mark for stats(). The default, NoQueueStats, compiles all of it
+// away. See queue_stats.h.
+//
+// A PackableType T shares a 16 byte Data line with its slot's Tag, and both are
+// swapped with one exchange. Any other movable T is constructed in place in a
+// Slot, and the slot's Tag is published only once the value is there.
+template <std::movable T,
+          size_t kBufferSize = kRuntimeBufferSize,
+          bool kMinimizeContention = false,
+          WaitStrategy Waiter = ParkWait,
+          Cardinality kProducers = Cardinality::kMany,
+          Cardinality kConsumers = Cardinality::kMany,
+          StatsPolicy Stats = NoQueueStats>
 class MPMCQueue {
+  using Geometry = BufferGeometry<kBufferSize>;
+  static constexpr bool kPacked = PackableType<T>;
+  static constexpr bool kSingleProducer = kProducers == Cardinality::kSingle;
+  static constexpr bool kSingleConsumer = kConsumers == Cardinality::kSingle;
+
   union Data {
     struct {
       T value;
@@ -38,28 +85,45 @@ class MPMCQueue {
       return *this;
     }
 
-    std::string DebugString() const {
+    std::string DebugString(const Geometry& geometry = Geometry{}) const {
       return "Data{value=" + std::string(bool(value) ? "####" : "null") + ", "
-           + tag.DebugString() + "}";
+           + tag.DebugString(geometry) + "}";
     }
   };
-  static_assert(sizeof(Data) == sizeof(Data::line), "");
-  static_assert(sizeof(Data) == 16, "");
+
+  struct Slot {
+    std::atomic<Tag<kBufferSize>> tag_atomic;
+    alignas(T) std::byte storage[sizeof(T)];
+
+    T* value() { return std::launder(reinterpret_cast<T*>(storage)); }
+  };
+
+  using Cell = std::conditional_t<kPacked, Data, Slot>;
+  static constexpr int kShuffleBits
+      = kMinimizeContention ? shuffle_bits(sizeof(Cell)) : 0;
 
  public:
-  MPMCQueue()
-      : head_(Tag<kBufferSize>::kBufferWrapDelta)
-      , tail_(Tag<kBufferSize>::kBufferWrapDelta)
-      , buffer_(kBufferSize) {
+  MPMCQueue() : MPMCQueue(QueueOpts{}) {}
+
+  // If kBufferSize is fixed at compile time, opts.max_size() is ignored.
+  MPMCQueue(const QueueOpts& opts)
+      : geometry_(opts.max_size())
+      , head_(Tag<kBufferSize>::wrap_delta(geometry_))
+      , tail_(Tag<kBufferSize>::wrap_delta(geometry_))
+      , buffer_(geometry_.size()) {
+    if constexpr (kPacked) {
+      static_assert(sizeof(Data) == sizeof(Data::line), "");
+      static_assert(sizeof(Data) == 16, "");
+    }
+
     Tag<kBufferSize> tag;
     tag.mark_as_consumer();
     for (size_t i = 0; i < buffer_.size(); i++) {
-      buffer_[tag.to_index()].tag = tag;
+      buffer_[index_of(tag)].tag_atomic.store(tag, std::memory_order::relaxed);
       ++tag;
     }
     std::atomic_thread_fence(std::memory_order::release);
   }
-  MPMCQueue(const QueueOpts&) : MPMCQueue() {}
 
   ~MPMCQueue() {
     while (true) {
@@ -70,63 +134,525 @@ class MPMCQueue {
     }
   }
 
-  void push(T val) {
-    Tag tail{tail_.reserve()};
+  // Returns false without blocking once the queue is closed.
+  bool push(T val) {
+    Tag tail{reserve_tail()};
+    if (tail.is_closed()) {
+      return false;
+    }
     tail.mark_as_producer();
     do_push(std::move(val), tail);
+    notify_poppers();
+    return true;
   }
 
-  bool try_push(T val) {
-    auto maybe_tail
-        = tail_.try_reserve(/*max_allowed_value=*/head_.value_atomic());
-    if (!maybe_tail.has_value()) {
+  bool try_push(T val) { return try_push_forward(std::move(val)); }
+
+  // Returns empty once the queue is closed and every value pushed before that
+  // has been popped.
+  std::optional<T> pop() {
+    Tag head{reserve_head()};
+    head.mark_as_consumer();
+    std::optional<T> val = do_pop(head);
+    notify_pushers();
+    return val;
+  }
+
+  std::optional<T> try_pop() {
+    std::optional<T> val = try_pop_quiet();
+    if (val.has_value()) {
+      notify_pushers();
+    }
+    return val;
+  }
+
+  // The timed and cancellable operations only reserve a ticket once they can
+  // use it right away, since a reserved ticket can't be handed back. Giving up
+  // leaves the queue exactly as it was.
+
+  // Pushes `val`, waiting until `deadline` for room. On timeout or once the
+  // queue is closed, this returns false and `val` is left as it was.
+  template <typename V, typename Clock, typename Duration>
+    requires std::constructible_from<T, V&&>
+  bool push_until(V&& val,
+                  const std::chrono::time_point<Clock, Duration>& deadline) {
+    while (!try_push_forward(std::forward<V>(val))) {
+      if (is_closed()
+          || !push_waiters_.wait_until(deadline, [this]() {
+               return size() < capacity() || is_closed();
+             })) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  template <typename V, typename Rep, typename Period>
+    requires std::constructible_from<T, V&&>
+  bool push_for(V&& val, const std::chrono::duration<Rep, Period>& timeout) {
+    return push_until(std::forward<V>(val),
+                      std::chrono::steady_clock::now() + timeout);
+  }
+
+  // Pops a value, waiting until `deadline` for one to arrive.
+  template <typename Clock, typename Duration>
+  std::optional<T> pop_until(
+      const std::chrono::time_point<Clock, Duration>& deadline) {
+    return pop_waiting([&](auto ready) {
+      return pop_waiters_.wait_until(deadline, ready);
+    });
+  }
+
+  template <typename Rep, typename Period>
+  std::optional<T> pop_for(const std::chrono::duration<Rep, Period>& timeout) {
+    return pop_until(std::chrono::steady_clock::now() + timeout);
+  }
+
+  // Like pop(), but also gives up once `stop` is requested, which lets
+  // std::jthread workers be cancelled without closing the queue.
+  std::optional<T> pop(std::stop_token stop) {
+    return pop_waiting(
+        [&](auto ready) { return pop_waiters_.wait(stop, ready); });
+  }
+
+  // For use as `co_await queue.async_pop(executor)` in a coroutine. Pops a
+  // value without blocking the thread: if there is none, the coroutine
+  // suspends until a push hands it one, and then resumes on `executor`. Like
+  // pop(), this returns empty once the queue is closed and drained.
+  template <Executor E>
+  auto async_pop(E& executor) {
+    return PopAwaiter<E>{*this, executor};
+  }
+
+  // For use as `co_await queue.async_push(val, executor)`. Pushes `val`,
+  // suspending while the queue is full, and resumes on `executor` once a pop
+  // made room and the value is in. Returns false once the queue is closed.
+  template <typename V, Executor E>
+    requires std::constructible_from<T, V&&>
+  auto async_push(V&& val, E& executor) {
+    return PushAwaiter<E>{*this, T(std::forward<V>(val)), executor};
+  }
+
+  // Pushes every value in `vals` using a single ticket reservation. The values
+  // land in consecutive slots, so they are popped in order relative to each
+  // other. Returns false without pushing any of them once the queue is closed.
+  bool push_n(std::span<const T> vals) {
+    if (vals.empty()) {
+      return !is_closed();
+    }
+    Tag tail{reserve_tail(vals.size())};
+    if (tail.is_closed()) {
       return false;
     }
-    auto tail = maybe_tail.value();
     tail.mark_as_producer();
-    do_push(std::move(val), tail);
+    for (size_t i = 0; i < vals.size(); i++) {
+      // Consumers in pop(stop_token) and the like wait for a notify rather than
+      // on a slot, and may be the only ones that can free this one, so tell
+      // them about the values so far before waiting for it.
+      if (i > 0 && !is_handed_over(tail)) {
+        notify_poppers();
+      }
+      do_push(vals[i], tail);
+      ++tail;
+    }
+    notify_poppers();
     return true;
   }
 
-  T pop() {
-    Tag head{head_.reserve()};
+  // Pushes as many leading values from `vals` as there is currently room for
+  // and returns that count.
+  size_t try_push_n(std::span<const T> vals) {
+    uint64_t retries = 0;
+    auto [tail, count] = tail_.template try_reserve_n<kSingleProducer>(
+        /*limit=*/push_limit(/*count=*/vals.size()),
+        /*max_count=*/vals.size(),
+        retries_out(retries));
+    stats_.add(QueueCounter::kReserveRetries, retries);
+    tail.mark_as_producer();
+    for (size_t i = 0; i < count; i++) {
+      do_push(vals[i], tail);
+      ++tail;
+    }
+    if (count > 0) {
+      notify_poppers();
+    }
+    return count;
+  }
+
+  // Pops `n` values into `out`, blocking until all of them arrive. Returns how
+  // many were popped, which is less than `n` only once the queue is closed.
+  size_t pop_n(T* out, size_t n) {
+    if (n == 0) {
+      return 0;
+    }
+    Tag head{reserve_head(n)};
     head.mark_as_consumer();
-    return do_pop(head);
+    size_t popped = 0;
+    for (; popped < n; popped++) {
+      // Like in push_n(), producers may be waiting for the room made so far.
+      if (popped > 0 && !is_handed_over(head)) {
+        notify_pushers();
+      }
+      std::optional<T> val = do_pop(head);
+      if (!val.has_value()) {
+        break;
+      }
+      out[popped] = std::move(val.value());
+      ++head;
+    }
+    notify_pushers();
+    return popped;
   }
 
-  std::optional<T> try_pop() {
-    auto maybe_head
-        = tail_.try_reserve(/*max_allowed_value=*/head_.value_atomic() - 1);
-    if (!maybe_head.has_value()) {
-      return {};
+  // Pops up to `max` values that are already in the queue into `out` and
+  // returns how many were popped.
+  size_t try_pop_n(T* out, size_t max) {
+    uint64_t retries = 0;
+    auto [head, count] = head_.template try_reserve_n<kSingleConsumer>(
+        /*limit=*/pop_limit(/*count=*/max),
+        /*max_count=*/max,
+        retries_out(retries));
+    stats_.add(QueueCounter::kReserveRetries, retries);
+    head.mark_as_consumer();
+    size_t popped = 0;
+    for (; popped < count; popped++) {
+      std::optional<T> val = do_pop(head);
+      if (!val.has_value()) {
+        break;
+      }
+      out[popped] = std::move(val.value());
+      ++head;
     }
-    auto head = maybe_head.value();
-    head.mark_as_producer();
-    return {do_pop(head)};
+    if (popped > 0) {
+      notify_pushers();
+    }
+    return popped;
   }
 
+  // Makes every later push fail right away. Values that were pushed before can
+  // still be popped, and after that every pop returns empty instead of
+  // blocking, including those that are already blocked. Pushes that were
+  // already waiting for room still finish once consumers make room.
+  //
+  // With a single producer, only the producer may call this, since it stores
+  // to tail_ without a read-modify-write.
+  void close() {
+    Tag<kBufferSize> tail = tail_.close();
+    if (tail.is_closed()) {
+      return;
+    }
+    closed_at_.store(tail.value(), std::memory_order::seq_cst);
+
+    // Changing every tag wakes up whatever waits on it, whichever wait
+    // strategy it uses. Waiters that find their ticket is past closed_at_ give
+    // up, and the rest go back to waiting.
+    for (Cell& cell : buffer_) {
+      Tag<kBufferSize> old_tag
+          = cell.tag_atomic.load(std::memory_order::relaxed);
+      Tag<kBufferSize> closed_tag;
+      do {
+        closed_tag = old_tag;
+        closed_tag.mark_as_closed();
+      } while (!cell.tag_atomic.compare_exchange_weak(
+          old_tag, closed_tag, std::memory_order::seq_cst));
+      waiter_.notify(cell.tag_atomic, old_tag);
+    }
+
+    notify_poppers();
+    notify_pushers();
+  }
+
+  bool is_closed() const { return tail_.is_closed_atomic(); }
+
   size_t size() const {
     // Reading head before tail will make it possible to "see" more elements in
     // the queue than it can hold, but this makes it so that the size will
-    // never be negative.
+    // never be negative, except once pops pass closed_at_.
     auto head = head_.value_atomic();
-    auto tail = tail_.value_atomic();
+    auto tail = load_pop_limit();
+    if (tail < head) {
+      return 0;
+    }
 
-    return (head - tail) / Tag<kBufferSize>::kIncrement;
+    return (tail - head) / Tag<kBufferSize>::kIncrement;
   }
 
-  static constexpr size_t capacity() { return kBufferSize; }
+  constexpr size_t capacity() const { return geometry_.size(); }
+
+  // What Stats counted so far. All zeros with NoQueueStats.
+  QueueStats stats() const { return stats_.snapshot(); }
 
  private:
+  // Read-only after construction. With a compile-time size this takes no
+  // space at all.
+  [[no_unique_address]] Geometry geometry_;
   alignas(hardware_destructive_interference_size) Tag<kBufferSize> head_;
+  // Only used by a single consumer, which shares this line with head_.
+  uint64_t cached_pop_limit_ = 0;
   alignas(hardware_destructive_interference_size) Tag<kBufferSize> tail_;
-  alignas(hardware_destructive_interference_size) std::vector<Data> buffer_;
+  // Only used by a single producer, which shares this line with tail_.
+  uint64_t cached_push_limit_ = 0;
+  alignas(hardware_destructive_interference_size) std::vector<Cell> buffer_;
+  [[no_unique_address]] Waiter waiter_;
+  [[no_unique_address]] Stats stats_;
+  // Only the timed and cancellable operations wait on these.
+  alignas(hardware_destructive_interference_size) DeadlineWaiter pop_waiters_;
+  alignas(hardware_destructive_interference_size) DeadlineWaiter push_waiters_;
+  // The first ticket that no value was pushed for, once the queue is closed.
+  alignas(hardware_destructive_interference_size) std::atomic<uint64_t>
+      closed_at_{std::numeric_limits<uint64_t>::max()};
+
+  Tag<kBufferSize> reserve_tail(uint64_t count = 1) {
+    return tail_.template reserve<kSingleProducer>(count);
+  }
+
+  Tag<kBufferSize> reserve_head(uint64_t count = 1) {
+    return head_.template reserve<kSingleConsumer>(count);
+  }
+
+  uint64_t load_push_limit() const {
+    return head_.value_atomic() + Tag<kBufferSize>::wrap_delta(geometry_);
+  }
+
+  // The limit to reserve up to `count` more tickets from tail_ with. head_
+  // only moves forward, so a single producer's cached limit stays safe to use
+  // and only needs reloading once it's in the way.
+  uint64_t push_limit(uint64_t count) {
+    if constexpr (kSingleProducer) {
+      if (cached_push_limit_ < tail_.value_atomic() + count) {
+        cached_push_limit_ = load_push_limit();
+      }
+      return cached_push_limit_;
+    }
+    return load_push_limit();
+  }
+
+  // Like push_limit(), but for head_.
+  uint64_t pop_limit(uint64_t count) {
+    if constexpr (kSingleConsumer) {
+      if (cached_pop_limit_ < head_.value_atomic() + count) {
+        cached_pop_limit_ = load_pop_limit();
+      }
+      return cached_pop_limit_;
+    }
+    return load_pop_limit();
+  }
+
+  // Pushes that fail after close() still bump tail_, so pops never go past
+  // closed_at_.
+  uint64_t load_pop_limit() const {
+    return std::min<uint64_t>(tail_.value_atomic(),
+                              closed_at_.load(std::memory_order::acquire));
+  }
+
+  // Whether the queue was closed before a value was pushed for `tag`.
+  bool is_closed_for(const Tag<kBufferSize>& tag) const {
+    // Pairs with close(), which sets closed_at_ before it changes every tag.
+    // Either this sees closed_at_ or the tag that was just loaded changes.
+    std::atomic_thread_fence(std::memory_order::seq_cst);
+    return tag.value() >= closed_at_.load(std::memory_order::relaxed);
+  }
+
+  // Pops with try_pop() and calls `wait(ready)` until something may be ready
+  // to pop. Returns empty once `wait` returns false or the queue is closed and
+  // drained.
+  template <typename Wait>
+  std::optional<T> pop_waiting(Wait&& wait) {
+    while (true) {
+      // Anything pushed before a close that was seen here has a ticket, so
+      // try_pop() finding nothing means there is nothing left for us.
+      bool closed = is_closed();
+      if (auto val = try_pop()) {
+        return val;
+      }
+      if (closed
+          || !wait([this]() { return size() > 0 || is_closed(); })) {
+        return {};
+      }
+    }
+  }
+
+  template <typename V>
+  bool try_push_forward(V&& val) {
+    if (!try_push_quiet(std::forward<V>(val))) {
+      return false;
+    }
+    notify_poppers();
+    return true;
+  }
+
+  // Like try_push() and try_pop(), but without notifying the other side, so
+  // that they can run while a DeadlineWaiter's mutex is held.
+  template <typename V>
+  bool try_push_quiet(V&& val) {
+    uint64_t retries = 0;
+    auto maybe_tail = tail_.template try_reserve<kSingleProducer>(
+        /*limit=*/push_limit(/*count=*/1), retries_out(retries));
+    stats_.add(QueueCounter::kReserveRetries, retries);
+    if (!maybe_tail.has_value()) {
+      return false;
+    }
+    auto tail = maybe_tail.value();
+    tail.mark_as_producer();
+    do_push(std::forward<V>(val), tail);
+    return true;
+  }
+
+  std::optional<T> try_pop_quiet() {
+    uint64_t retries = 0;
+    auto maybe_head = head_.template try_reserve<kSingleConsumer>(
+        /*limit=*/pop_limit(/*count=*/1), retries_out(retries));
+    stats_.add(QueueCounter::kReserveRetries, retries);
+    if (!maybe_head.has_value()) {
+      return {};
+    }
+    auto head = maybe_head.value();
+    head.mark_as_consumer();
+    return do_pop(head);
+  }
+
+  // Like the timed operations, these never hold a ticket while suspended. The
+  // awaiter lives in the coroutine's frame, so waiting doesn't allocate.
+  template <Executor E>
+  class PopAwaiter : public DeadlineWaiter::AsyncWait {
+   public:
+    PopAwaiter(MPMCQueue& queue, E& executor)
+        : queue_(queue), executor_(executor) {}
+    PopAwaiter(const PopAwaiter&) = delete;
+
+    bool await_ready() {
+      if (!try_complete()) {
+        return false;
+      }
+      if (val_.has_value()) {
+        queue_.notify_pushers();
+      }
+      return true;
+    }
+
+    bool await_suspend(std::coroutine_handle<> handle) {
+      handle_ = handle;
+      if (queue_.pop_waiters_.suspend(*this)) {
+        return true;
+      }
+      if (val_.has_value()) {
+        queue_.notify_pushers();
+      }
+      return false;
+    }
+
+    std::optional<T> await_resume() { return std::move(val_); }
+
+    bool try_complete() override {
+      // As in pop_waiting(), finding nothing after seeing the close means
+      // there is nothing left for us.
+      bool closed = queue_.is_closed();
+      val_ = queue_.try_pop_quiet();
+      return val_.has_value() || closed;
+    }
+
+    void resume() override { executor_.execute(handle_); }
+
+   private:
+    MPMCQueue& queue_;
+    E& executor_;
+    std::coroutine_handle<> handle_;
+    std::optional<T> val_;
+  };
+
+  template <Executor E>
+  class PushAwaiter : public DeadlineWaiter::AsyncWait {
+   public:
+    PushAwaiter(MPMCQueue& queue, T val, E& executor)
+        : queue_(queue), executor_(executor), val_(std::move(val)) {}
+    PushAwaiter(const PushAwaiter&) = delete;
+
+    bool await_ready() {
+      if (!try_complete()) {
+        return false;
+      }
+      if (pushed_) {
+        queue_.notify_poppers();
+      }
+      return true;
+    }
+
+    bool await_suspend(std::coroutine_handle<> handle) {
+      handle_ = handle;
+      if (queue_.push_waiters_.suspend(*this)) {
+        return true;
+      }
+      if (pushed_) {
+        queue_.notify_poppers();
+      }
+      return false;
+    }
+
+    bool await_resume() { return pushed_; }
+
+    bool try_complete() override {
+      // val_ is only moved from once the push has a ticket.
+      pushed_ = queue_.try_push_quiet(std::move(val_));
+      return pushed_ || queue_.is_closed();
+    }
+
+    void resume() override { executor_.execute(handle_); }
+
+   private:
+    MPMCQueue& queue_;
+    E& executor_;
+    std::coroutine_handle<> handle_;
+    T val_;
+    bool pushed_{false};
+  };
+
+  // A coroutine's operation that notify() completes changes the queue too, so
+  // keep notifying until neither side has anything left to complete.
+  void notify_poppers() {
+    while (pop_waiters_.notify() > 0 && push_waiters_.notify() > 0) {
+    }
+  }
+
+  void notify_pushers() {
+    while (push_waiters_.notify() > 0 && pop_waiters_.notify() > 0) {
+    }
+  }
 
   void do_push(T val, const Tag<kBufferSize>& tag) {
     assert(tag.is_producer());
     assert(!tag.is_waiting());
+    observe_size(tag);
+
+    if constexpr (kPacked) {
+      do_push_packed(val, tag);
+    } else {
+      wait_until_paired(tag);
+      std::construct_at(buffer_[index_of(tag)].value(), std::move(val));
+      publish(tag);
+    }
+  }
+
+  // Returns empty if the queue was closed before a value was pushed for `tag`.
+  std::optional<T> do_pop(const Tag<kBufferSize>& tag) {
+    assert(tag.is_consumer());
+    assert(!tag.is_waiting());
+
+    if constexpr (kPacked) {
+      return do_pop_packed(tag);
+    } else {
+      if (!wait_until_paired(tag)) {
+        return {};
+      }
+      T* slot_value = buffer_[index_of(tag)].value();
+      T val{std::move(*slot_value)};
+      std::destroy_at(slot_value);
+      publish(tag);
+      return val;
+    }
+  }
 
-    int idx = tag.to_index();
+  void do_push_packed(T val, const Tag<kBufferSize>& tag) {
+    int idx = index_of(tag);
 
     // This is the strangest issue -- with Ubuntu clang version 15.0.7,
     // when observed_data is defined inside of the loop scope, benchmarks will
@@ -137,38 +663,39 @@ class MPMCQueue {
           = buffer_[idx].line.load(std::memory_order::acquire);
       observed_data = Data{/*line=*/observed_data_line};
 
-      if (tag.is_paired(observed_data.tag)) {
+      if (tag.is_paired(observed_data.tag, geometry_)) {
         break;
       }
 
-      wait_for_data(tag, observed_data.tag);
+      stats_.add(QueueCounter::kWaits);
+      waiter_.wait(buffer_[idx].tag_atomic, observed_data.tag);
     }
 
     Data new_data{/*value_=*/val, /*tag_=*/tag};
     Data old_data{buffer_[idx].line.exchange(
         new_data.line.load(std::memory_order::relaxed),
         std::memory_order::acq_rel)};
-    if (old_data.tag.is_waiting()) {
-      buffer_[idx].tag_atomic.notify_all();
-    }
+    count_wake(old_data.tag);
+    waiter_.notify(buffer_[idx].tag_atomic, old_data.tag);
   }
 
-  T do_pop(const Tag<kBufferSize>& tag) {
-    assert(tag.is_consumer());
-    assert(!tag.is_waiting());
-
-    int idx = tag.to_index();
+  std::optional<T> do_pop_packed(const Tag<kBufferSize>& tag) {
+    int idx = index_of(tag);
 
     Data observed_data;
     while (true) {
       observed_data
           = Data{/*line=*/buffer_[idx].line.load(std::memory_order::acquire)};
 
-      if (tag.is_paired(observed_data.tag)) {
+      if (tag.is_paired(observed_data.tag, geometry_)) {
         break;
       }
 
-      wait_for_data(tag, observed_data.tag);
+      if (is_closed_for(tag)) {
+        return {};
+      }
+      stats_.add(QueueCounter::kWaits);
+      waiter_.wait(buffer_[idx].tag_atomic, observed_data.tag);
     }
 
     // This is another strange issue -- it is faster to exchange the __int128
@@ -178,33 +705,75 @@ class MPMCQueue {
         Data{/*value=*/T{}, /*tag=*/tag}.line.load(std::memory_order::relaxed),
         std::memory_order::acq_rel)};
 
-    if (old_data.tag.is_waiting()) {
-      buffer_[idx].tag_atomic.notify_all();
-    }
+    count_wake(old_data.tag);
+    waiter_.notify(buffer_[idx].tag_atomic, old_data.tag);
 
     return observed_data.value;
   }
 
-  void wait_for_data(const Tag<kBufferSize>& claimed_tag,
-                     Tag<kBufferSize> observed_tag) {
-    int idx = claimed_tag.to_index();
+  int index_of(const Tag<kBufferSize>& tag) const {
+    return tag.template to_index<kShuffleBits>(geometry_);
+  }
+
+  // Whether the slot for `tag` has been handed over, so that using it won't
+  // wait.
+  bool is_handed_over(const Tag<kBufferSize>& tag) {
+    return tag.is_paired(
+        buffer_[index_of(tag)].tag_atomic.load(std::memory_order::acquire),
+        geometry_);
+  }
+
+  // Blocks until the slot for `tag` has been handed over by its previous owner.
+  // Returns false if the queue was closed before that could happen.
+  bool wait_until_paired(const Tag<kBufferSize>& tag) {
+    auto& tag_atomic = buffer_[index_of(tag)].tag_atomic;
     while (true) {
-      Tag<kBufferSize> want_tag{observed_tag};
-      want_tag.mark_as_waiting();
-      if ((observed_tag.value() == want_tag.value())
-          || buffer_[idx].tag_atomic.compare_exchange_weak(
-              observed_tag,
-              want_tag,
-              std::memory_order::release,
-              std::memory_order::relaxed)) {
-        buffer_[idx].tag_atomic.wait(want_tag, std::memory_order::acquire);
-        break;
+      Tag<kBufferSize> observed_tag
+          = tag_atomic.load(std::memory_order::acquire);
+      if (tag.is_paired(observed_tag, geometry_)) {
+        return true;
       }
+      if (is_closed_for(tag)) {
+        return false;
+      }
+      stats_.add(QueueCounter::kWaits);
+      waiter_.wait(tag_atomic, observed_tag);
+    }
+  }
 
-      if (claimed_tag.is_paired(observed_tag)) {
-        break;
+  // Hands the slot for `tag` over to its next owner.
+  void publish(const Tag<kBufferSize>& tag) {
+    auto& tag_atomic = buffer_[index_of(tag)].tag_atomic;
+    Tag<kBufferSize> old_tag
+        = tag_atomic.exchange(tag, std::memory_order::acq_rel);
+    count_wake(old_tag);
+    waiter_.notify(tag_atomic, old_tag);
+  }
+
+  // Where Tag::try_reserve() should count its retries. Without stats it
+  // doesn't count them at all.
+  static uint64_t* retries_out(uint64_t& retries) {
+    return Stats::kEnabled ? &retries : nullptr;
+  }
+
+  // The queue holds at least every ticket from head_ up to the one that is
+  // being pushed. This reads head_, so it only runs with stats.
+  void observe_size(const Tag<kBufferSize>& tag) {
+    if constexpr (Stats::kEnabled) {
+      uint64_t head = head_.value_atomic();
+      if (tag.value() >= head) {
+        stats_.observe_size((tag.value() - head) / Tag<kBufferSize>::kIncrement
+                            + 1);
       }
     }
   }
+
+  // A hand-over of a slot that a waiter flagged, which makes the wait strategy
+  // wake it.
+  void count_wake(const Tag<kBufferSize>& old_tag) {
+    if (old_tag.is_waiting()) {
+      stats_.add(QueueCounter::kWakes);
+    }
+  }
 };
 }  // namespace theta
@@ -1,24 +1,47 @@
 #pragma once
 
+#include <algorithm>
 #include <atomic>
+#include <chrono>
 #include <cassert>
 #include <cmath>
+#include <concepts>
 #include <cstdint>
+#include <deque>
+#include <limits>
 #include <memory>
+#include <mutex>
 #include <optional>
+#include <span>
 #include <type_traits>
+#include <utility>
 #include <vector>
 
 #include "defs.h"
 #include "queue_opts.h"
+#include "queue_stats.h"
+#include "wait_strategy.h"
 
 namespace theta {
 
-// Multiple-producer, single-consumer.
-// If more than one consumer exists at once, no items will be lost, but it is
-// possible for events to appear out of order. This requires that no producer
-// adds a "zero" item.
-template <ZeroableAtomType T>
+// Multiple-producer, single-consumer. This requires that no producer adds a
+// "zero" item.
+//
+// Only one thread at a time may pop, with try_pop(), drain() or any other pop.
+// A pop takes its slots before it moves head past them, so that a producer on
+// the next lap can't write into a slot ahead of the one from this lap, and two
+// consumers could take the same slot and skip the one after it.
+//
+// With kUnbounded, pushes never fail. Once the ring fills up, it falls back to
+// a mutex-protected queue, and it returns to lock-free operation once the
+// consumer catches up. See the comment above HeadTail for details. Its ring
+// holds at most 2^21 slots, so QueueOpts::max_size() must not exceed that.
+//
+// Stats counts CAS retries on the index word, spins on slots that a pop hasn't
+// cleared yet and the occupancy high-water mark. See queue_stats.h.
+template <ZeroableAtomType T,
+          bool kUnbounded = false,
+          StatsPolicy Stats = NoQueueStats>
 class MPSCQueue {
  public:
   static constexpr size_t next_pow_2(int v) {
@@ -32,6 +55,8 @@ class MPSCQueue {
   MPSCQueue(QueueOpts opts)
       : ht_(/*head=*/0, /*tail=*/0), buf_(next_pow_2(opts.max_size())) {
     CHECK(capacity());
+    CHECK(buf_.size() <= kMaxBufferSize);
+    CHECK(!kUnbounded || push_half() > 0);
   }
 
   ~MPSCQueue() {
@@ -43,128 +68,290 @@ class MPSCQueue {
     }
   }
 
+  void push(T val)
+    requires kUnbounded
+  {
+    try_push(val, nullptr);
+  }
+
   bool try_push(T val) { return try_push(val, nullptr); }
 
   bool try_push(T val, size_t* num_items) {
     DCHECK(val);
     uint64_t expected = ht_.line.load(std::memory_order::acquire);
-    uint32_t head, tail;
+    uint32_t tail;
     do {
-      size_t s = size(expected, buf_.size());
-      if (s == capacity()) {
+      size_t room = push_room(expected);
+      if (room == 0) {
+        if constexpr (kUnbounded) {
+          push_slow(std::span<const T>{&val, 1});
+          if (num_items) {
+            *num_items = size();
+          }
+          pop_waiters_.notify();
+          return true;
+        }
         if (num_items) {
-          *num_items = s;
+          *num_items = capacity();
         }
         return false;
       } else if (num_items) {
-        *num_items = s + 1;
+        *num_items = size(expected) + 1;
       }
 
-      head = HeadTail{expected}.head;
-      tail = HeadTail{expected}.tail;
+      tail = wrap(HeadTail{expected}.tail + 1);
+    } while (!ht_.line.compare_exchange_weak(
+                 expected,
+                 with_tail(expected, tail),
+                 std::memory_order::release,
+                 std::memory_order::relaxed)
+             && count_retry());
 
-      if (tail == buf_.size() - 1) {
-        tail = 0;
-      } else {
-        tail++;
+    stats_.observe_size(size(expected) + 1);
+    put(HeadTail{expected}.tail, val);
+    pop_waiters_.notify();
+    return true;
+  }
+
+  // Claims room for as many leading values of `vals` as will fit with a single
+  // CAS and returns how many were pushed. With kUnbounded, every value is
+  // pushed.
+  size_t try_push_n(std::span<const T> vals) {
+    uint64_t expected = ht_.line.load(std::memory_order::acquire);
+    uint32_t tail;
+    size_t count;
+    do {
+      count = std::min(vals.size(), push_room(expected));
+      if (count == 0) {
+        break;
       }
+
+      tail = wrap(HeadTail{expected}.tail + count);
     } while (!ht_.line.compare_exchange_weak(
-        expected,
-        HeadTail{head, tail}.line.load(std::memory_order::relaxed),
-        std::memory_order::release,
-        std::memory_order::relaxed));
+                 expected,
+                 with_tail(expected, tail),
+                 std::memory_order::release,
+                 std::memory_order::relaxed)
+             && count_retry());
 
+    if (count > 0) {
+      stats_.observe_size(size(expected) + count);
+    }
     uint32_t index = HeadTail{expected}.tail;
+    for (size_t i = 0; i < count; i++) {
+      DCHECK(vals[i]);
+      put(index, vals[i]);
+      index = wrap(index + 1);
+    }
 
-    // It is possible that a pop operation has claimed this index but hasn't
-    // yet performed its read.
-    while (true) {
-      T expect_zero{};
-      if (buf_[index].compare_exchange_weak(expect_zero,
-                                            val,
-                                            std::memory_order::release,
-                                            std::memory_order::relaxed)) {
-        break;
+    if constexpr (kUnbounded) {
+      if (count < vals.size()) {
+        push_slow(vals.subspan(count));
+        count = vals.size();
       }
     }
 
-    return true;
+    if (count > 0) {
+      pop_waiters_.notify();
+    }
+    return count;
   }
 
   std::optional<T> try_pop() {
-    auto maybe_index = reserve_for_pop();
-    if (!maybe_index.has_value()) {
+    uint64_t line = load_for_pop();
+    if (pop_room(line) == 0) {
       return {};
     }
-    auto index = maybe_index.value();
+    T t = take(HeadTail{line}.head);
+    release_for_pop(1);
+    notify_pushers();
+    return t;
+  }
 
-    T t{};
-    // It's possible that a push operation has obtained this index but hasn't
-    // yet written its value which will cause us to spin.
+  // Pushes `val`, waiting until `deadline` for room. With kUnbounded, this
+  // never waits.
+  template <typename Clock, typename Duration>
+  bool push_until(T val,
+                  const std::chrono::time_point<Clock, Duration>& deadline) {
+    while (!try_push(val)) {
+      if (!push_waiters_.wait_until(
+              deadline, [this]() { return size() < capacity(); })) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  template <typename Rep, typename Period>
+  bool push_for(T val, const std::chrono::duration<Rep, Period>& timeout) {
+    return push_until(val, std::chrono::steady_clock::now() + timeout);
+  }
+
+  // Pops an item, waiting until `deadline` for one to arrive.
+  template <typename Clock, typename Duration>
+  std::optional<T> pop_until(
+      const std::chrono::time_point<Clock, Duration>& deadline) {
+    while (true) {
+      if (auto val = try_pop()) {
+        return val;
+      }
+      if (!pop_waiters_.wait_until(deadline,
+                                   [this]() { return size() > 0; })) {
+        return {};
+      }
+    }
+  }
+
+  template <typename Rep, typename Period>
+  std::optional<T> pop_for(const std::chrono::duration<Rep, Period>& timeout) {
+    return pop_until(std::chrono::steady_clock::now() + timeout);
+  }
+
+  // Passes up to `max` of the currently visible items to `callback` in order
+  // and then releases all of their slots with a single CAS. Returns the number
+  // of items drained. With kUnbounded, this works through at most half of the
+  // ring per CAS.
+  //
+  // Slots are released only after they are taken, since a producer that
+  // claimed a released slot could otherwise write to it before the producer
+  // from the previous lap.
+  template <typename F>
+    requires std::invocable<F&, T>
+  size_t drain(F&& callback, size_t max = std::numeric_limits<size_t>::max()) {
+    if constexpr (kUnbounded) {
+      max = std::min(max, size());
+    }
+
+    size_t drained = 0;
     do {
-      t = buf_[index].exchange(t, std::memory_order::acq_rel);
-    } while (!t);
+      uint64_t line = load_for_pop();
+      size_t count = std::min(max - drained, pop_room(line));
+      if constexpr (kUnbounded) {
+        // A split may land anywhere after head, so never get further ahead of
+        // it than the pop half reaches.
+        count = std::min(count, half());
+      }
+      if (count == 0) {
+        break;
+      }
 
-    return t;
+      uint32_t index = HeadTail{line}.head;
+      for (size_t i = 0; i < count; i++) {
+        callback(take(index));
+        index = wrap(index + 1);
+      }
+      release_for_pop(count);
+      drained += count;
+    } while (kUnbounded && drained < max);
+
+    if (drained > 0) {
+      notify_pushers();
+    }
+    return drained;
+  }
+
+  size_t try_pop_n(T* out, size_t max) {
+    return drain([&out](T t) { *out++ = t; }, max);
   }
 
   size_t size() const {
-    return size(ht_.line.load(std::memory_order::acquire), buf_.size());
+    uint64_t line = ht_.line.load(std::memory_order::acquire);
+    if constexpr (kUnbounded) {
+      HeadTail ht{line};
+      if (ht.fallback) {
+        return wrap(ht.split - ht.head) + wrap(ht.tail - ht.split)
+             + fallback_.size.load(std::memory_order::relaxed);
+      }
+    }
+    return size(line);
   }
 
+  // The number of items the ring holds. With kUnbounded, items beyond this
+  // spill into the fallback queue.
   size_t capacity() const { return buf_.size() - 1; }
 
+  // What Stats counted so far. All zeros with NoQueueStats.
+  QueueStats stats() const { return stats_.snapshot(); }
+
  private:
-  // TODO(lpe): It's possible to make this structure naturally fall back to a
-  // traditional threadqueue, thereby removing the size limit. This would
-  // require 5 index values:
-  // head: Index of the next value to pop
-  // tail: Index where the next value should push
-  // split: If active, a point that splits the queue in half. If this happens,
-  //        the head index will always live in one half while the tail index
-  //        will always live in the other.
-  // fallback_tail: If in fallback mode, this index operates in the same half as
-  // the
-  //                head. It indicates where the next value popped from the
-  //                fallback queue should be placed.
-  // fallback_head: If in fallback mode, this indicates where the next value to
-  //                be placed in the fallback queue is located.
-  //
-  // This system requires all 5 values to be read atomically, so the fast-queue
-  // size will be limitted to 4096 values (12 bits). This leaves 4 bits, one of
-  // which can indicate whether the fallback mode is active.
+  // Only the fallback mode needs `split` next to head and tail, which limits
+  // its ring to 2^21 slots. Bounded queues keep head and tail wide enough for
+  // any size that next_pow_2() returns.
+  static constexpr int kIndexBits = kUnbounded ? 21 : 31;
+  static constexpr int kSplitBits = kUnbounded ? kIndexBits : 1;
+  static constexpr size_t kMaxBufferSize = size_t{1} << kIndexBits;
+
+  // All indices live in one atomic word so that every mode transition is a
+  // single CAS.
   //
-  // While in fallback mode, creating a Flusher object will need to refill the
-  // pop half of the queue. If a push or a pop operation reaches the fallback
-  // head/tail, then that operation will need to block while it offloads values
-  // into the fallback queue or pulls more values from the fallback queue.
+  // In fast mode, `split` is unused and the ring holds the items in
+  // [head, tail).
   //
-  // Moving from fast-mode to fallback-mode will involve taking the mutex in
-  // the push path, declaring the split point, and then moving the elements in
-  // the push half into the fallback-queue.
+  // When a push finds the ring full and kUnbounded is set, it takes the
+  // fallback mutex and sets `split` to head + size/2, which splits the ring in
+  // half. The consumer keeps popping [head, split) without a lock while
+  // producers keep claiming slots in [split, split + size/2 - 1) without a
+  // lock.
+  // Once the push half is full, a producer holding the mutex moves all of it
+  // to the back of the fallback queue and resets tail to split.
   //
-  // Moving from fallback-mode to fast-mode will again involve taking the mutex,
-  // but then the two halves of the fast-queue will need to be stitched together
-  // by moving elements one half to the other half.
+  // When the consumer empties the pop half, it takes the mutex and refills the
+  // slots just before `split` from the front of the fallback queue. If the
+  // fallback queue is empty, the push half alone holds every remaining item,
+  // so the consumer returns to fast mode with head = split.
   //
-  // It's not clear how thread-friendly the transition from fallback- to
-  // fast-mode can be. At the worst, it will be possible to set a bit that flags
-  // all operations to block.
-
+  // Items in the pop half are always older than those in the fallback queue,
+  // which are older than those in the push half, so order is preserved.
   union alignas(hardware_destructive_interference_size) HeadTail {
     struct {
-      uint32_t head;
-      uint32_t tail;
+      uint64_t head : kIndexBits;
+      uint64_t tail : kIndexBits;
+      uint64_t split : kSplitBits;
+      uint64_t fallback : 1;
     };
     std::atomic<uint64_t> line;
 
     HeadTail(uint64_t line) : line(line) {}
-    HeadTail(uint32_t head, uint32_t tail) : head(head), tail(tail) {}
+    HeadTail(uint64_t head,
+             uint64_t tail,
+             uint64_t split = 0,
+             uint64_t fallback = 0)
+        : head(head), tail(tail), split(split), fallback(fallback) {}
   } ht_;
+  static_assert(2 * kIndexBits + kSplitBits + 1 <= 64, "");
 
   alignas(
       hardware_destructive_interference_size) std::vector<std::atomic<T>> buf_;
 
+  struct alignas(hardware_destructive_interference_size) Fallback {
+    std::mutex mu;
+    std::deque<T> queue;
+    // Mirrors queue.size() so that size() doesn't need the mutex.
+    std::atomic<size_t> size{0};
+  };
+  struct NoFallback {};
+  [[no_unique_address]] std::conditional_t<kUnbounded, Fallback, NoFallback>
+      fallback_;
+
+  // Only the timed operations wait on these.
+  alignas(hardware_destructive_interference_size) DeadlineWaiter pop_waiters_;
+  alignas(hardware_destructive_interference_size) DeadlineWaiter push_waiters_;
+
+  [[no_unique_address]] Stats stats_;
+
+  // Always true, so that it can sit in a CAS loop's condition.
+  bool count_retry() {
+    stats_.add(QueueCounter::kReserveRetries);
+    return true;
+  }
+
+  // With kUnbounded, pushes never wait.
+  void notify_pushers() {
+    if constexpr (!kUnbounded) {
+      push_waiters_.notify();
+    }
+  }
+
   static inline constexpr size_t size(uint64_t line, size_t buf_size) {
     uint32_t head = HeadTail(line).head;
     uint32_t tail = HeadTail(line).tail;
@@ -174,28 +361,203 @@ class MPSCQueue {
     return tail - head;
   }
 
-  std::optional<uint32_t> reserve_for_pop() {
-    uint64_t expected;
-    uint32_t head, tail;
-    do {
-      expected = ht_.line.load(std::memory_order::acquire);
-      if (size(expected, buf_.size()) == 0) {
-        return {};
+  size_t size(uint64_t line) const { return size(line, buf_.size()); }
+
+  uint32_t wrap(uint64_t index) const { return index & (buf_.size() - 1); }
+
+  size_t half() const { return buf_.size() / 2; }
+
+  // Like fast mode, the push half leaves one slot unclaimed between its end and
+  // head, so that the slot a consumer is popping from can't be handed out.
+  size_t push_half() const { return half() - 1; }
+
+  static uint64_t with_tail(uint64_t line, uint32_t tail) {
+    HeadTail ht{line};
+    return HeadTail{ht.head, tail, ht.split, ht.fallback}.line.load(
+        std::memory_order::relaxed);
+  }
+
+  static uint64_t with_head(uint64_t line, uint32_t head) {
+    HeadTail ht{line};
+    return HeadTail{head, ht.tail, ht.split, ht.fallback}.line.load(
+        std::memory_order::relaxed);
+  }
+
+  // The number of slots that producers may claim without taking the mutex.
+  size_t push_room(uint64_t line) const {
+    if constexpr (kUnbounded) {
+      HeadTail ht{line};
+      if (ht.fallback) {
+        return push_half() - wrap(ht.tail - ht.split);
       }
+    }
+    return capacity() - size(line);
+  }
 
-      head = HeadTail(expected).head + 1;
-      tail = HeadTail(expected).tail;
+  // The number of items that the consumer may claim without taking the mutex.
+  size_t pop_room(uint64_t line) const {
+    if constexpr (kUnbounded) {
+      HeadTail ht{line};
+      if (ht.fallback) {
+        return wrap(ht.split - ht.head);
+      }
+    }
+    return size(line);
+  }
 
-      if (head >= buf_.size()) {
-        head -= buf_.size();
+  void put(uint32_t index, T val) {
+    // It is possible that a pop operation has claimed this index but hasn't
+    // yet performed its read.
+    while (true) {
+      T expect_zero{};
+      if (buf_[index].compare_exchange_weak(expect_zero,
+                                            val,
+                                            std::memory_order::release,
+                                            std::memory_order::relaxed)) {
+        break;
       }
-    } while (!ht_.line.compare_exchange_weak(
+      stats_.add(QueueCounter::kSlotSpins);
+    }
+  }
+
+  T take(uint32_t index) {
+    T t{};
+    // It's possible that a push operation has obtained this index but hasn't
+    // yet written its value which will cause us to spin.
+    do {
+      t = buf_[index].exchange(t, std::memory_order::acq_rel);
+    } while (!t);
+
+    return t;
+  }
+
+  // Loads the index word. In fallback mode, this first refills the pop half
+  // if it's empty.
+  uint64_t load_for_pop() {
+    while (true) {
+      uint64_t line = ht_.line.load(std::memory_order::acquire);
+      if constexpr (kUnbounded) {
+        if (pop_room(line) == 0 && HeadTail{line}.fallback) {
+          refill();
+          continue;
+        }
+      }
+      return line;
+    }
+  }
+
+  // Hands the `count` slots after head back to the producers. Only the
+  // consumer moves head, but producers may move tail at the same time.
+  void release_for_pop(size_t count) {
+    uint64_t expected = ht_.line.load(std::memory_order::relaxed);
+    while (!ht_.line.compare_exchange_weak(
         expected,
-        HeadTail(head, tail).line.load(std::memory_order::relaxed),
+        with_head(expected, wrap(HeadTail{expected}.head + count)),
         std::memory_order::release,
-        std::memory_order::relaxed));
+        std::memory_order::relaxed)) {
+    }
+  }
+
+  // Pushes `vals` once the lock-free path has run out of room. This splits the
+  // ring if it is in fast mode and flushes the push half to the fallback queue
+  // whenever it fills up.
+  void push_slow(std::span<const T> vals) {
+    std::lock_guard l{fallback_.mu};
+    while (!vals.empty()) {
+      uint64_t expected = ht_.line.load(std::memory_order::acquire);
+      HeadTail ht{expected};
+      size_t count = std::min(vals.size(), push_room(expected));
+      if (count > 0) {
+        if (!ht_.line.compare_exchange_weak(
+                expected,
+                with_tail(expected, wrap(ht.tail + count)),
+                std::memory_order::release,
+                std::memory_order::relaxed)) {
+          continue;
+        }
+        uint32_t index = ht.tail;
+        for (size_t i = 0; i < count; i++) {
+          DCHECK(vals[i]);
+          put(index, vals[i]);
+          index = wrap(index + 1);
+        }
+        vals = vals.subspan(count);
+      } else if (!ht.fallback) {
+        // The half holding head belongs to the consumer. The other half only
+        // holds the newest items, so it's what gets flushed.
+        ht_.line.compare_exchange_weak(
+            expected,
+            HeadTail{ht.head, ht.tail, wrap(ht.head + half()), true}.line.load(
+                std::memory_order::relaxed),
+            std::memory_order::release,
+            std::memory_order::relaxed);
+      } else {
+        flush_push_half();
+      }
+    }
+    if constexpr (Stats::kEnabled) {
+      stats_.observe_size(size());
+    }
+  }
+
+  // Requires the fallback mutex and a full push half. No producer can claim a
+  // slot until tail is reset, so only head can change underneath us.
+  void flush_push_half() {
+    uint64_t expected = ht_.line.load(std::memory_order::acquire);
+    HeadTail ht{expected};
+
+    for (uint32_t index = ht.split; index != ht.tail;
+         index = wrap(index + 1)) {
+      fallback_.queue.push_back(take(index));
+    }
+    fallback_.size.store(fallback_.queue.size(), std::memory_order::relaxed);
+
+    while (!ht_.line.compare_exchange_weak(expected,
+                                           with_tail(expected, ht.split),
+                                           std::memory_order::release,
+                                           std::memory_order::relaxed)) {
+    }
+  }
 
-    return HeadTail(expected).head;
+  // Called by the consumer once the pop half is empty. Moves the oldest items
+  // from the fallback queue into the pop half, or returns to fast mode if
+  // there are none.
+  void refill() {
+    std::lock_guard l{fallback_.mu};
+    uint64_t expected = ht_.line.load(std::memory_order::acquire);
+    HeadTail ht{expected};
+    if (!ht.fallback || ht.head != ht.split) {
+      return;
+    }
+
+    if (fallback_.queue.empty()) {
+      // Only producers may race with this, and they only move tail.
+      uint64_t desired;
+      do {
+        desired = HeadTail{ht.split, HeadTail{expected}.tail}.line.load(
+            std::memory_order::relaxed);
+      } while (!ht_.line.compare_exchange_weak(expected,
+                                               desired,
+                                               std::memory_order::release,
+                                               std::memory_order::relaxed));
+      return;
+    }
+
+    // Fill the slots that end at split so that the pop half stays contiguous
+    // with the push half.
+    size_t count = std::min(half(), fallback_.queue.size());
+    uint32_t head = wrap(ht.split - count);
+    for (size_t i = 0; i < count; i++) {
+      put(wrap(head + i), fallback_.queue.front());
+      fallback_.queue.pop_front();
+    }
+    fallback_.size.store(fallback_.queue.size(), std::memory_order::relaxed);
+
+    while (!ht_.line.compare_exchange_weak(expected,
+                                           with_head(expected, head),
+                                           std::memory_order::release,
+                                           std::memory_order::relaxed)) {
+    }
   }
 };
 
@@ -0,0 +1,178 @@
+#pragma once
+
+#include <pthread.h>
+#include <sched.h>
+
+#include <chrono>
+#include <concepts>
+#include <cstddef>
+#include <memory>
+#include <optional>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "defs.h"
+#include "mpmc_queue.h"
+#include "numa_topology.h"
+#include "queue_opts.h"
+#include "wait_strategy.h"
+
+namespace theta {
+
+// Multiple-producer, multiple-consumer queue with one MPMCQueue shard per NUMA
+// node, so that threads on different nodes don't share index or slot cache
+// lines. Producers push to their own node's shard. Consumers pop from their own
+// shard first and only steal from other shards, nearest first, when it is
+// empty. Values are FIFO within a shard, but not across shards.
+//
+// The operations without a node argument use the node that the calling thread
+// runs on. Callers that pin their threads, and tests with a fake topology,
+// can pass the node instead.
+//
+// Every shard holds QueueOpts::max_size() values, or kBufferSize if it is
+// fixed at compile time.
+template <std::movable T, size_t kBufferSize = kRuntimeBufferSize>
+class NumaShardedQueue {
+ public:
+  explicit NumaShardedQueue(const QueueOpts& opts,
+                            NumaTopology topology = NumaTopology::from_sysfs())
+      : topology_(std::move(topology)) {
+    shards_.resize(topology_.num_nodes());
+    for (size_t node = 0; node < shards_.size(); node++) {
+      // Linux places a page on the node of the thread that first touches it,
+      // and the constructor writes every slot, so build each shard from a
+      // thread running on its node.
+      std::thread{[&, node]() {
+        pin_to_node(node);
+        shards_[node] = std::make_unique<Shard>(opts, topology_, node);
+      }}.join();
+    }
+  }
+
+  template <typename V>
+    requires std::constructible_from<T, V&&>
+  void push(V&& val) {
+    push(topology_.current_node(), std::forward<V>(val));
+  }
+
+  // Pushes to `node`'s shard, blocking while it is full.
+  template <typename V>
+    requires std::constructible_from<T, V&&>
+  void push(size_t node, V&& val) {
+    shards_[node]->queue.push(T(std::forward<V>(val)));
+    pop_waiters_.notify();
+  }
+
+  template <typename V>
+    requires std::constructible_from<T, V&&>
+  bool try_push(V&& val) {
+    return try_push(topology_.current_node(), std::forward<V>(val));
+  }
+
+  template <typename V>
+    requires std::constructible_from<T, V&&>
+  bool try_push(size_t node, V&& val) {
+    if (!shards_[node]->queue.try_push(T(std::forward<V>(val)))) {
+      return false;
+    }
+    pop_waiters_.notify();
+    return true;
+  }
+
+  std::optional<T> try_pop() { return try_pop(topology_.current_node()); }
+
+  // Pops from `node`'s shard, or steals from the nearest shard that has a
+  // value.
+  std::optional<T> try_pop(size_t node) {
+    Shard& local = *shards_[node];
+    if (auto val = local.queue.try_pop()) {
+      return val;
+    }
+    for (size_t victim : local.steal_order) {
+      if (auto val = shards_[victim]->queue.try_pop()) {
+        return val;
+      }
+    }
+    return {};
+  }
+
+  std::optional<T> pop() { return pop(topology_.current_node()); }
+
+  // Like try_pop(node), but blocks until some shard has a value.
+  std::optional<T> pop(size_t node) {
+    while (true) {
+      if (auto val = try_pop(node)) {
+        return val;
+      }
+      pop_waiters_.wait(std::stop_token{}, [this]() { return size() > 0; });
+    }
+  }
+
+  // Like pop(node), but gives up at `deadline`.
+  template <typename Clock, typename Duration>
+  std::optional<T> pop_until(
+      size_t node, const std::chrono::time_point<Clock, Duration>& deadline) {
+    while (true) {
+      if (auto val = try_pop(node)) {
+        return val;
+      }
+      if (!pop_waiters_.wait_until(deadline,
+                                   [this]() { return size() > 0; })) {
+        return {};
+      }
+    }
+  }
+
+  template <typename Rep, typename Period>
+  std::optional<T> pop_for(size_t node,
+                           const std::chrono::duration<Rep, Period>& timeout) {
+    return pop_until(node, std::chrono::steady_clock::now() + timeout);
+  }
+
+  size_t size() const {
+    size_t size = 0;
+    for (const auto& shard : shards_) {
+      size += shard->queue.size();
+    }
+    return size;
+  }
+
+  size_t size(size_t node) const { return shards_[node]->queue.size(); }
+
+  // The number of values each shard holds.
+  size_t capacity() const { return shards_[0]->queue.capacity(); }
+
+  const NumaTopology& topology() const { return topology_; }
+
+ private:
+  struct Shard {
+    Shard(const QueueOpts& opts, const NumaTopology& topology, size_t node)
+        : queue(opts), steal_order(topology.steal_order(node)) {}
+
+    MPMCQueue<T, kBufferSize> queue;
+    std::vector<size_t> steal_order;
+  };
+
+  NumaTopology topology_;
+  std::vector<std::unique_ptr<Shard>> shards_;
+
+  // Only blocking pops wait on this.
+  alignas(hardware_destructive_interference_size) DeadlineWaiter pop_waiters_;
+
+  // Best effort, since a fake topology may name CPUs that don't exist.
+  void pin_to_node(size_t node) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : topology_.cpus(node)) {
+      if (cpu < CPU_SETSIZE) {
+        CPU_SET(cpu, &set);
+      }
+    }
+    if (CPU_COUNT(&set) > 0) {
+      pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+  }
+};
+
+}  // namespace theta
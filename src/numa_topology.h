@@ -0,0 +1,166 @@
+#pragma once
+
+#include <sched.h>
+
+#include <algorithm>
+#include <charconv>
+#include <cstddef>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <numeric>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "defs.h"
+
+namespace theta {
+
+// The NUMA nodes of a machine, the CPUs in each, and how far apart they are.
+// Tests and single-node machines can build a fake one with uniform().
+class NumaTopology {
+ public:
+  // `distances[i][j]` is the relative cost for node i to access node j's
+  // memory, like in /sys. Without them, every remote node costs the same.
+  explicit NumaTopology(std::vector<std::vector<int>> node_cpus,
+                        std::vector<std::vector<int>> distances = {})
+      : node_cpus_(std::move(node_cpus)), distances_(std::move(distances)) {
+    CHECK(!node_cpus_.empty());
+    if (distances_.empty()) {
+      distances_.assign(num_nodes(), std::vector<int>(num_nodes(), 20));
+      for (size_t i = 0; i < num_nodes(); i++) {
+        distances_[i][i] = 10;
+      }
+    }
+    CHECK(distances_.size() == num_nodes());
+    for (size_t i = 0; i < num_nodes(); i++) {
+      for (int cpu : node_cpus_[i]) {
+        if (cpu >= static_cast<int>(cpu_nodes_.size())) {
+          cpu_nodes_.resize(cpu + 1, 0);
+        }
+        cpu_nodes_[cpu] = i;
+      }
+    }
+  }
+
+  // Reads the nodes under `root`, which is normally /sys/devices/system/node.
+  // Without NUMA support there is no such directory, and this returns a
+  // single node with every CPU.
+  static NumaTopology from_sysfs(
+      const std::filesystem::path& root = "/sys/devices/system/node") {
+    std::vector<std::pair<int, std::filesystem::path>> nodes;
+    std::error_code ec;
+    for (const auto& entry : std::filesystem::directory_iterator(root, ec)) {
+      std::string name = entry.path().filename().string();
+      int id;
+      if (name.starts_with("node")
+          && std::from_chars(name.data() + 4, name.data() + name.size(), id).ec
+                 == std::errc{}) {
+        nodes.emplace_back(id, entry.path());
+      }
+    }
+    if (nodes.empty()) {
+      return uniform(1, std::max(1u, std::thread::hardware_concurrency()));
+    }
+    std::sort(nodes.begin(), nodes.end());
+
+    std::vector<std::vector<int>> node_cpus;
+    std::vector<std::vector<int>> distances;
+    for (const auto& [id, path] : nodes) {
+      node_cpus.push_back(parse_cpulist(read_line(path / "cpulist")));
+      std::istringstream distance_line{read_line(path / "distance")};
+      std::vector<int> row{std::istream_iterator<int>{distance_line}, {}};
+      distances.push_back(std::move(row));
+    }
+    // Distances are indexed by node id, which only matches ours if the ids
+    // have no gaps.
+    bool usable = std::all_of(
+        distances.begin(), distances.end(), [&](const auto& row) {
+          return row.size() == nodes.size();
+        });
+    return NumaTopology{std::move(node_cpus),
+                        usable ? std::move(distances)
+                               : std::vector<std::vector<int>>{}};
+  }
+
+  // `nodes` nodes of `cpus_per_node` CPUs each, numbered consecutively.
+  static NumaTopology uniform(size_t nodes, size_t cpus_per_node) {
+    std::vector<std::vector<int>> node_cpus(nodes);
+    for (size_t i = 0; i < nodes; i++) {
+      node_cpus[i].resize(cpus_per_node);
+      std::iota(node_cpus[i].begin(), node_cpus[i].end(), i * cpus_per_node);
+    }
+    return NumaTopology{std::move(node_cpus)};
+  }
+
+  // Parses a list like "0-3,8,10-11".
+  static std::vector<int> parse_cpulist(std::string_view list) {
+    std::vector<int> cpus;
+    while (!list.empty()) {
+      std::string_view range = list.substr(0, list.find(','));
+      list.remove_prefix(std::min(list.size(), range.size() + 1));
+      int first = 0;
+      auto [end, ec] = std::from_chars(
+          range.data(), range.data() + range.size(), first);
+      if (ec != std::errc{}) {
+        continue;
+      }
+      int last = first;
+      if (end != range.data() + range.size() && *end == '-') {
+        std::from_chars(end + 1, range.data() + range.size(), last);
+      }
+      for (int cpu = first; cpu <= last; cpu++) {
+        cpus.push_back(cpu);
+      }
+    }
+    return cpus;
+  }
+
+  size_t num_nodes() const { return node_cpus_.size(); }
+
+  const std::vector<int>& cpus(size_t node) const { return node_cpus_[node]; }
+
+  int distance(size_t from, size_t to) const { return distances_[from][to]; }
+
+  // The node that `cpu` belongs to, or node 0 if it isn't in any.
+  size_t node_of(int cpu) const {
+    return cpu >= 0 && cpu < static_cast<int>(cpu_nodes_.size())
+             ? cpu_nodes_[cpu]
+             : 0;
+  }
+
+  // The node of the CPU that the calling thread is running on.
+  size_t current_node() const { return node_of(sched_getcpu()); }
+
+  // Every other node, nearest first.
+  std::vector<size_t> steal_order(size_t node) const {
+    std::vector<size_t> order;
+    for (size_t i = 1; i < num_nodes(); i++) {
+      order.push_back((node + i) % num_nodes());
+    }
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+      return distance(node, a) < distance(node, b);
+    });
+    return order;
+  }
+
+ private:
+  std::vector<std::vector<int>> node_cpus_;
+  std::vector<std::vector<int>> distances_;
+  // Indexed by CPU.
+  std::vector<size_t> cpu_nodes_;
+
+  static std::string read_line(const std::filesystem::path& path) {
+    std::ifstream in{path};
+    std::string line;
+    std::getline(in, line);
+    return line;
+  }
+};
+
+}  // namespace theta
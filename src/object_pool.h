@@ -0,0 +1,366 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <concepts>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "defs.h"
+
+namespace theta {
+
+namespace detail {
+
+// The pools that are still alive, so that a thread that exits knows which of
+// its caches it can hand back.
+struct PoolRegistry {
+  static std::mutex& mutex() {
+    static std::mutex mutex;
+    return mutex;
+  }
+
+  static std::unordered_set<uint64_t>& live() {
+    static std::unordered_set<uint64_t> live;
+    return live;
+  }
+
+  static uint64_t next_id() {
+    static std::atomic<uint64_t> next{1};
+    return next.fetch_add(1, std::memory_order::relaxed);
+  }
+};
+
+// A thread's caches, one for each pool that it has used.
+class ThreadCaches {
+ public:
+  struct Entry {
+    uint64_t pool_id;
+    void* pool;
+    void* cache;
+    void (*retire)(void* pool, void* cache);
+  };
+
+  ~ThreadCaches() {
+    std::lock_guard lock{PoolRegistry::mutex()};
+    for (const Entry& e : entries_) {
+      if (PoolRegistry::live().contains(e.pool_id)) {
+        e.retire(e.pool, e.cache);
+      }
+    }
+  }
+
+  void* find(uint64_t pool_id) {
+    if (last_.pool_id == pool_id) {
+      return last_.cache;
+    }
+    for (const Entry& e : entries_) {
+      if (e.pool_id == pool_id) {
+        last_ = e;
+        return e.cache;
+      }
+    }
+    return nullptr;
+  }
+
+  void add(const Entry& entry) {
+    // Drop the caches of pools that are gone, which they freed already.
+    {
+      std::lock_guard lock{PoolRegistry::mutex()};
+      std::erase_if(entries_, [](const Entry& e) {
+        return !PoolRegistry::live().contains(e.pool_id);
+      });
+    }
+    entries_.push_back(entry);
+    last_ = entry;
+  }
+
+  static ThreadCaches& get() {
+    static thread_local ThreadCaches caches;
+    return caches;
+  }
+
+ private:
+  std::vector<Entry> entries_;
+  Entry last_{};
+};
+
+}  // namespace detail
+
+// Fixed-size objects for passing through pointer-carrying queues, in place of
+// new and delete. Each thread allocates from a cache of its own, and an object
+// remembers the cache that handed it out. Freeing it on that thread is a push
+// onto a local list. Freeing it on another thread adds it to a batch for its
+// home cache, which goes back with a single CAS once it has kBatch objects or
+// the next object has a different home, so a consumer that frees what one
+// producer made returns it in bulk. Caches that hold too many objects give
+// batches to a lock-free global list, where any thread can take them.
+//
+// Memory is never given back before the pool is destroyed, and every object
+// must have been freed by then. flush() hands back a thread's partial batch,
+// for threads that stop freeing objects.
+template <typename T>
+class ObjectPool {
+  struct Cache;
+
+ public:
+  static constexpr size_t kBatch = 64;
+
+  ObjectPool() : id_(detail::PoolRegistry::next_id()) {
+    std::lock_guard lock{detail::PoolRegistry::mutex()};
+    detail::PoolRegistry::live().insert(id_);
+  }
+
+  ObjectPool(const ObjectPool&) = delete;
+  ObjectPool& operator=(const ObjectPool&) = delete;
+
+  ~ObjectPool() {
+    std::lock_guard lock{detail::PoolRegistry::mutex()};
+    detail::PoolRegistry::live().erase(id_);
+  }
+
+  template <typename... Args>
+    requires std::constructible_from<T, Args&&...>
+  T* make(Args&&... args) {
+    Cache& cache = local_cache();
+    Node* node = cache.take(*this);
+    try {
+      new (node->storage) T(std::forward<Args>(args)...);
+    } catch (...) {
+      cache.put(node);
+      throw;
+    }
+    node->home = &cache;
+    return reinterpret_cast<T*>(node->storage);
+  }
+
+  void destroy(T* obj) {
+    obj->~T();
+    Node* node = reinterpret_cast<Node*>(obj);
+    Cache& cache = local_cache();
+    if (node->home == &cache) {
+      cache.put(node);
+      if (cache.count > 2 * kBatch) {
+        push_global(cache.take_batch());
+      }
+    } else {
+      cache.free_remote(node);
+    }
+  }
+
+  // Hands back the objects that this thread freed for other threads and
+  // hasn't returned yet.
+  void flush() { local_cache().flush_remote(); }
+
+  // The number of objects that the pool has memory for.
+  size_t capacity() const {
+    std::lock_guard lock{mutex_};
+    return chunks_.size() * kBatch;
+  }
+
+ private:
+  struct Node {
+    // First, so that an object's address is its node's.
+    alignas(T) std::byte storage[sizeof(T)];
+    Cache* home;
+    // Links nodes in a free list or batch.
+    Node* next;
+    // Links batches on the global list, and only set on a batch's first node.
+    std::atomic<Node*> next_batch;
+  };
+
+  struct alignas(hardware_destructive_interference_size) Cache {
+    // Only the owning thread touches these.
+    Node* free{nullptr};
+    size_t count{0};
+    // A batch of objects freed here whose home is remote_home.
+    Cache* remote_home{nullptr};
+    Node* remote_first{nullptr};
+    Node* remote_last{nullptr};
+    size_t remote_count{0};
+
+    // Objects that other threads freed, pushed a batch at a time.
+    alignas(hardware_destructive_interference_size) std::atomic<Node*>
+        returned{nullptr};
+
+    void put(Node* node) {
+      node->next = free;
+      free = node;
+      count++;
+    }
+
+    Node* take(ObjectPool& pool) {
+      if (!free) {
+        refill(pool);
+      }
+      Node* node = free;
+      free = node->next;
+      count--;
+      return node;
+    }
+
+    void refill(ObjectPool& pool) {
+      free = returned.exchange(nullptr, std::memory_order::acquire);
+      if (!free) {
+        free = pool.pop_global();
+      }
+      if (!free) {
+        free = pool.new_chunk();
+      }
+      count = 0;
+      for (Node* n = free; n; n = n->next) {
+        count++;
+      }
+    }
+
+    // Splits kBatch nodes off the free list.
+    Node* take_batch() {
+      Node* first = free;
+      Node* last = first;
+      for (size_t i = 1; i < kBatch; i++) {
+        last = last->next;
+      }
+      free = last->next;
+      last->next = nullptr;
+      count -= kBatch;
+      return first;
+    }
+
+    void free_remote(Node* node) {
+      if (remote_home != node->home) {
+        flush_remote();
+        remote_home = node->home;
+        remote_last = node;
+      }
+      node->next = remote_first;
+      remote_first = node;
+      if (++remote_count == kBatch) {
+        flush_remote();
+      }
+    }
+
+    void flush_remote() {
+      if (!remote_first) {
+        return;
+      }
+      Node* head = remote_home->returned.load(std::memory_order::relaxed);
+      do {
+        remote_last->next = head;
+      } while (!remote_home->returned.compare_exchange_weak(
+          head,
+          remote_first,
+          std::memory_order::release,
+          std::memory_order::relaxed));
+      remote_home = nullptr;
+      remote_first = remote_last = nullptr;
+      remote_count = 0;
+    }
+  };
+
+  // The global list's head is a node address in the low 48 bits, which is
+  // all that x86-64 and AArch64 user space addresses use, and a count of
+  // pops in the top 16 that keeps a stale pop from succeeding.
+  static_assert(sizeof(void*) == 8);
+  static constexpr int kTagShift = 48;
+  static constexpr uint64_t kAddressMask = (uint64_t{1} << kTagShift) - 1;
+
+  const uint64_t id_;
+
+  alignas(hardware_destructive_interference_size) std::atomic<uint64_t>
+      global_{0};
+
+  // Guards chunks_, caches_ and idle_caches_.
+  alignas(hardware_destructive_interference_size) mutable std::mutex mutex_;
+  std::vector<std::unique_ptr<Node[]>> chunks_;
+  std::vector<std::unique_ptr<Cache>> caches_;
+  // Caches of threads that exited, for new threads to take over.
+  std::vector<Cache*> idle_caches_;
+
+  Cache& local_cache() {
+    auto& thread_caches = detail::ThreadCaches::get();
+    if (void* cache = thread_caches.find(id_)) {
+      return *static_cast<Cache*>(cache);
+    }
+
+    Cache* cache;
+    {
+      std::lock_guard lock{mutex_};
+      if (idle_caches_.empty()) {
+        caches_.push_back(std::make_unique<Cache>());
+        cache = caches_.back().get();
+      } else {
+        cache = idle_caches_.back();
+        idle_caches_.pop_back();
+      }
+    }
+    thread_caches.add({id_, this, cache, &retire});
+    return *cache;
+  }
+
+  // Called with the registry locked when a thread exits, which keeps the pool
+  // from going away meanwhile.
+  static void retire(void* pool_ptr, void* cache_ptr) {
+    auto& pool = *static_cast<ObjectPool*>(pool_ptr);
+    auto& cache = *static_cast<Cache*>(cache_ptr);
+    cache.flush_remote();
+    while (cache.count >= kBatch) {
+      pool.push_global(cache.take_batch());
+    }
+    std::lock_guard lock{pool.mutex_};
+    pool.idle_caches_.push_back(&cache);
+  }
+
+  Node* new_chunk() {
+    auto chunk = std::make_unique<Node[]>(kBatch);
+    for (size_t i = 0; i + 1 < kBatch; i++) {
+      chunk[i].next = &chunk[i + 1];
+    }
+    chunk[kBatch - 1].next = nullptr;
+    Node* first = chunk.get();
+    std::lock_guard lock{mutex_};
+    chunks_.push_back(std::move(chunk));
+    return first;
+  }
+
+  void push_global(Node* batch) {
+    uint64_t head = global_.load(std::memory_order::relaxed);
+    uint64_t want;
+    do {
+      batch->next_batch.store(address_of(head), std::memory_order::relaxed);
+      want = (head & ~kAddressMask) | reinterpret_cast<uint64_t>(batch);
+    } while (!global_.compare_exchange_weak(head,
+                                            want,
+                                            std::memory_order::release,
+                                            std::memory_order::relaxed));
+  }
+
+  Node* pop_global() {
+    uint64_t head = global_.load(std::memory_order::acquire);
+    while (Node* batch = address_of(head)) {
+      // `batch` may have been popped and reused since, in which case this
+      // reads a meaningless link, but the tag has changed and the CAS fails.
+      Node* next = batch->next_batch.load(std::memory_order::relaxed);
+      uint64_t want = ((head >> kTagShift) + 1) << kTagShift
+                    | reinterpret_cast<uint64_t>(next);
+      if (global_.compare_exchange_weak(head,
+                                        want,
+                                        std::memory_order::acquire,
+                                        std::memory_order::acquire)) {
+        return batch;
+      }
+    }
+    return nullptr;
+  }
+
+  static Node* address_of(uint64_t head) {
+    return reinterpret_cast<Node*>(head & kAddressMask);
+  }
+};
+
+}  // namespace theta
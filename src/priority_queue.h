@@ -0,0 +1,197 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <concepts>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <stop_token>
+#include <utility>
+
+#include "defs.h"
+#include "mpmc_queue.h"
+#include "queue_opts.h"
+#include "wait_strategy.h"
+
+namespace theta {
+
+// Multiple-producer, multiple-consumer queue with kLanes priority levels, each
+// an MPMCQueue of its own. Lane kLanes - 1 has the highest priority. A bitmap
+// of lanes that may hold values lets a pop find the highest one with a single
+// load and countl_zero, however many lanes there are.
+//
+// By default priorities are strict. A lane with weight w instead lets the
+// lanes below it have one pop after every w pops of its own, so they can't
+// starve. Values are FIFO within a lane.
+//
+// Every lane holds QueueOpts::max_size() values, or kBufferSize if it is
+// fixed at compile time.
+template <std::movable T,
+          size_t kLanes,
+          size_t kBufferSize = kRuntimeBufferSize>
+  requires(kLanes > 0 && kLanes <= 64)
+class PriorityQueue {
+ public:
+  using Weights = std::array<uint32_t, kLanes>;
+
+  PriorityQueue() : PriorityQueue(QueueOpts{}) {}
+
+  PriorityQueue(const QueueOpts& opts, const Weights& weights = {}) {
+    for (size_t i = 0; i < kLanes; i++) {
+      lanes_[i].queue.emplace(opts);
+      lanes_[i].weight = weights[i];
+    }
+  }
+
+  // Pushes `val` to lane `priority`, blocking while that lane is full.
+  template <typename V>
+    requires std::constructible_from<T, V&&>
+  void push(size_t priority, V&& val) {
+    DCHECK(priority < kLanes);
+    lanes_[priority].queue->push(T(std::forward<V>(val)));
+    mark_ready(priority);
+  }
+
+  template <typename V>
+    requires std::constructible_from<T, V&&>
+  bool try_push(size_t priority, V&& val) {
+    DCHECK(priority < kLanes);
+    if (!lanes_[priority].queue->try_push(T(std::forward<V>(val)))) {
+      return false;
+    }
+    mark_ready(priority);
+    return true;
+  }
+
+  // Pops from the highest ready lane, or returns empty if every lane is.
+  std::optional<T> try_pop() {
+    uint64_t ready = ready_.load(std::memory_order::acquire);
+    // Lanes that yielded to the ones below, which are tried again if those
+    // turn out to be empty after all.
+    uint64_t yielded = 0;
+    while (ready != 0) {
+      int lane = 63 - std::countl_zero(ready);
+      uint64_t bit = uint64_t{1} << lane;
+      uint64_t lower = ready & (bit - 1);
+      if (lower != 0 && (yielded & bit) == 0 && yields(lanes_[lane])) {
+        yielded |= bit;
+        ready = lower;
+        continue;
+      }
+      if (auto val = lanes_[lane].queue->try_pop()) {
+        return val;
+      }
+      mark_empty(lane);
+      ready &= ~bit;
+      yielded &= ~bit;
+      if (ready == 0) {
+        ready = yielded;
+      }
+    }
+    return {};
+  }
+
+  // Pops from the highest ready lane, blocking until some lane has a value.
+  std::optional<T> pop() { return pop(std::stop_token{}); }
+
+  // Like pop(), but returns empty once `stop` is requested.
+  std::optional<T> pop(std::stop_token stop) {
+    return pop_waiting(
+        [&](auto ready) { return pop_waiters_.wait(stop, ready); });
+  }
+
+  template <typename Clock, typename Duration>
+  std::optional<T> pop_until(
+      const std::chrono::time_point<Clock, Duration>& deadline) {
+    return pop_waiting([&](auto ready) {
+      return pop_waiters_.wait_until(deadline, ready);
+    });
+  }
+
+  template <typename Rep, typename Period>
+  std::optional<T> pop_for(const std::chrono::duration<Rep, Period>& timeout) {
+    return pop_until(std::chrono::steady_clock::now() + timeout);
+  }
+
+  size_t size() const {
+    size_t size = 0;
+    for (const Lane& lane : lanes_) {
+      size += lane.queue->size();
+    }
+    return size;
+  }
+
+  size_t size(size_t priority) const { return lanes_[priority].queue->size(); }
+
+  // The number of values each lane holds.
+  size_t capacity() const { return lanes_[0].queue->capacity(); }
+
+ private:
+  struct alignas(hardware_destructive_interference_size) Lane {
+    // MPMCQueue can't be moved, so the lanes are constructed in place.
+    std::optional<MPMCQueue<T, kBufferSize>> queue;
+    uint32_t weight{0};
+    // Pops of this lane that had lower lanes ready, for weighted lanes.
+    std::atomic<uint32_t> served{0};
+  };
+
+  std::array<Lane, kLanes> lanes_;
+
+  // Bit i is set whenever lane i may hold values. It may also be set for an
+  // empty lane, until a pop finds the lane empty.
+  alignas(hardware_destructive_interference_size) std::atomic<uint64_t> ready_{
+      0};
+
+  // Only blocking pops wait on this.
+  alignas(hardware_destructive_interference_size) DeadlineWaiter pop_waiters_;
+
+  // Whether a pop should pass over `lane` in favor of the lanes below it.
+  static bool yields(Lane& lane) {
+    if (lane.weight == 0) {
+      return false;
+    }
+    return lane.served.fetch_add(1, std::memory_order::relaxed)
+               % (lane.weight + 1)
+           == lane.weight;
+  }
+
+  void mark_ready(size_t lane) {
+    uint64_t bit = uint64_t{1} << lane;
+    // Pairs with the fence in mark_empty(), so either this sees the bit
+    // cleared or that sees the value pushed.
+    std::atomic_thread_fence(std::memory_order::seq_cst);
+    if ((ready_.load(std::memory_order::relaxed) & bit) == 0) {
+      ready_.fetch_or(bit, std::memory_order::release);
+    }
+    pop_waiters_.notify();
+  }
+
+  void mark_empty(int lane) {
+    uint64_t bit = uint64_t{1} << lane;
+    ready_.fetch_and(~bit, std::memory_order::relaxed);
+    std::atomic_thread_fence(std::memory_order::seq_cst);
+    // A push may have come in since the pop failed.
+    if (lanes_[lane].queue->size() > 0) {
+      ready_.fetch_or(bit, std::memory_order::release);
+    }
+  }
+
+  template <typename Wait>
+  std::optional<T> pop_waiting(Wait&& wait) {
+    while (true) {
+      if (auto val = try_pop()) {
+        return val;
+      }
+      if (!wait([this]() {
+            return ready_.load(std::memory_order::relaxed) != 0;
+          })) {
+        return {};
+      }
+    }
+  }
+};
+
+}  // namespace theta
@@ -11,7 +11,15 @@ class QueueOpts {
     return *this;
   }
 
+  // Only queues with a lane per producer use this.
+  size_t max_producers() const { return max_producers_; }
+  QueueOpts& set_max_producers(size_t val) {
+    max_producers_ = val;
+    return *this;
+  }
+
  private:
   size_t max_size_{hardware_destructive_interference_size};
+  size_t max_producers_{64};
 };
 }  // namespace theta
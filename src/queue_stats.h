@@ -0,0 +1,125 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <concepts>
+#include <cstddef>
+#include <cstdint>
+
+#include "defs.h"
+
+namespace theta {
+
+// What a queue's Stats policy counts.
+enum class QueueCounter {
+  // Pushes and pops that found their slot still held by its previous owner,
+  // and had to wait for it with the wait strategy.
+  kWaits,
+  // Hand-overs of a slot that had a parked waiter, each of which costs a
+  // notify_all().
+  kWakes,
+  // Ticket reservations whose CAS failed and had to be retried.
+  kReserveRetries,
+  // Rounds that a push spun on a slot that a pop hadn't cleared yet.
+  kSlotSpins,
+  kNumCounters,
+};
+
+// A snapshot of a queue's counters. Every field is zero unless the queue was
+// built with ShardedQueueStats.
+struct QueueStats {
+  uint64_t waits{0};
+  uint64_t wakes{0};
+  uint64_t reserve_retries{0};
+  uint64_t slot_spins{0};
+  // The most values that a push has seen in the queue, including its own.
+  uint64_t max_size{0};
+};
+
+// A queue's Stats policy counts the events above. Queues only compute what
+// they pass to it when kEnabled is set.
+template <typename S>
+concept StatsPolicy = requires(S s, const S cs, QueueCounter c, uint64_t n) {
+  { S::kEnabled } -> std::convertible_to<bool>;
+  s.add(c, n);
+  s.observe_size(n);
+  { cs.snapshot() } -> std::same_as<QueueStats>;
+};
+
+// The default, which compiles every count away.
+struct NoQueueStats {
+  static constexpr bool kEnabled = false;
+
+  void add(QueueCounter /*counter*/, uint64_t /*n*/ = 1) {}
+  void observe_size(uint64_t /*size*/) {}
+  QueueStats snapshot() const { return {}; }
+};
+
+// Counts in one of kShards cache lines, picked per thread, so that threads
+// don't share the lines they count in unless there are more than kShards of
+// them. snapshot() adds the shards up, and may miss counts that are still in
+// flight.
+class ShardedQueueStats {
+ public:
+  static constexpr bool kEnabled = true;
+  static constexpr size_t kShards = 16;
+
+  void add(QueueCounter counter, uint64_t n = 1) {
+    if (n > 0) {
+      shard().counts[static_cast<size_t>(counter)].fetch_add(
+          n, std::memory_order::relaxed);
+    }
+  }
+
+  void observe_size(uint64_t size) {
+    std::atomic<uint64_t>& max = shard().max_size;
+    uint64_t seen = max.load(std::memory_order::relaxed);
+    while (size > seen
+           && !max.compare_exchange_weak(
+               seen, size, std::memory_order::relaxed)) {
+    }
+  }
+
+  QueueStats snapshot() const {
+    std::array<uint64_t, kNumCounters> totals{};
+    uint64_t max_size = 0;
+    for (const Shard& shard : shards_) {
+      for (size_t i = 0; i < kNumCounters; i++) {
+        totals[i] += shard.counts[i].load(std::memory_order::relaxed);
+      }
+      max_size = std::max(max_size,
+                          shard.max_size.load(std::memory_order::relaxed));
+    }
+    return QueueStats{
+        .waits = totals[static_cast<size_t>(QueueCounter::kWaits)],
+        .wakes = totals[static_cast<size_t>(QueueCounter::kWakes)],
+        .reserve_retries
+        = totals[static_cast<size_t>(QueueCounter::kReserveRetries)],
+        .slot_spins = totals[static_cast<size_t>(QueueCounter::kSlotSpins)],
+        .max_size = max_size,
+    };
+  }
+
+ private:
+  static constexpr size_t kNumCounters
+      = static_cast<size_t>(QueueCounter::kNumCounters);
+
+  struct alignas(hardware_destructive_interference_size) Shard {
+    std::array<std::atomic<uint64_t>, kNumCounters> counts{};
+    std::atomic<uint64_t> max_size{0};
+  };
+
+  std::array<Shard, kShards> shards_;
+
+  // Threads take shards in the order they first count anything, so the first
+  // kShards threads each get one to themselves.
+  Shard& shard() {
+    static std::atomic<size_t> next_shard{0};
+    static thread_local size_t index
+        = next_shard.fetch_add(1, std::memory_order::relaxed) % kShards;
+    return shards_[index];
+  }
+};
+
+}  // namespace theta
@@ -0,0 +1,345 @@
+#pragma once
+
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cerrno>
+#include <climits>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <optional>
+#include <string>
+#include <type_traits>
+#include <utility>
+
+#include "defs.h"
+
+namespace theta {
+
+// Multiple-producer, multiple-consumer queue that lives entirely in a shared
+// mapping, so that processes on one host can exchange values through it. The
+// layout holds no pointers: a header that describes it, then the slots.
+//
+// Like MPMCQueue, every push and pop takes a ticket from tail or head, and the
+// slot's turn word passes the slot between the two sides. A thread waiting for
+// its turn sets the word's waiting flag and sleeps on a futex that isn't
+// process-private, so a hand-over only makes a syscall when someone sleeps.
+//
+// Values are copied bytewise, so T must be trivially copyable. A process that
+// dies holding a ticket leaves its slot stuck, which blocks the queue.
+template <typename T>
+  requires std::is_trivially_copyable_v<T>
+class SharedMemoryQueue {
+ public:
+  static constexpr uint64_t kMagic = 0x5154484d53544854;  // "THTSMHTQ"
+  static constexpr uint32_t kVersion = 1;
+
+  SharedMemoryQueue(SharedMemoryQueue&& other)
+      : fd_(std::exchange(other.fd_, -1)),
+        header_(std::exchange(other.header_, nullptr)),
+        bytes_(other.bytes_) {}
+
+  SharedMemoryQueue& operator=(SharedMemoryQueue&& other) {
+    std::swap(fd_, other.fd_);
+    std::swap(header_, other.header_);
+    std::swap(bytes_, other.bytes_);
+    return *this;
+  }
+
+  ~SharedMemoryQueue() {
+    if (header_) {
+      munmap(header_, bytes_);
+    }
+    if (fd_ >= 0) {
+      close(fd_);
+    }
+  }
+
+  // Creates a queue for at least `capacity` values in an anonymous memfd.
+  // Other processes can attach to fd() once they have it, by inheriting it or
+  // receiving it over a Unix socket. Returns empty with errno set on failure.
+  static std::optional<SharedMemoryQueue> create(size_t capacity) {
+    return create_in(memfd_create("theta_shared_memory_queue", MFD_CLOEXEC),
+                     capacity);
+  }
+
+  // Like create(), but in a new POSIX shared memory object named `name`,
+  // which must not exist yet.
+  static std::optional<SharedMemoryQueue> create(const std::string& name,
+                                                 size_t capacity) {
+    return create_in(
+        shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600),
+        capacity);
+  }
+
+  // Maps the queue in `fd`, which this takes a duplicate of. Returns empty
+  // with errno set to EINVAL if `fd` doesn't hold a queue of T, or to EAGAIN
+  // if its creator hasn't finished setting it up.
+  static std::optional<SharedMemoryQueue> attach(int fd) {
+    return attach_to(fcntl(fd, F_DUPFD_CLOEXEC, 0));
+  }
+
+  static std::optional<SharedMemoryQueue> attach(const std::string& name) {
+    return attach_to(shm_open(name.c_str(), O_RDWR | O_CLOEXEC, 0));
+  }
+
+  // Removes the name of a queue made with create(name, ...). Processes that
+  // have it mapped keep using it.
+  static bool unlink(const std::string& name) {
+    return shm_unlink(name.c_str()) == 0;
+  }
+
+  void push(const T& val) {
+    uint64_t ticket = header_->tail.fetch_add(1, std::memory_order::relaxed);
+    put(ticket, val);
+  }
+
+  bool try_push(const T& val) {
+    uint64_t ticket = header_->tail.load(std::memory_order::relaxed);
+    while (true) {
+      uint32_t turn = slot(ticket).turn.load(std::memory_order::acquire);
+      if (turn_value(turn) != push_turn(ticket)) {
+        // The slot still holds the value from the previous lap, unless
+        // another producer took this ticket already.
+        uint64_t tail = header_->tail.load(std::memory_order::relaxed);
+        if (tail == ticket) {
+          return false;
+        }
+        ticket = tail;
+        continue;
+      }
+      if (header_->tail.compare_exchange_weak(ticket,
+                                              ticket + 1,
+                                              std::memory_order::relaxed,
+                                              std::memory_order::relaxed)) {
+        put(ticket, val);
+        return true;
+      }
+    }
+  }
+
+  T pop() {
+    uint64_t ticket = header_->head.fetch_add(1, std::memory_order::relaxed);
+    return take(ticket);
+  }
+
+  std::optional<T> try_pop() {
+    uint64_t ticket = header_->head.load(std::memory_order::relaxed);
+    while (true) {
+      uint32_t turn = slot(ticket).turn.load(std::memory_order::acquire);
+      if (turn_value(turn) != pop_turn(ticket)) {
+        uint64_t head = header_->head.load(std::memory_order::relaxed);
+        if (head == ticket) {
+          return {};
+        }
+        ticket = head;
+        continue;
+      }
+      if (header_->head.compare_exchange_weak(ticket,
+                                              ticket + 1,
+                                              std::memory_order::relaxed,
+                                              std::memory_order::relaxed)) {
+        return take(ticket);
+      }
+    }
+  }
+
+  // Pushes that are still blocked count as well.
+  size_t size() const {
+    uint64_t head = header_->head.load(std::memory_order::acquire);
+    uint64_t tail = header_->tail.load(std::memory_order::acquire);
+    return tail > head ? std::min<uint64_t>(tail - head, capacity()) : 0;
+  }
+
+  size_t capacity() const { return header_->capacity; }
+
+  // The descriptor of the mapping, for handing to other processes.
+  int fd() const { return fd_; }
+
+  // The size of the mapping that holds a queue of `capacity` values.
+  static size_t mapping_size(size_t capacity) {
+    return sizeof(Header) + std::bit_ceil(capacity) * sizeof(Slot);
+  }
+
+ private:
+  // Everything that other processes see. Fields only ever hold offsets and
+  // counts, never addresses.
+  struct Header {
+    // Written last by the creator, so attach() knows the rest is ready.
+    std::atomic<uint64_t> magic;
+    uint32_t version;
+    uint32_t value_size;
+    uint64_t capacity;
+    alignas(hardware_destructive_interference_size) std::atomic<uint64_t> head;
+    alignas(hardware_destructive_interference_size) std::atomic<uint64_t> tail;
+  };
+
+  // Futexes are 32 bits, so the turn is the ticket's lap, times two for the
+  // two sides, modulo 2^31. Laps only need to differ from the ones a slot
+  // may still see, so this never wraps into a turn that is in use.
+  struct Slot {
+    alignas(hardware_constructive_interference_size)
+        std::atomic<uint32_t> turn;
+    T value;
+  };
+
+  static_assert(std::atomic<uint64_t>::is_always_lock_free);
+  static_assert(std::atomic<uint32_t>::is_always_lock_free);
+  static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t));
+
+  static constexpr uint32_t kWaitingFlag = uint32_t{1} << 31;
+
+  int fd_;
+  Header* header_;
+  size_t bytes_;
+
+  SharedMemoryQueue(int fd, Header* header, size_t bytes)
+      : fd_(fd), header_(header), bytes_(bytes) {}
+
+  static std::optional<SharedMemoryQueue> create_in(int fd, size_t capacity) {
+    if (fd < 0) {
+      return {};
+    }
+    if (capacity == 0 || capacity > (size_t{1} << 40)) {
+      close(fd);
+      errno = EINVAL;
+      return {};
+    }
+    size_t bytes = mapping_size(capacity);
+    if (ftruncate(fd, bytes) != 0) {
+      close(fd);
+      return {};
+    }
+    auto* header = static_cast<Header*>(map(fd, bytes));
+    if (!header) {
+      close(fd);
+      return {};
+    }
+
+    // ftruncate() zero-filled the file, which is a valid state for every
+    // atomic, and turn 0 lets the first lap push.
+    header->version = kVersion;
+    header->value_size = sizeof(T);
+    header->capacity = std::bit_ceil(capacity);
+    header->magic.store(kMagic, std::memory_order::release);
+    return SharedMemoryQueue{fd, header, bytes};
+  }
+
+  static std::optional<SharedMemoryQueue> attach_to(int fd) {
+    if (fd < 0) {
+      return {};
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+      close(fd);
+      return {};
+    }
+    size_t bytes = st.st_size;
+    if (bytes < sizeof(Header)) {
+      close(fd);
+      errno = EINVAL;
+      return {};
+    }
+    auto* header = static_cast<Header*>(map(fd, bytes));
+    if (!header) {
+      close(fd);
+      return {};
+    }
+
+    SharedMemoryQueue queue{fd, header, bytes};
+    uint64_t magic = header->magic.load(std::memory_order::acquire);
+    if (magic == 0) {
+      errno = EAGAIN;
+      return {};
+    }
+    if (magic != kMagic || header->version != kVersion
+        || header->value_size != sizeof(T)
+        || !std::has_single_bit(header->capacity)
+        || mapping_size(header->capacity) != bytes) {
+      errno = EINVAL;
+      return {};
+    }
+    return queue;
+  }
+
+  static void* map(int fd, size_t bytes) {
+    void* addr
+        = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    return addr == MAP_FAILED ? nullptr : addr;
+  }
+
+  Slot& slot(uint64_t ticket) const {
+    auto* slots = reinterpret_cast<Slot*>(header_ + 1);
+    return slots[ticket & (header_->capacity - 1)];
+  }
+
+  uint32_t push_turn(uint64_t ticket) const {
+    return (2 * (ticket / header_->capacity)) & ~kWaitingFlag;
+  }
+
+  uint32_t pop_turn(uint64_t ticket) const {
+    return (2 * (ticket / header_->capacity) + 1) & ~kWaitingFlag;
+  }
+
+  static uint32_t turn_value(uint32_t turn) { return turn & ~kWaitingFlag; }
+
+  void put(uint64_t ticket, const T& val) {
+    Slot& s = slot(ticket);
+    wait_for_turn(s.turn, push_turn(ticket));
+    s.value = val;
+    hand_over(s.turn, pop_turn(ticket));
+  }
+
+  T take(uint64_t ticket) {
+    Slot& s = slot(ticket);
+    wait_for_turn(s.turn, pop_turn(ticket));
+    T val = s.value;
+    hand_over(s.turn, push_turn(ticket + header_->capacity));
+    return val;
+  }
+
+  static void wait_for_turn(std::atomic<uint32_t>& turn, uint32_t want) {
+    uint32_t observed = turn.load(std::memory_order::acquire);
+    while (turn_value(observed) != want) {
+      // Set the waiting flag so that the hand-over knows to wake us, then
+      // sleep unless the turn changed in between.
+      uint32_t waiting = observed | kWaitingFlag;
+      if (observed == waiting
+          || turn.compare_exchange_weak(observed,
+                                        waiting,
+                                        std::memory_order::acquire,
+                                        std::memory_order::acquire)) {
+        futex(&turn, FUTEX_WAIT, waiting);
+        observed = turn.load(std::memory_order::acquire);
+      }
+    }
+  }
+
+  static void hand_over(std::atomic<uint32_t>& turn, uint32_t next) {
+    if (turn.exchange(next, std::memory_order::release) & kWaitingFlag) {
+      futex(&turn, FUTEX_WAKE, INT_MAX);
+    }
+  }
+
+  // Without FUTEX_PRIVATE_FLAG, the kernel keys the futex on the underlying
+  // page, so it works across processes that map it at different addresses.
+  static void futex(std::atomic<uint32_t>* addr, int op, uint32_t val) {
+    syscall(SYS_futex,
+            reinterpret_cast<uint32_t*>(addr),
+            op,
+            val,
+            nullptr,
+            nullptr,
+            0);
+  }
+};
+
+}  // namespace theta
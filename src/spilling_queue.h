@@ -0,0 +1,298 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstring>
+#include <filesystem>
+#include <mutex>
+#include <optional>
+#include <type_traits>
+#include <utility>
+
+#include "defs.h"
+#include "mpmc_queue.h"
+#include "queue_opts.h"
+#include "wait_strategy.h"
+
+namespace theta {
+
+class SpillOpts {
+ public:
+  // Where the spill file goes. It has no name, and disappears with the queue.
+  const std::filesystem::path& dir() const { return dir_; }
+  SpillOpts& set_dir(std::filesystem::path val) {
+    dir_ = std::move(val);
+    return *this;
+  }
+
+  // The most the spill file may hold. Pushes block once it is full.
+  size_t max_bytes() const { return max_bytes_; }
+  SpillOpts& set_max_bytes(size_t val) {
+    max_bytes_ = val;
+    return *this;
+  }
+
+ private:
+  std::filesystem::path dir_{std::filesystem::temp_directory_path()};
+  size_t max_bytes_{size_t{1} << 30};
+};
+
+// Multiple-producer, multiple-consumer queue that overflows to disk instead of
+// blocking. Values go to an MPMCQueue while it has room. Once it is full they
+// are appended to a memory-mapped spill file, and every later push goes there
+// too until consumers have drained it, so each producer's values stay in
+// order. A consumer that finds the ring empty moves as many spilled values
+// back into it as fit.
+//
+// The spill file is only created on the first overflow. If that fails, the
+// queue behaves like a plain bounded MPMCQueue.
+template <typename T, size_t kBufferSize = kRuntimeBufferSize>
+  requires std::is_trivially_copyable_v<T>
+           && std::is_default_constructible_v<T>
+class SpillingQueue {
+ public:
+  SpillingQueue() : SpillingQueue(QueueOpts{}) {}
+
+  SpillingQueue(const QueueOpts& opts, SpillOpts spill_opts = {})
+      : ring_(opts), spill_opts_(std::move(spill_opts)) {}
+
+  ~SpillingQueue() {
+    if (map_) {
+      munmap(map_, bytes_);
+    }
+    if (fd_ >= 0) {
+      close(fd_);
+    }
+  }
+
+  // Blocks only while the spill file is full, or the ring is if the spill file
+  // can't take any values.
+  void push(const T& val) {
+    push_quiet(val);
+    pop_waiters_.notify();
+  }
+
+  // Returns false if both the ring and the spill file are full.
+  bool try_push(const T& val) {
+    if (!try_push_quiet(val)) {
+      return false;
+    }
+    pop_waiters_.notify();
+    return true;
+  }
+
+  std::optional<T> try_pop() {
+    if (auto val = ring_.try_pop()) {
+      return val;
+    }
+    if (!spilling_.load(std::memory_order::acquire)) {
+      return {};
+    }
+    return refill();
+  }
+
+  T pop() {
+    while (true) {
+      if (auto val = pop_for(std::chrono::hours{1})) {
+        return *val;
+      }
+    }
+  }
+
+  template <typename Rep, typename Period>
+  std::optional<T> pop_for(const std::chrono::duration<Rep, Period>& timeout) {
+    auto deadline = std::chrono::steady_clock::now() + timeout;
+    while (true) {
+      if (auto val = try_pop()) {
+        return val;
+      }
+      // Consumers wait here rather than on the ring, so that spilled values
+      // wake them too.
+      if (!pop_waiters_.wait_until(deadline,
+                                   [this]() { return size() > 0; })) {
+        return {};
+      }
+    }
+  }
+
+  size_t size() const {
+    return ring_.size() + spilled_.load(std::memory_order::relaxed);
+  }
+
+  size_t spilled() const { return spilled_.load(std::memory_order::relaxed); }
+
+  // The number of values the ring holds, not counting the spill file.
+  size_t capacity() const { return ring_.capacity(); }
+
+ private:
+  // Disk space is allocated this far ahead of the write position, so that
+  // running out of it fails a push instead of raising SIGBUS.
+  static constexpr size_t kAllocateChunk = size_t{1} << 20;
+
+  MPMCQueue<T, kBufferSize> ring_;
+  SpillOpts spill_opts_;
+
+  // Set while the spill file holds values, which sends every push there.
+  alignas(hardware_destructive_interference_size) std::atomic<bool> spilling_{
+      false};
+  std::atomic<size_t> spilled_{0};
+
+  // Every push notifies this, whether its value went to the ring or the spill
+  // file.
+  alignas(hardware_destructive_interference_size) DeadlineWaiter pop_waiters_;
+
+  // Everything below is guarded by mutex_.
+  alignas(hardware_destructive_interference_size) std::mutex mutex_;
+  // Notified when the spill file has been drained.
+  std::condition_variable space_;
+  int fd_{-1};
+  std::byte* map_{nullptr};
+  size_t bytes_{0};
+  bool file_failed_{false};
+  size_t read_pos_{0};
+  size_t write_pos_{0};
+  size_t allocated_{0};
+  size_t released_{0};
+
+  void push_quiet(const T& val) {
+    if (!spilling_.load(std::memory_order::acquire) && ring_.try_push(val)) {
+      return;
+    }
+    std::unique_lock lock{mutex_};
+    while (!push_locked(val)) {
+      // space_ is only notified once spilled values drain, so without any,
+      // wait for room in the ring instead. That also covers a spill file
+      // that ran out of disk space before it held anything.
+      if (file_failed_ || !spilling_.load(std::memory_order::relaxed)) {
+        lock.unlock();
+        ring_.push(val);
+        return;
+      }
+      space_.wait(lock);
+    }
+  }
+
+  bool try_push_quiet(const T& val) {
+    if (!spilling_.load(std::memory_order::acquire) && ring_.try_push(val)) {
+      return true;
+    }
+    std::lock_guard lock{mutex_};
+    return push_locked(val);
+  }
+
+  bool push_locked(const T& val) {
+    // The last spilled value may have been taken since the caller looked.
+    if (!spilling_.load(std::memory_order::relaxed) && ring_.try_push(val)) {
+      return true;
+    }
+    if (!open_file() || !reserve(sizeof(T))) {
+      return false;
+    }
+    std::memcpy(map_ + write_pos_, &val, sizeof(T));
+    write_pos_ += sizeof(T);
+    spilled_.fetch_add(1, std::memory_order::relaxed);
+    spilling_.store(true, std::memory_order::release);
+    return true;
+  }
+
+  // Takes the oldest spilled value, and moves the ones after it into the
+  // ring while it has room.
+  std::optional<T> refill() {
+    std::lock_guard lock{mutex_};
+    if (read_pos_ == write_pos_) {
+      return {};
+    }
+    T first = read();
+    size_t moved = 1;
+    while (read_pos_ < write_pos_) {
+      T val;
+      std::memcpy(&val, map_ + read_pos_, sizeof(T));
+      if (!ring_.try_push(val)) {
+        break;
+      }
+      read_pos_ += sizeof(T);
+      moved++;
+    }
+    spilled_.fetch_sub(moved, std::memory_order::relaxed);
+
+    if (read_pos_ == write_pos_) {
+      // Start over at the front of the file.
+      release(allocated_);
+      read_pos_ = write_pos_ = allocated_ = released_ = 0;
+      spilling_.store(false, std::memory_order::release);
+      space_.notify_all();
+    } else {
+      size_t page = sysconf(_SC_PAGESIZE);
+      release(read_pos_ / page * page);
+    }
+    return first;
+  }
+
+  T read() {
+    T val;
+    std::memcpy(&val, map_ + read_pos_, sizeof(T));
+    read_pos_ += sizeof(T);
+    return val;
+  }
+
+  bool open_file() {
+    if (map_) {
+      return true;
+    }
+    if (file_failed_) {
+      return false;
+    }
+    bytes_ = spill_opts_.max_bytes() / sizeof(T) * sizeof(T);
+    fd_ = open(
+        spill_opts_.dir().c_str(), O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if (bytes_ == 0 || fd_ < 0 || ftruncate(fd_, bytes_) != 0) {
+      file_failed_ = true;
+      return false;
+    }
+    void* addr
+        = mmap(nullptr, bytes_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+    if (addr == MAP_FAILED) {
+      file_failed_ = true;
+      return false;
+    }
+    map_ = static_cast<std::byte*>(addr);
+    madvise(map_, bytes_, MADV_SEQUENTIAL);
+    return true;
+  }
+
+  // Makes sure that the next `n` bytes after write_pos_ are backed by disk.
+  bool reserve(size_t n) {
+    if (write_pos_ + n > bytes_) {
+      return false;
+    }
+    while (write_pos_ + n > allocated_) {
+      size_t len = std::min(kAllocateChunk, bytes_ - allocated_);
+      if (fallocate(fd_, 0, allocated_, len) != 0) {
+        return false;
+      }
+      allocated_ += len;
+    }
+    return true;
+  }
+
+  // Punches a hole up to `end`, which gives back its disk space and page
+  // cache.
+  void release(size_t end) {
+    if (end > released_) {
+      fallocate(fd_,
+                FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                released_,
+                end - released_);
+      released_ = end;
+    }
+  }
+};
+
+}  // namespace theta
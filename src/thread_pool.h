@@ -0,0 +1,270 @@
+#pragma once
+
+#include <pthread.h>
+#include <sched.h>
+
+#include <algorithm>
+#include <atomic>
+#include <concepts>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <optional>
+#include <span>
+#include <stdexcept>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <variant>
+#include <vector>
+
+#include "defs.h"
+#include "mpmc_queue.h"
+#include "queue_opts.h"
+
+namespace theta {
+
+class ThreadPool;
+
+// Work for a ThreadPool. The pool never owns or allocates tasks: whoever
+// submits a task keeps it alive until it has run, and can wait for that on the
+// task itself. A task can be submitted again once it is done.
+//
+// run() must not throw. PackagedTask catches exceptions for its callable.
+class Task {
+ public:
+  virtual ~Task() = default;
+
+  bool is_done() const { return done_.load(std::memory_order::acquire); }
+
+  // Blocks until the task has run. The task must have been submitted.
+  void wait() const;
+
+ protected:
+  virtual void run() = 0;
+
+  // Called instead of run() when the pool is shut down before the task could
+  // be queued.
+  virtual void cancel() {}
+
+ private:
+  friend class ThreadPool;
+
+  std::atomic<bool> done_{false};
+  ThreadPool* pool_{nullptr};
+};
+
+// Runs `F` and keeps its result or exception, like std::packaged_task, but
+// the state that get() waits on lives in the task instead of on the heap.
+template <std::invocable F>
+class PackagedTask : public Task {
+ public:
+  using Result = std::invoke_result_t<F&>;
+
+  explicit PackagedTask(F f) : f_(std::move(f)) {}
+
+  // Waits for the task to run and returns its result, or rethrows what it
+  // threw.
+  Result get() {
+    wait();
+    if (error_) {
+      std::rethrow_exception(error_);
+    }
+    if constexpr (!std::is_void_v<Result>) {
+      return std::move(*result_);
+    }
+  }
+
+ protected:
+  void run() override {
+    // The task may have run before.
+    error_ = nullptr;
+    if constexpr (!std::is_void_v<Result>) {
+      result_.reset();
+    }
+    try {
+      if constexpr (std::is_void_v<Result>) {
+        std::invoke(f_);
+      } else {
+        result_.emplace(std::invoke(f_));
+      }
+    } catch (...) {
+      error_ = std::current_exception();
+    }
+  }
+
+  void cancel() override {
+    error_ = std::make_exception_ptr(
+        std::runtime_error("ThreadPool shut down before the task ran"));
+    if constexpr (!std::is_void_v<Result>) {
+      result_.reset();
+    }
+  }
+
+ private:
+  F f_;
+  [[no_unique_address]] std::conditional_t<std::is_void_v<Result>,
+                                           std::monostate,
+                                           std::optional<Result>>
+      result_;
+  std::exception_ptr error_;
+};
+
+class ThreadPoolOpts {
+ public:
+  size_t num_workers() const { return num_workers_; }
+  ThreadPoolOpts& set_num_workers(size_t val) {
+    num_workers_ = val;
+    return *this;
+  }
+
+  // The number of submitted tasks that may wait for a worker before submit()
+  // blocks.
+  size_t max_queued() const { return max_queued_; }
+  ThreadPoolOpts& set_max_queued(size_t val) {
+    max_queued_ = val;
+    return *this;
+  }
+
+  // Worker i is pinned to cpus()[i % cpus().size()]. No pinning if empty.
+  const std::vector<int>& cpus() const { return cpus_; }
+  ThreadPoolOpts& set_cpus(std::vector<int> val) {
+    cpus_ = std::move(val);
+    return *this;
+  }
+
+ private:
+  size_t num_workers_{std::max(1u, std::thread::hardware_concurrency())};
+  size_t max_queued_{1024};
+  std::vector<int> cpus_;
+};
+
+// A fixed set of workers that run tasks from one MPMCQueue<Task*>. Workers
+// park in the queue while it's empty, and the destructor closes the queue, so
+// shutdown needs no sentinel tasks.
+class ThreadPool {
+ public:
+  ThreadPool() : ThreadPool(ThreadPoolOpts{}) {}
+
+  ThreadPool(const ThreadPoolOpts& opts)
+      : queue_(QueueOpts{}.set_max_size(opts.max_queued())) {
+    CHECK(opts.num_workers() > 0);
+    workers_.reserve(opts.num_workers());
+    for (size_t i = 0; i < opts.num_workers(); i++) {
+      workers_.emplace_back([this]() { work(); });
+      if (!opts.cpus().empty()) {
+        pin(workers_.back(), opts.cpus()[i % opts.cpus().size()]);
+      }
+    }
+  }
+
+  // Runs every task that was submitted before returning.
+  ~ThreadPool() {
+    queue_.close();
+    for (auto& worker : workers_) {
+      worker.join();
+    }
+  }
+
+  // Queues `task`, blocking while max_queued() tasks are already waiting.
+  // Returns false once the pool is being destroyed, in which case the task is
+  // cancelled and done without running.
+  bool submit(Task& task) {
+    prepare(task);
+    if (!queue_.push(&task)) {
+      cancel(task);
+      return false;
+    }
+    return true;
+  }
+
+  // Queues every task with a single reservation, so they start in order. Like
+  // submit(), this cancels every task and returns false once the pool is being
+  // destroyed.
+  bool submit_bulk(std::span<Task* const> tasks) {
+    for (Task* task : tasks) {
+      prepare(*task);
+    }
+    if (!queue_.push_n(tasks)) {
+      for (Task* task : tasks) {
+        cancel(*task);
+      }
+      return false;
+    }
+    return true;
+  }
+
+  size_t num_workers() const { return workers_.size(); }
+
+ private:
+  friend class Task;
+
+  MPMCQueue<Task*> queue_;
+  std::vector<std::thread> workers_;
+
+  // An eventcount for Task::wait(). Finishing a task costs a fence and a load
+  // while nobody waits. Tasks may be destroyed as soon as they are done, so
+  // this lives in the pool rather than in each task.
+  alignas(hardware_destructive_interference_size) std::atomic<uint32_t>
+      waiters_{0};
+  alignas(hardware_destructive_interference_size) std::atomic<uint32_t>
+      epoch_{0};
+
+  void prepare(Task& task) {
+    DCHECK(task.pool_ == nullptr || task.is_done());
+    task.pool_ = this;
+    task.done_.store(false, std::memory_order::relaxed);
+  }
+
+  void cancel(Task& task) {
+    task.cancel();
+    finish(task);
+  }
+
+  // Best effort, since the process may not be allowed to run on `cpu`.
+  static void pin(std::thread& thread, int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set);
+  }
+
+  void work() {
+    while (std::optional<Task*> task = queue_.pop()) {
+      (*task)->run();
+      finish(**task);
+    }
+  }
+
+  void finish(Task& task) {
+    task.done_.store(true, std::memory_order::release);
+    // Pairs with the increment in wait(), so either the waiter sees done_ or
+    // this sees the waiter. `task` may be gone from here on.
+    std::atomic_thread_fence(std::memory_order::seq_cst);
+    if (waiters_.load(std::memory_order::relaxed) > 0) {
+      epoch_.fetch_add(1, std::memory_order::release);
+      epoch_.notify_all();
+    }
+  }
+
+  void wait(const Task& task) {
+    waiters_.fetch_add(1, std::memory_order::seq_cst);
+    while (true) {
+      uint32_t epoch = epoch_.load(std::memory_order::seq_cst);
+      if (task.is_done()) {
+        break;
+      }
+      epoch_.wait(epoch, std::memory_order::acquire);
+    }
+    waiters_.fetch_sub(1, std::memory_order::relaxed);
+  }
+};
+
+inline void Task::wait() const {
+  if (!is_done()) {
+    DCHECK(pool_);
+    pool_->wait(*this);
+  }
+}
+
+}  // namespace theta
@@ -1,16 +1,68 @@
 #pragma once
 
+#include <algorithm>
+#include <bit>
+#include <utility>
+
+#include "defs.h"
 #include "packed_atomic.h"
 
 namespace theta {
 
+// Passing this as a queue's kBufferSize defers the buffer size to the
+// QueueOpts that the queue is constructed with.
+inline constexpr size_t kRuntimeBufferSize = 0;
+
+// Describes how tickets map onto a ring buffer. When the size is known at
+// compile time, this is an empty type and every value folds into a constant.
+template <size_t kBufferSize>
+struct BufferGeometry {
+  static_assert((kBufferSize & (kBufferSize - 1)) == 0, "");
+
+  constexpr BufferGeometry() = default;
+  explicit constexpr BufferGeometry(size_t /*min_size*/) {}
+
+  static constexpr uint64_t size() { return kBufferSize; }
+  static constexpr uint64_t mask() { return kBufferSize - 1; }
+};
+
+template <>
+struct BufferGeometry<kRuntimeBufferSize> {
+  explicit BufferGeometry(size_t min_size)
+      : size_(std::bit_ceil(min_size)), mask_(size_ - 1) {}
+
+  uint64_t size() const { return size_; }
+  uint64_t mask() const { return mask_; }
+
+ private:
+  uint64_t size_;
+  uint64_t mask_;
+};
+
+// Swaps the low kBits of `index`, which pick a slot within a cache line, with
+// the next kBits, which pick the cache line. Consecutive indexes then land on
+// different cache lines without padding the slots. This is the same mapping as
+// atomic_queue::details::remap_index.
+template <int kBits>
+constexpr uint64_t remap_index(uint64_t index) {
+  constexpr uint64_t kMixMask = (uint64_t{1} << kBits) - 1;
+  uint64_t mix = (index ^ (index >> kBits)) & kMixMask;
+  return index ^ mix ^ (mix << kBits);
+}
+
+// How many index bits remap_index() should shuffle for slots of `slot_size`
+// bytes. Slots that fill a whole cache line don't need shuffling.
+constexpr int shuffle_bits(size_t slot_size) {
+  size_t per_line = hardware_constructive_interference_size / slot_size;
+  return per_line <= 1 ? 0 : std::countr_zero(std::bit_floor(per_line));
+}
+
 template <size_t kBufferSize>
 struct Tag {
   using RawType = uint64_t;
   using ContainingType = PackedAtomic<RawType>::ContainingType;
   using AtomicContainingType = PackedAtomic<RawType>::AtomicContainingType;
-
-  static_assert((kBufferSize & (kBufferSize - 1)) == 0, "");
+  using Geometry = BufferGeometry<kBufferSize>;
 
   // An kIncrement value of
   //   kIncrement = 1 + hardware_destructive_interference_size / sizeof(T)
@@ -20,10 +72,11 @@ struct Tag {
   static constexpr RawType kIncrement = 1;
   // static constexpr RawType kIncrement =
   //     1 + hardware_destructive_interference_size / sizeof(T);
-  static constexpr RawType kBufferWrapDelta = kBufferSize * kIncrement;
-  static constexpr RawType kBufferSizeMask = kBufferSize - 1;
   static constexpr RawType kConsumerFlag = (1ULL << 63);
   static constexpr RawType kWaitingFlag = (1ULL << 62);
+  // Set on the producer counter once a queue is closed, and on slot tags to
+  // wake up anything waiting on them.
+  static constexpr RawType kClosedFlag = (1ULL << 61);
 
   PackedAtomic<RawType> raw;
 
@@ -52,27 +105,44 @@ struct Tag {
 
   auto operator<=>(const Tag&) const = default;
 
-  std::string DebugString() const {
+  // Methods that depend on the buffer size take a Geometry. It only needs to
+  // be passed explicitly when the size is chosen at runtime.
+  static RawType wrap_delta(const Geometry& geometry) {
+    return geometry.size() * kIncrement;
+  }
+
+  std::string DebugString(const Geometry& geometry = Geometry{}) const {
     return "Tag<" + std::string(is_producer() ? "P" : "C")
-         + (is_waiting() ? std::string("|W") : "") + ">{"
-         + std::to_string(value()) + "@" + std::to_string(to_index()) + "}";
+         + (is_waiting() ? std::string("|W") : "")
+         + (is_closed() ? std::string("|X") : "") + ">{"
+         + std::to_string(value()) + "@" + std::to_string(to_index(geometry))
+         + "}";
   }
 
-  RawType value() const { return (raw.get<0>() << 2) >> 2; }
-  RawType value_atomic() const { return (raw.get_atomic<0>() << 2) >> 2; }
+  RawType value() const { return (raw.get<0>() << 3) >> 3; }
+  RawType value_atomic() const { return (raw.get_atomic<0>() << 3) >> 3; }
 
-  Tag prev_paired_tag() const {
+  Tag prev_paired_tag(const Geometry& geometry = Geometry{}) const {
     if (is_consumer()) {
-      return Tag{(raw.get<0>() ^ kConsumerFlag) & ~kWaitingFlag};
+      return Tag{(raw.get<0>() ^ kConsumerFlag)
+                 & ~(kWaitingFlag | kClosedFlag)};
     } else {
-      return Tag{((raw.get<0>() - kBufferWrapDelta) ^ kConsumerFlag)
-                 & ~kWaitingFlag};
+      return Tag{((raw.get<0>() - wrap_delta(geometry)) ^ kConsumerFlag)
+                 & ~(kWaitingFlag | kClosedFlag)};
     }
   }
 
-  bool is_paired(Tag observed_tag) const {
-    return prev_paired_tag().raw.template get<0>()
-        == (observed_tag.raw.template get<0>() & ~kWaitingFlag);
+  bool is_paired(Tag observed_tag,
+                 const Geometry& geometry = Geometry{}) const {
+    return prev_paired_tag(geometry).raw.template get<0>()
+        == (observed_tag.raw.template get<0>()
+            & ~(kWaitingFlag | kClosedFlag));
+  }
+
+  // Whether both tags are the same ticket with the same owner, ignoring the
+  // waiting flag.
+  bool matches(Tag other) const {
+    return ((raw.get<0>() ^ other.raw.template get<0>()) & ~kWaitingFlag) == 0;
   }
 
   bool is_producer() const { return (raw.get<0>() & kConsumerFlag) == 0; }
@@ -89,36 +159,116 @@ struct Tag {
 
   void clear_waiting_flag() { raw.set<0>(raw.get<0>() & ~kWaitingFlag); }
 
-  int to_index() const { return raw.get<0>() & kBufferSizeMask; }
+  void mark_as_closed() { raw.set<0>(raw.get<0>() | kClosedFlag); }
 
-  Tag<kBufferSize> reserve() {
-    return Tag<kBufferSize>{
-        static_cast<RawType>(raw.container_as_atomic()->fetch_add(
-            kIncrement, std::memory_order::acq_rel))};
+  bool is_closed() const { return (raw.get<0>() & kClosedFlag) > 0; }
+
+  bool is_closed_atomic() const {
+    return (raw.get_atomic<0>() & kClosedFlag) > 0;
+  }
+
+  // Sets the closed flag on a counter and returns its previous value. Later
+  // reservations fail or come back with the flag set.
+  Tag<kBufferSize> close() {
+    return Tag<kBufferSize>{static_cast<RawType>(
+        raw.container_as_atomic()->fetch_or(kClosedFlag,
+                                            std::memory_order::seq_cst))};
+  }
+
+  // With kShuffleBits, the index is passed through remap_index(). Buffers too
+  // small to hold 2^(2 * kShuffleBits) slots are left unshuffled.
+  template <int kShuffleBits = 0>
+  int to_index(const Geometry& geometry = Geometry{}) const {
+    uint64_t index = raw.get<0>() & geometry.mask();
+    if constexpr (kShuffleBits > 0) {
+      if (geometry.size() >= (uint64_t{1} << (2 * kShuffleBits))) {
+        index = remap_index<kShuffleBits>(index);
+      }
+    }
+    return index;
   }
 
-  std::optional<Tag<kBufferSize>> try_reserve(RawType max_allowed_value) {
-    const Tag<kBufferSize> limit{max_allowed_value};
+  // With kExclusive, the caller must be the only thread that reserves tickets
+  // from this counter, which lets a load and a store stand in for the
+  // read-modify-write.
 
-    Tag<kBufferSize>::ContainingType expected{
-        static_cast<Tag<kBufferSize>::ContainingType>(limit.value())};
-    Tag<kBufferSize> desired{limit};
-    desired++;
+  // Reserves `count` consecutive tickets and returns the first one.
+  template <bool kExclusive = false>
+  Tag<kBufferSize> reserve(RawType count = 1) {
+    auto* atomic = raw.container_as_atomic();
+    if constexpr (kExclusive) {
+      auto old = atomic->load(std::memory_order::relaxed);
+      atomic->store(old + count * kIncrement, std::memory_order::release);
+      return Tag<kBufferSize>{static_cast<RawType>(old)};
+    }
+    return Tag<kBufferSize>{static_cast<RawType>(
+        atomic->fetch_add(count * kIncrement, std::memory_order::acq_rel))};
+  }
 
-    while (!raw.container_as_atomic()->compare_exchange_weak(
-        expected,
-        desired.raw.container(),
-        std::memory_order::release,
-        std::memory_order::relaxed)) {
-      desired.raw.template set<0>(expected);
-      desired++;
-      if (desired.value() > limit.value()) {
+  // Reserves the next ticket only if its value is below `limit` and the counter
+  // isn't closed. Failed CASes are added to `*retries` if it is set.
+  template <bool kExclusive = false>
+  std::optional<Tag<kBufferSize>> try_reserve(RawType limit,
+                                              uint64_t* retries = nullptr) {
+    auto* atomic = raw.container_as_atomic();
+    auto expected = atomic->load(std::memory_order::relaxed);
+    do {
+      Tag<kBufferSize> tag{static_cast<RawType>(expected)};
+      if (tag.is_closed() || tag.value() >= limit) {
         return {};
       }
-    }
+      if constexpr (kExclusive) {
+        atomic->store(expected + kIncrement, std::memory_order::release);
+        break;
+      }
+    } while (!atomic->compare_exchange_weak(expected,
+                                            expected + kIncrement,
+                                            std::memory_order::acq_rel,
+                                            std::memory_order::relaxed)
+             && count_retry(retries));
 
     return {Tag<kBufferSize>{static_cast<Tag<kBufferSize>::RawType>(expected)}};
   }
+
+  // Reserves up to `max_count` consecutive tickets whose values are all below
+  // `limit`. Returns the first ticket and how many were reserved, which is
+  // zero if none were available or the counter is closed. Counts retries like
+  // try_reserve().
+  template <bool kExclusive = false>
+  std::pair<Tag<kBufferSize>, RawType> try_reserve_n(
+      RawType limit, RawType max_count, uint64_t* retries = nullptr) {
+    auto* atomic = raw.container_as_atomic();
+    auto expected = atomic->load(std::memory_order::relaxed);
+    RawType count;
+    do {
+      Tag<kBufferSize> tag{static_cast<RawType>(expected)};
+      RawType value = tag.value();
+      if (tag.is_closed() || value >= limit) {
+        return {Tag<kBufferSize>{}, 0};
+      }
+      count = std::min(max_count, (limit - value) / kIncrement);
+      if constexpr (kExclusive) {
+        atomic->store(expected + count * kIncrement,
+                      std::memory_order::release);
+        break;
+      }
+    } while (!atomic->compare_exchange_weak(expected,
+                                            expected + count * kIncrement,
+                                            std::memory_order::acq_rel,
+                                            std::memory_order::relaxed)
+             && count_retry(retries));
+
+    return {Tag<kBufferSize>{static_cast<RawType>(expected)}, count};
+  }
+
+ private:
+  // Always true, so that it can sit in a retry loop's condition.
+  static bool count_retry(uint64_t* retries) {
+    if (retries) {
+      ++*retries;
+    }
+    return true;
+  }
 };
 static_assert(sizeof(Tag<128>) == sizeof(Tag<128>::RawType), "");
 
@@ -0,0 +1,407 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <concepts>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <optional>
+#include <stop_token>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "defs.h"
+#include "queue_opts.h"
+#include "wait_strategy.h"
+
+namespace theta {
+
+// Multiple-producer, multiple-consumer queue without a bound, in the style of
+// LCRQ: a linked list of fixed-size rings. Producers push to the last ring.
+// When it fills, they close it and link a new one after it, so a push never
+// blocks. Consumers pop from the first ring, and once it is closed and
+// drained, unlink it and move on to the next.
+//
+// Tickets are reserved with a CAS that only succeeds once the ticket's slot is
+// free, like MPMCQueue's try_push() and try_pop(). With a blind fetch-and-add,
+// a ticket that a full ring can't serve would leave a hole that consumers have
+// to skip, which LCRQ does with a double-width CAS on every slot.
+//
+// Unlinked rings are reclaimed with epochs: every operation counts itself in
+// one of two counters, picked by the epoch's parity, and a ring is only reused
+// after the counter of the epoch that retired it drains. The counters are
+// striped across cache lines to keep threads from contending on them. The last
+// few reclaimed rings are kept for reuse, so a steady state allocates nothing.
+//
+// Every ring holds QueueOpts::max_size() values, rounded up to a power of two.
+template <std::movable T>
+class UnboundedMPMCQueue {
+ public:
+  UnboundedMPMCQueue() : UnboundedMPMCQueue(QueueOpts{}) {}
+
+  explicit UnboundedMPMCQueue(const QueueOpts& opts)
+      : ring_size_(std::bit_ceil(std::max<size_t>(opts.max_size(), 2))) {
+    Ring* ring = new Ring{ring_size_};
+    head_.store(ring, std::memory_order::relaxed);
+    tail_.store(ring, std::memory_order::relaxed);
+  }
+
+  ~UnboundedMPMCQueue() {
+    Ring* ring = head_.load(std::memory_order::relaxed);
+    while (ring) {
+      delete std::exchange(ring, ring->next.load(std::memory_order::relaxed));
+    }
+    for (auto& limbo : limbo_) {
+      for (Ring* r : limbo) {
+        delete r;
+      }
+    }
+    for (Ring* r : spare_) {
+      delete r;
+    }
+  }
+
+  // Never blocks, and only fails to push if memory runs out.
+  template <typename V>
+    requires std::constructible_from<T, V&&>
+  void push(V&& val) {
+    {
+      Guard guard{*this};
+      while (true) {
+        Ring* ring = tail_.load(std::memory_order::acquire);
+        if (Ring* next = ring->next.load(std::memory_order::acquire)) {
+          tail_.compare_exchange_strong(ring, next);
+          continue;
+        }
+        if (ring->try_push(std::forward<V>(val))) {
+          break;
+        }
+        // The ring is closed. Whoever links the next one wins, and everyone
+        // tries again there.
+        Ring* fresh = take_spare();
+        Ring* expected = nullptr;
+        if (ring->next.compare_exchange_strong(expected, fresh)) {
+          tail_.compare_exchange_strong(ring, fresh);
+        } else {
+          give_spare(fresh);
+        }
+      }
+    }
+    pop_waiters_.notify();
+  }
+
+  std::optional<T> try_pop() {
+    std::optional<T> val;
+    bool retired = false;
+    {
+      Guard guard{*this};
+      while (true) {
+        Ring* ring = head_.load(std::memory_order::acquire);
+        auto [popped, drained] = ring->try_pop();
+        if (popped || !drained) {
+          val = std::move(popped);
+          break;
+        }
+        // A closed ring always gets a successor, but it may not be linked
+        // yet, in which case there is nothing to pop.
+        Ring* next = ring->next.load(std::memory_order::acquire);
+        if (!next) {
+          break;
+        }
+        Ring* tail = ring;
+        tail_.compare_exchange_strong(tail, next);
+        if (head_.compare_exchange_strong(ring, next)) {
+          retire(ring);
+          retired = true;
+        }
+      }
+    }
+    // Outside the guard, so that this thread's own count doesn't hold back
+    // the epoch.
+    if (retired) {
+      reclaim();
+    }
+    return val;
+  }
+
+  // Pops a value, blocking until there is one.
+  T pop() { return *pop(std::stop_token{}); }
+
+  // Like pop(), but returns empty once `stop` is requested.
+  std::optional<T> pop(std::stop_token stop) {
+    return pop_waiting(
+        [&](auto ready) { return pop_waiters_.wait(stop, ready); });
+  }
+
+  template <typename Clock, typename Duration>
+  std::optional<T> pop_until(
+      const std::chrono::time_point<Clock, Duration>& deadline) {
+    return pop_waiting([&](auto ready) {
+      return pop_waiters_.wait_until(deadline, ready);
+    });
+  }
+
+  template <typename Rep, typename Period>
+  std::optional<T> pop_for(const std::chrono::duration<Rep, Period>& timeout) {
+    return pop_until(std::chrono::steady_clock::now() + timeout);
+  }
+
+  size_t size() const {
+    Guard guard{*this};
+    size_t size = 0;
+    for (Ring* ring = head_.load(std::memory_order::acquire); ring;
+         ring = ring->next.load(std::memory_order::acquire)) {
+      size += ring->size();
+    }
+    return size;
+  }
+
+  // The number of values each ring holds.
+  size_t ring_size() const { return ring_size_; }
+
+ private:
+  static constexpr uint64_t kClosedFlag = uint64_t{1} << 63;
+  static constexpr size_t kStripes = 16;
+  static constexpr size_t kMaxSpares = 4;
+
+  struct Slot {
+    // Ticket t may push once this is t, and pop once it is t + 1.
+    std::atomic<uint64_t> seq;
+    alignas(T) std::byte storage[sizeof(T)];
+
+    T* value() { return std::launder(reinterpret_cast<T*>(storage)); }
+  };
+
+  struct PopResult {
+    std::optional<T> val;
+    // Set once the ring is closed and every value in it has been popped.
+    bool drained;
+  };
+
+  class Ring {
+   public:
+    explicit Ring(size_t size)
+        : mask_(size - 1), slots_(std::make_unique<Slot[]>(size)) {
+      reset();
+    }
+
+    ~Ring() {
+      while (try_pop().val) {
+      }
+    }
+
+    Ring(const Ring&) = delete;
+    Ring& operator=(const Ring&) = delete;
+
+    // Only for rings that nothing else can reach.
+    void reset() {
+      head_.store(0, std::memory_order::relaxed);
+      tail_.store(0, std::memory_order::relaxed);
+      next.store(nullptr, std::memory_order::relaxed);
+      for (uint64_t i = 0; i <= mask_; i++) {
+        slots_[i].seq.store(i, std::memory_order::relaxed);
+      }
+    }
+
+    // Fails, closing the ring, if it is full. `val` is left as it was then.
+    template <typename V>
+    bool try_push(V&& val) {
+      uint64_t tail = tail_.load(std::memory_order::relaxed);
+      while (true) {
+        if (tail & kClosedFlag) {
+          return false;
+        }
+        Slot& slot = slots_[tail & mask_];
+        uint64_t seq = slot.seq.load(std::memory_order::acquire);
+        if (seq == tail) {
+          if (tail_.compare_exchange_weak(
+                  tail, tail + 1, std::memory_order::relaxed)) {
+            new (slot.storage) T(std::forward<V>(val));
+            slot.seq.store(tail + 1, std::memory_order::release);
+            return true;
+          }
+        } else if (seq < tail) {
+          // The slot still holds the value from the previous lap.
+          tail_.fetch_or(kClosedFlag, std::memory_order::acq_rel);
+          return false;
+        } else {
+          tail = tail_.load(std::memory_order::relaxed);
+        }
+      }
+    }
+
+    PopResult try_pop() {
+      uint64_t head = head_.load(std::memory_order::relaxed);
+      while (true) {
+        Slot& slot = slots_[head & mask_];
+        uint64_t seq = slot.seq.load(std::memory_order::acquire);
+        if (seq == head + 1) {
+          if (head_.compare_exchange_weak(
+                  head, head + 1, std::memory_order::relaxed)) {
+            T val = std::move(*slot.value());
+            slot.value()->~T();
+            slot.seq.store(head + mask_ + 1, std::memory_order::release);
+            return {std::move(val), false};
+          }
+        } else if (seq < head + 1) {
+          // Nothing at `head` yet. If the ring is closed and `head` is past
+          // the last ticket, nothing ever will be. Otherwise a push may be
+          // about to finish.
+          uint64_t tail = tail_.load(std::memory_order::acquire);
+          return {std::nullopt,
+                  (tail & kClosedFlag) && head >= (tail & ~kClosedFlag)};
+        } else {
+          head = head_.load(std::memory_order::relaxed);
+        }
+      }
+    }
+
+    size_t size() const {
+      uint64_t head = head_.load(std::memory_order::relaxed);
+      uint64_t tail = tail_.load(std::memory_order::relaxed) & ~kClosedFlag;
+      return tail > head ? tail - head : 0;
+    }
+
+    alignas(hardware_destructive_interference_size) std::atomic<Ring*> next{
+        nullptr};
+
+   private:
+    const uint64_t mask_;
+    std::unique_ptr<Slot[]> slots_;
+    alignas(hardware_destructive_interference_size) std::atomic<uint64_t>
+        head_{0};
+    alignas(hardware_destructive_interference_size) std::atomic<uint64_t>
+        tail_{0};
+  };
+
+  struct alignas(hardware_destructive_interference_size) Stripe {
+    std::array<std::atomic<uint64_t>, 2> active{};
+  };
+
+  // Counts the calling thread in the current epoch while it may hold a ring.
+  class Guard {
+   public:
+    explicit Guard(const UnboundedMPMCQueue& queue) {
+      static thread_local size_t stripe
+          = std::hash<std::thread::id>{}(std::this_thread::get_id())
+          % kStripes;
+      auto& counters = queue.stripes_[stripe].active;
+      while (true) {
+        uint64_t epoch = queue.epoch_.load(std::memory_order::seq_cst);
+        active_ = &counters[epoch & 1];
+        active_->fetch_add(1, std::memory_order::seq_cst);
+        // Only count in an epoch that is still current, so that reclaim()
+        // never misses a thread that started before the epoch changed.
+        if (queue.epoch_.load(std::memory_order::seq_cst) == epoch) {
+          return;
+        }
+        active_->fetch_sub(1, std::memory_order::relaxed);
+      }
+    }
+
+    ~Guard() { active_->fetch_sub(1, std::memory_order::release); }
+
+   private:
+    std::atomic<uint64_t>* active_;
+  };
+
+  const size_t ring_size_;
+
+  alignas(hardware_destructive_interference_size) std::atomic<Ring*> head_;
+  alignas(hardware_destructive_interference_size) std::atomic<Ring*> tail_;
+
+  alignas(hardware_destructive_interference_size) std::atomic<uint64_t>
+      epoch_{0};
+  mutable std::array<Stripe, kStripes> stripes_;
+
+  // Guards limbo_ and spare_, and only one thread reclaims at a time.
+  alignas(hardware_destructive_interference_size) std::mutex mutex_;
+  // Rings unlinked in an epoch of each parity.
+  std::array<std::vector<Ring*>, 2> limbo_;
+  // Reclaimed rings, ready for reuse.
+  std::vector<Ring*> spare_;
+
+  // Only blocking pops wait on this.
+  alignas(hardware_destructive_interference_size) DeadlineWaiter pop_waiters_;
+
+  Ring* take_spare() {
+    {
+      std::lock_guard lock{mutex_};
+      if (!spare_.empty()) {
+        Ring* ring = spare_.back();
+        spare_.pop_back();
+        return ring;
+      }
+    }
+    return new Ring{ring_size_};
+  }
+
+  // For rings that are reset and that nothing else can reach.
+  void give_spare(Ring* ring) {
+    {
+      std::lock_guard lock{mutex_};
+      if (spare_.size() < kMaxSpares) {
+        spare_.push_back(ring);
+        return;
+      }
+    }
+    delete ring;
+  }
+
+  void retire(Ring* ring) {
+    std::lock_guard lock{mutex_};
+    limbo_[epoch_.load(std::memory_order::relaxed) & 1].push_back(ring);
+  }
+
+  // A ring retired in epoch e can't be in use once every thread that counted
+  // itself in e has finished: later threads could only reach it through
+  // head_ or tail_, which had both moved past it by then. So once the
+  // counters of the previous epoch are all zero, this reuses its rings and
+  // starts the next epoch, whose parity is the same.
+  void reclaim() {
+    std::unique_lock lock{mutex_, std::try_to_lock};
+    if (!lock.owns_lock()) {
+      return;
+    }
+    uint64_t epoch = epoch_.load(std::memory_order::relaxed);
+    size_t previous = (epoch + 1) & 1;
+    for (const Stripe& stripe : stripes_) {
+      if (stripe.active[previous].load(std::memory_order::seq_cst) > 0) {
+        return;
+      }
+    }
+    std::vector<Ring*> reclaimed = std::move(limbo_[previous]);
+    limbo_[previous].clear();
+    epoch_.store(epoch + 1, std::memory_order::seq_cst);
+    for (Ring* ring : reclaimed) {
+      ring->reset();
+      if (spare_.size() < kMaxSpares) {
+        spare_.push_back(ring);
+      } else {
+        delete ring;
+      }
+    }
+  }
+
+  template <typename Wait>
+  std::optional<T> pop_waiting(Wait&& wait) {
+    while (true) {
+      if (auto val = try_pop()) {
+        return val;
+      }
+      if (!wait([this]() { return size() > 0; })) {
+        return {};
+      }
+    }
+  }
+};
+
+}  // namespace theta
@@ -0,0 +1,331 @@
+#pragma once
+
+#include <atomic_queue/defs.h>
+#include <linux/membarrier.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <concepts>
+#include <condition_variable>
+#include <coroutine>
+#include <cstdint>
+#include <mutex>
+#include <stop_token>
+#include <thread>
+
+#include "defs.h"
+#include "types.h"
+
+namespace theta {
+
+// A wait strategy decides how a thread that claimed a ticket waits for the
+// slot's previous owner to hand it over.
+//
+// wait() returns once the slot's tag may no longer match `observed`. Returning
+// early is fine since the queue checks the tag again. notify() is called right
+// after every hand-over with the tag that it replaced.
+template <typename W>
+concept WaitStrategy = std::default_initializable<W>
+                    && requires(W w,
+                                std::atomic<Tag<kRuntimeBufferSize>>& slot_tag,
+                                Tag<kRuntimeBufferSize> tag) {
+                         w.wait(slot_tag, tag);
+                         w.notify(slot_tag, tag);
+                       };
+
+// Busy-waits on the slot's tag, so a hand-over is seen as soon as its cache
+// line arrives and never costs a syscall. Only use this when every thread has
+// a core to itself.
+struct SpinWait {
+  template <typename TagT>
+  void wait(std::atomic<TagT>& slot_tag, TagT observed) {
+    while (slot_tag.load(std::memory_order::acquire).matches(observed)) {
+      atomic_queue::spin_loop_pause();
+    }
+  }
+
+  template <typename TagT>
+  void notify(std::atomic<TagT>& /*slot_tag*/, TagT /*old_tag*/) {}
+};
+
+// Parks on the slot's tag with std::atomic::wait. A waiter sets the tag's
+// waiting flag first, so only hand-overs that have a waiter call notify_all().
+struct ParkWait {
+  template <typename TagT>
+  void wait(std::atomic<TagT>& slot_tag, TagT observed) {
+    park(slot_tag, observed);
+  }
+
+  template <typename TagT>
+  void notify(std::atomic<TagT>& slot_tag, TagT old_tag) {
+    if (old_tag.is_waiting()) {
+      slot_tag.notify_all();
+    }
+  }
+
+  template <typename TagT>
+  static void park(std::atomic<TagT>& slot_tag, TagT observed) {
+    TagT want_tag{observed};
+    want_tag.mark_as_waiting();
+    while (true) {
+      if (observed.is_waiting()
+          || slot_tag.compare_exchange_weak(observed,
+                                            want_tag,
+                                            std::memory_order::release,
+                                            std::memory_order::relaxed)) {
+        slot_tag.wait(want_tag, std::memory_order::acquire);
+        return;
+      }
+
+      if (!observed.matches(want_tag)) {
+        return;
+      }
+    }
+  }
+};
+
+// Spins for kSpins rounds and yields for kYields more before parking like
+// ParkWait. Short hand-overs stay out of the kernel, and long ones don't burn
+// a core.
+template <int kSpins = 128, int kYields = 16>
+struct SpinYieldParkWait {
+  template <typename TagT>
+  void wait(std::atomic<TagT>& slot_tag, TagT observed) {
+    for (int i = 0; i < kSpins + kYields; i++) {
+      TagT tag = slot_tag.load(std::memory_order::acquire);
+      if (!tag.matches(observed)) {
+        return;
+      }
+      if (i < kSpins) {
+        atomic_queue::spin_loop_pause();
+      } else {
+        std::this_thread::yield();
+      }
+    }
+    // Parking on `observed` rather than a fresh load makes the CAS fail if the
+    // hand-over landed after the last check, instead of flagging the slot that
+    // is already ours and sleeping on it.
+    ParkWait::park(slot_tag, observed);
+  }
+
+  template <typename TagT>
+  void notify(std::atomic<TagT>& slot_tag, TagT old_tag) {
+    ParkWait{}.notify(slot_tag, old_tag);
+  }
+};
+
+// Parks every waiter on one queue-wide eventcount instead of on its slot. A
+// hand-over with nobody waiting costs a fence and a load, and doesn't touch the
+// slot's tag again. When someone is waiting, every waiter wakes up to check its
+// own slot, which suits queues with many idle consumers and little traffic.
+class EventCountWait {
+ public:
+  template <typename TagT>
+  void wait(std::atomic<TagT>& slot_tag, TagT observed) {
+    waiters_.fetch_add(1, std::memory_order::seq_cst);
+    uint32_t epoch = epoch_.load(std::memory_order::seq_cst);
+    if (slot_tag.load(std::memory_order::seq_cst).matches(observed)) {
+      epoch_.wait(epoch, std::memory_order::acquire);
+    }
+    waiters_.fetch_sub(1, std::memory_order::relaxed);
+  }
+
+  template <typename TagT>
+  void notify(std::atomic<TagT>& /*slot_tag*/, TagT /*old_tag*/) {
+    // Pairs with the waiter's increment, so either the waiter sees the new tag
+    // or this sees the waiter.
+    std::atomic_thread_fence(std::memory_order::seq_cst);
+    if (waiters_.load(std::memory_order::relaxed) > 0) {
+      epoch_.fetch_add(1, std::memory_order::release);
+      epoch_.notify_all();
+    }
+  }
+
+ private:
+  alignas(hardware_destructive_interference_size) std::atomic<uint32_t>
+      waiters_{0};
+  alignas(hardware_destructive_interference_size) std::atomic<uint32_t>
+      epoch_{0};
+};
+
+// Runs coroutines that a queue resumes. Anything with an execute() that
+// eventually resumes the handle on some thread will do.
+template <typename E>
+concept Executor = requires(E& e, std::coroutine_handle<> h) { e.execute(h); };
+
+// Resumes the coroutine right away, on whichever thread completed its wait.
+struct InlineExecutor {
+  void execute(std::coroutine_handle<> h) { h.resume(); }
+};
+
+// Whether asymmetric_heavy_barrier() works here. It needs Linux 4.14.
+inline bool has_asymmetric_heavy_barrier() {
+  static const bool registered
+      = syscall(SYS_membarrier,
+                MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED,
+                /*flags=*/0,
+                /*cpu_id=*/0)
+     == 0;
+  return registered;
+}
+
+// Makes every running thread of the process execute a full memory barrier
+// before this returns, so that a barrier on a rare path can pair with compiler
+// barriers on a hot one. Costs an IPI per CPU that runs one of them.
+inline void asymmetric_heavy_barrier() {
+  syscall(SYS_membarrier,
+          MEMBARRIER_CMD_PRIVATE_EXPEDITED,
+          /*flags=*/0,
+          /*cpu_id=*/0);
+}
+
+// Lets threads sleep until some queue-wide condition may hold, a deadline
+// passes, or a stop is requested. The timed and cancellable queue operations
+// use this instead of a WaitStrategy since they can't reserve a ticket that
+// they might have to give up.
+//
+// Until something first waits, notify() costs a load and no fence, so queues
+// whose users never wait this way keep their fast path. After that it costs a
+// fence and a load while nobody waits.
+//
+// Suspended coroutines wait here too, without a thread of their own.
+class DeadlineWaiter {
+ public:
+  // An operation of a suspended coroutine. notify() retries it on the
+  // notifying thread, and only hands the coroutine to its executor once it has
+  // finished, so a resumed coroutine never has to wait again.
+  class AsyncWait {
+   public:
+    // Returns whether the operation finished, successfully or not. This runs
+    // with the waiter's mutex held, so it must not notify this waiter.
+    virtual bool try_complete() = 0;
+    virtual void resume() = 0;
+
+   protected:
+    ~AsyncWait() = default;
+
+   private:
+    friend class DeadlineWaiter;
+    AsyncWait* next_{nullptr};
+  };
+
+  // Returns whether `ready()` holds, waiting for it until `deadline`.
+  template <typename Clock, typename Duration, typename Ready>
+  bool wait_until(const std::chrono::time_point<Clock, Duration>& deadline,
+                  Ready&& ready) {
+    return wait_with(
+        [&](auto& l) { return cv_.wait_until(l, deadline, ready); }, ready);
+  }
+
+  // Returns whether `ready()` holds, waiting for it until `stop` is requested.
+  template <typename Ready>
+  bool wait(std::stop_token stop, Ready&& ready) {
+    return wait_with([&](auto& l) { return cv_.wait(l, stop, ready); }, ready);
+  }
+
+  // Keeps `wait` until a notify() completes it, unless it completes right
+  // away. Returns whether it was kept, in which case the caller must suspend.
+  bool suspend(AsyncWait& wait) {
+    std::lock_guard l{mu_};
+    arm();
+    waiters_.fetch_add(1, std::memory_order::seq_cst);
+    // Pairs with the fence in notify(), like in wait_with().
+    std::atomic_thread_fence(std::memory_order::seq_cst);
+    if (wait.try_complete()) {
+      waiters_.fetch_sub(1, std::memory_order::relaxed);
+      return false;
+    }
+    wait.next_ = nullptr;
+    *async_tail_ = &wait;
+    async_tail_ = &wait.next_;
+    return true;
+  }
+
+  // Wakes every waiting thread so it can check its condition again, and
+  // completes suspended operations in the order they suspended, up to the
+  // first one that can't finish yet. Call this after every change that might
+  // make a condition hold. Returns the number of operations completed.
+  size_t notify() {
+    // Pairs with the heavy barrier in arm(), so either the first waiter sees
+    // the change or this sees it armed.
+    std::atomic_signal_fence(std::memory_order::seq_cst);
+    if (!armed_.load(std::memory_order::relaxed)) {
+      return 0;
+    }
+    std::atomic_thread_fence(std::memory_order::seq_cst);
+    if (waiters_.load(std::memory_order::relaxed) == 0) {
+      return 0;
+    }
+
+    AsyncWait* done = nullptr;
+    AsyncWait** done_tail = &done;
+    size_t completed = 0;
+    {
+      std::lock_guard l{mu_};
+      cv_.notify_all();
+      while (async_head_ && async_head_->try_complete()) {
+        *done_tail = async_head_;
+        done_tail = &async_head_->next_;
+        async_head_ = async_head_->next_;
+        completed++;
+      }
+      *done_tail = nullptr;
+      if (!async_head_) {
+        async_tail_ = &async_head_;
+      }
+      waiters_.fetch_sub(completed, std::memory_order::relaxed);
+    }
+
+    // A resumed coroutine may destroy its AsyncWait right away.
+    while (done) {
+      AsyncWait* next = done->next_;
+      done->resume();
+      done = next;
+    }
+    return completed;
+  }
+
+ private:
+  // Set once something has waited. Without the heavy barrier, notify() has to
+  // pay for the fence from the start.
+  std::atomic<bool> armed_{!has_asymmetric_heavy_barrier()};
+  std::atomic<uint32_t> waiters_{0};
+  std::mutex mu_;
+  // The _any flavor can be woken by a std::stop_token.
+  std::condition_variable_any cv_;
+  // Suspended operations, oldest first.
+  AsyncWait* async_head_{nullptr};
+  AsyncWait** async_tail_{&async_head_};
+
+  template <typename Wait, typename Ready>
+  bool wait_with(Wait&& wait, Ready& ready) {
+    if (ready()) {
+      return true;
+    }
+
+    std::unique_lock l{mu_};
+    arm();
+    waiters_.fetch_add(1, std::memory_order::seq_cst);
+    // Pairs with the fence in notify(), so either ready() sees the change or
+    // notify() sees this waiter.
+    std::atomic_thread_fence(std::memory_order::seq_cst);
+    bool is_ready = wait(l);
+    waiters_.fetch_sub(1, std::memory_order::relaxed);
+    return is_ready;
+  }
+
+  // Makes notify() fence from now on. A notify() that still saw armed_ unset
+  // has passed a full barrier by the time this returns, so the waiter that
+  // calls this sees its change. Requires mu_, which keeps later waiters from
+  // going ahead before the barrier has finished.
+  void arm() {
+    if (!armed_.load(std::memory_order::relaxed)) {
+      armed_.store(true, std::memory_order::relaxed);
+      asymmetric_heavy_barrier();
+    }
+  }
+};
+
+}  // namespace theta
@@ -0,0 +1,179 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <vector>
+
+#include "defs.h"
+#include "queue_opts.h"
+
+namespace theta {
+
+// A Chase-Lev work-stealing deque, with the memory ordering from Lê et al.,
+// "Correct and Efficient Work-Stealing for Weak Memory Models".
+//
+// One owner thread pushes and pops at the bottom, so its own work comes back
+// in LIFO order. Any number of thieves take the oldest items from the top.
+// The owner only synchronizes with thieves when it takes the last item.
+//
+// Thieves may read a slot while the owner overwrites it after the item was
+// taken, so T has to be lock-free atomic.
+//
+// The buffer starts with QueueOpts::max_size() slots, rounded up to a power
+// of two, and doubles whenever a push finds it full. Thieves may still be
+// reading an old buffer, so old buffers are freed with the deque.
+template <typename T>
+  requires can_be_atomic<T>
+class WorkStealingDeque {
+  struct Buffer {
+    explicit Buffer(size_t size)
+        : mask(size - 1), slots(std::make_unique<std::atomic<T>[]>(size)) {}
+
+    size_t size() const { return mask + 1; }
+
+    T get(int64_t index) const {
+      return slots[index & mask].load(std::memory_order::relaxed);
+    }
+
+    void put(int64_t index, T val) {
+      slots[index & mask].store(val, std::memory_order::relaxed);
+    }
+
+    const size_t mask;
+    std::unique_ptr<std::atomic<T>[]> slots;
+  };
+
+ public:
+  WorkStealingDeque() : WorkStealingDeque(QueueOpts{}) {}
+
+  WorkStealingDeque(QueueOpts opts) {
+    CHECK(opts.max_size());
+    buffers_.push_back(
+        std::make_unique<Buffer>(std::bit_ceil(opts.max_size())));
+    buffer_.store(buffers_.back().get(), std::memory_order::relaxed);
+  }
+
+  // Owner only.
+  void push(T val) {
+    int64_t bottom = bottom_.load(std::memory_order::relaxed);
+    int64_t top = top_.load(std::memory_order::acquire);
+    Buffer* buffer = buffer_.load(std::memory_order::relaxed);
+    if (bottom - top >= static_cast<int64_t>(buffer->size())) {
+      buffer = grow(buffer, top, bottom);
+    }
+    buffer->put(bottom, val);
+    std::atomic_thread_fence(std::memory_order::release);
+    bottom_.store(bottom + 1, std::memory_order::relaxed);
+  }
+
+  // Owner only. Pops the newest item.
+  std::optional<T> pop() {
+    int64_t bottom = bottom_.load(std::memory_order::relaxed) - 1;
+    Buffer* buffer = buffer_.load(std::memory_order::relaxed);
+    bottom_.store(bottom, std::memory_order::relaxed);
+    // Pairs with the fence in steal(), so either a thief sees the smaller
+    // bottom or this sees the thief's top.
+    std::atomic_thread_fence(std::memory_order::seq_cst);
+    int64_t top = top_.load(std::memory_order::relaxed);
+
+    std::optional<T> val;
+    if (top <= bottom) {
+      val = buffer->get(bottom);
+      if (top == bottom) {
+        // The last item, which a thief may be taking as well.
+        if (!top_.compare_exchange_strong(top,
+                                          top + 1,
+                                          std::memory_order::seq_cst,
+                                          std::memory_order::relaxed)) {
+          val.reset();
+        }
+        bottom_.store(bottom + 1, std::memory_order::relaxed);
+      }
+    } else {
+      bottom_.store(bottom + 1, std::memory_order::relaxed);
+    }
+    return val;
+  }
+
+  // Takes the oldest item. This fails both when the deque is empty and when
+  // another thread took the item first, so a thief should move on to another
+  // victim rather than spin here.
+  std::optional<T> steal() {
+    int64_t top = top_.load(std::memory_order::acquire);
+    std::atomic_thread_fence(std::memory_order::seq_cst);
+    int64_t bottom = bottom_.load(std::memory_order::acquire);
+    if (top >= bottom) {
+      return {};
+    }
+
+    // Acquire, where the paper has consume, pairs with the release store in
+    // grow().
+    T val = buffer_.load(std::memory_order::acquire)->get(top);
+    if (!top_.compare_exchange_strong(top,
+                                      top + 1,
+                                      std::memory_order::seq_cst,
+                                      std::memory_order::relaxed)) {
+      return {};
+    }
+    return val;
+  }
+
+  // Steals up to half of the items, but no more than `max`, into `out`, oldest
+  // first. Returns the number stolen.
+  //
+  // Each item is claimed with its own CAS on top. Claiming a range with one
+  // CAS could race with pops that read top before the CAS and took items from
+  // inside the range without a CAS of their own.
+  size_t steal_half(T* out, size_t max) {
+    size_t count = std::min(max, (size() + 1) / 2);
+    size_t stolen = 0;
+    while (stolen < count) {
+      std::optional<T> val = steal();
+      if (!val) {
+        break;
+      }
+      out[stolen++] = *val;
+    }
+    return stolen;
+  }
+
+  // Only exact while no other thread uses the deque.
+  size_t size() const {
+    int64_t bottom = bottom_.load(std::memory_order::acquire);
+    int64_t top = top_.load(std::memory_order::acquire);
+    return bottom > top ? bottom - top : 0;
+  }
+
+  bool empty() const { return size() == 0; }
+
+  // The number of items the deque holds before it grows again.
+  size_t capacity() const {
+    return buffer_.load(std::memory_order::acquire)->size();
+  }
+
+ private:
+  // Thieves only write top_ and the owner mostly writes bottom_.
+  alignas(hardware_destructive_interference_size) std::atomic<int64_t> top_{0};
+  alignas(hardware_destructive_interference_size) std::atomic<int64_t> bottom_{
+      0};
+  std::atomic<Buffer*> buffer_;
+  // Only the owner touches this.
+  std::vector<std::unique_ptr<Buffer>> buffers_;
+
+  Buffer* grow(Buffer* old, int64_t top, int64_t bottom) {
+    auto buffer = std::make_unique<Buffer>(2 * old->size());
+    for (int64_t i = top; i < bottom; i++) {
+      buffer->put(i, old->get(i));
+    }
+    buffers_.push_back(std::move(buffer));
+    buffer_.store(buffers_.back().get(), std::memory_order::release);
+    return buffers_.back().get();
+  }
+};
+
+}  // namespace theta
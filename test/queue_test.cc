@@ -1,11 +1,39 @@
 #include <gtest/gtest.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/mount.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
+#include <algorithm>
 #include <array>
+#include <chrono>
+#include <coroutine>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <numeric>
+#include <optional>
 #include <random>
 #include <shared_mutex>
+#include <span>
+#include <stop_token>
+#include <string>
+#include <thread>
 
+#include "cpu_topology.h"
+#include "lane_mpsc_queue.h"
 #include "mpmc_queue.h"
 #include "mpsc_queue.h"
+#include "numa_sharded_queue.h"
+#include "object_pool.h"
+#include "priority_queue.h"
+#include "queue_stats.h"
+#include "shared_memory_queue.h"
+#include "spilling_queue.h"
+#include "unbounded_mpmc_queue.h"
+#include "work_stealing_deque.h"
 
 namespace theta {
 
@@ -16,7 +44,22 @@ class QueueTests : public ::testing::Test {
 };
 
 // using MyTypes = ::testing::Types<MPSCQueue<uint64_t*>, MPMCQueue<uint64_t*>>;
-using MyTypes = ::testing::Types<MPMCQueue<uint64_t*>>;
+template <size_t kBufferSize, Cardinality kProducers, Cardinality kConsumers>
+using RoleQueue = MPMCQueue<uint64_t*,
+                            kBufferSize,
+                            /*kMinimizeContention=*/false,
+                            ParkWait,
+                            kProducers,
+                            kConsumers>;
+
+using MyTypes = ::testing::Types<
+    MPMCQueue<uint64_t*>,
+    MPMCQueue<uint64_t*, 128>,
+    MPMCQueue<uint64_t*, kRuntimeBufferSize, /*kMinimizeContention=*/true>,
+    MPMCQueue<uint64_t*, 128, /*kMinimizeContention=*/true>,
+    RoleQueue<128, Cardinality::kSingle, Cardinality::kSingle>,
+    RoleQueue<kRuntimeBufferSize, Cardinality::kSingle, Cardinality::kMany>,
+    RoleQueue<128, Cardinality::kMany, Cardinality::kSingle>>;
 TYPED_TEST_SUITE(QueueTests, MyTypes);
 
 TYPED_TEST(QueueTests, push_pop) {
@@ -33,12 +76,1608 @@ TYPED_TEST(QueueTests, push_pop) {
   while (queue.size()) {
     EXPECT_EQ(queue.size(), expected_size--);
     auto v = queue.pop();
-    EXPECT_EQ(*v, expected++);
-    delete v;
+    ASSERT_TRUE(v.has_value());
+    EXPECT_EQ(*v.value(), expected++);
+    delete v.value();
   }
   EXPECT_EQ(expected, 110);
 }
 
+TYPED_TEST(QueueTests, try_push_full) {
+  auto queue = this->make_uut(QueueOpts{}.set_max_size(16));
+
+  for (int j = 0; j < 4; j++) {
+    uint64_t pushed = 0;
+    while (queue.try_push(new uint64_t{pushed})) {
+      pushed++;
+    }
+    EXPECT_EQ(pushed, queue.capacity());
+    EXPECT_EQ(queue.size(), queue.capacity());
+
+    uint64_t expected = 0;
+    while (auto v = queue.try_pop()) {
+      EXPECT_EQ(*v.value(), expected++);
+      delete v.value();
+    }
+    EXPECT_EQ(expected, pushed);
+    EXPECT_EQ(queue.size(), 0);
+  }
+}
+
+TYPED_TEST(QueueTests, push_n_pop_n) {
+  auto queue = this->make_uut(QueueOpts{}.set_max_size(16));
+
+  std::array<uint64_t, 40> values;
+  std::array<uint64_t*, 40> in;
+  for (size_t i = 0; i < in.size(); i++) {
+    values[i] = i;
+    in[i] = &values[i];
+  }
+
+  // Batches larger than the ring need a consumer to make progress.
+  std::thread producer{[&]() {
+    queue.push_n(std::span<uint64_t* const>{in}.first(5));
+    queue.push_n(std::span<uint64_t* const>{in}.subspan(5));
+  }};
+
+  std::array<uint64_t*, 40> out{};
+  queue.pop_n(out.data(), 3);
+  queue.pop_n(out.data() + 3, out.size() - 3);
+  producer.join();
+
+  EXPECT_EQ(out, in);
+  EXPECT_EQ(queue.size(), 0);
+}
+
+TYPED_TEST(QueueTests, try_push_n_try_pop_n) {
+  auto queue = this->make_uut(QueueOpts{}.set_max_size(16));
+  const size_t capacity = queue.capacity();
+
+  std::vector<uint64_t> values(capacity + 4);
+  std::vector<uint64_t*> in(values.size());
+  for (size_t i = 0; i < in.size(); i++) {
+    values[i] = i;
+    in[i] = &values[i];
+  }
+
+  std::vector<uint64_t*> out(in.size());
+  EXPECT_EQ(queue.try_pop_n(out.data(), out.size()), 0);
+
+  EXPECT_EQ(queue.try_push_n(in), capacity);
+  EXPECT_EQ(queue.try_push_n(in), 0);
+  EXPECT_EQ(queue.try_pop_n(out.data(), 4), 4);
+  EXPECT_EQ(queue.try_push_n(std::span{in}.subspan(capacity)), 4);
+  EXPECT_EQ(queue.try_pop_n(out.data() + 4, out.size()), capacity);
+
+  EXPECT_EQ(out, in);
+  EXPECT_EQ(queue.size(), 0);
+}
+
+TYPED_TEST(QueueTests, timed_push_pop) {
+  using namespace std::chrono_literals;
+  auto queue = this->make_uut(QueueOpts{}.set_max_size(16));
+
+  auto start = std::chrono::steady_clock::now();
+  EXPECT_EQ(queue.pop_for(10ms), std::nullopt);
+  EXPECT_GE(std::chrono::steady_clock::now() - start, 10ms);
+
+  std::vector<uint64_t> values(queue.capacity() + 1);
+  for (size_t i = 0; i < queue.capacity(); i++) {
+    EXPECT_TRUE(queue.push_for(&values[i], 10ms));
+  }
+  EXPECT_FALSE(queue.push_for(&values.back(), 10ms));
+  EXPECT_EQ(queue.size(), queue.capacity());
+
+  // Timeouts must not leave reserved tickets behind.
+  for (size_t i = 0; i < queue.capacity(); i++) {
+    EXPECT_EQ(queue.pop_for(10ms), &values[i]);
+  }
+  EXPECT_EQ(queue.size(), 0);
+
+  std::thread producer{[&]() {
+    std::this_thread::sleep_for(10ms);
+    queue.push(&values.back());
+  }};
+  EXPECT_EQ(queue.pop_until(std::chrono::steady_clock::now() + 1h),
+            &values.back());
+  producer.join();
+}
+
+// Every producer pushes an increasing sequence, so each consumer has to see
+// each producer's values in order.
+template <typename Q>
+void check_roles(int num_producers, int num_consumers) {
+  static constexpr uint64_t kPushesPerProducer = 20000;
+  Q queue{QueueOpts{}.set_max_size(8)};
+  std::vector<std::vector<uint64_t>> values(num_producers);
+  std::atomic<uint64_t> popped{0};
+
+  std::vector<std::thread> threads;
+  for (int p = 0; p < num_producers; p++) {
+    values[p].resize(kPushesPerProducer);
+    threads.emplace_back([&, p]() {
+      for (uint64_t i = 0; i < kPushesPerProducer; i++) {
+        values[p][i] = p * kPushesPerProducer + i;
+        if (i % 3 == 0) {
+          queue.push(&values[p][i]);
+        } else {
+          while (!queue.try_push(&values[p][i])) {
+            std::this_thread::yield();
+          }
+        }
+      }
+    });
+  }
+  for (int c = 0; c < num_consumers; c++) {
+    threads.emplace_back([&]() {
+      std::vector<uint64_t> next(num_producers, 0);
+      while (true) {
+        std::optional<uint64_t*> v;
+        while (!(v = queue.try_pop())) {
+          if (popped.load() == num_producers * kPushesPerProducer) {
+            return;
+          }
+          std::this_thread::yield();
+        }
+        uint64_t p = *v.value() / kPushesPerProducer;
+        uint64_t i = *v.value() % kPushesPerProducer;
+        EXPECT_GE(i, next[p]);
+        next[p] = i + 1;
+        popped++;
+      }
+    });
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+  EXPECT_EQ(popped, num_producers * kPushesPerProducer);
+}
+
+TEST(MPMCQueueTest, roles) {
+  check_roles<RoleQueue<8, Cardinality::kSingle, Cardinality::kSingle>>(1, 1);
+  check_roles<RoleQueue<8, Cardinality::kSingle, Cardinality::kMany>>(1, 3);
+  check_roles<RoleQueue<8, Cardinality::kMany, Cardinality::kSingle>>(3, 1);
+}
+
+TEST(MPMCQueueTest, capacity) {
+  MPMCQueue<uint64_t*> runtime_sized{QueueOpts{}.set_max_size(1000)};
+  EXPECT_EQ(runtime_sized.capacity(), 1024);
+
+  MPMCQueue<uint64_t*, 16> compile_time_sized{QueueOpts{}.set_max_size(1000)};
+  EXPECT_EQ(compile_time_sized.capacity(), 16);
+}
+
+template <typename W>
+class WaitStrategyTests : public ::testing::Test {};
+
+using WaitStrategies = ::testing::Types<ParkWait,
+                                        SpinWait,
+                                        SpinYieldParkWait<>,
+                                        SpinYieldParkWait<1, 1>,
+                                        EventCountWait>;
+TYPED_TEST_SUITE(WaitStrategyTests, WaitStrategies);
+
+// A tiny ring makes every producer and consumer wait for its slot.
+TYPED_TEST(WaitStrategyTests, blocking_push_pop) {
+  static constexpr uint64_t kPushesPerThread = 1000;
+  static constexpr int kNumThreads = 2;
+
+  MPMCQueue<uint64_t, 4, /*kMinimizeContention=*/false, TypeParam> packed;
+  MPMCQueue<std::string, 4, /*kMinimizeContention=*/false, TypeParam> in_place;
+  std::atomic<uint64_t> packed_sum{0};
+  std::atomic<uint64_t> in_place_sum{0};
+
+  std::vector<std::thread> threads;
+  for (int tx = 0; tx < kNumThreads; tx++) {
+    threads.emplace_back([&]() {
+      for (uint64_t i = 0; i < kPushesPerThread; i++) {
+        packed.push(i);
+        in_place.push(std::to_string(i));
+      }
+    });
+    threads.emplace_back([&]() {
+      for (uint64_t i = 0; i < kPushesPerThread; i++) {
+        packed_sum += packed.pop().value();
+        in_place_sum += std::stoull(in_place.pop().value());
+      }
+    });
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+
+  uint64_t expected
+      = kNumThreads * kPushesPerThread * (kPushesPerThread - 1) / 2;
+  EXPECT_EQ(packed_sum, expected);
+  EXPECT_EQ(in_place_sum, expected);
+}
+
+TYPED_TEST(WaitStrategyTests, close_wakes_blocked_threads) {
+  std::vector<uint64_t> values(4);
+  MPMCQueue<uint64_t*, 4, /*kMinimizeContention=*/false, TypeParam> queue;
+  std::atomic<int> empty_pops{0};
+  std::atomic<int> pushed{0};
+
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 3; i++) {
+    threads.emplace_back([&]() {
+      if (!queue.pop().has_value()) {
+        empty_pops++;
+      }
+    });
+  }
+  threads.emplace_back([&]() {
+    std::array<uint64_t*, 3> out;
+    if (queue.pop_n(out.data(), out.size()) == 0) {
+      empty_pops++;
+    }
+  });
+  threads.emplace_back([&]() {
+    if (!queue.pop_for(std::chrono::hours{1}).has_value()) {
+      empty_pops++;
+    }
+  });
+
+  std::this_thread::sleep_for(std::chrono::milliseconds{10});
+  queue.close();
+  for (auto& t : threads) {
+    t.join();
+  }
+  EXPECT_EQ(empty_pops, 5);
+  EXPECT_EQ(queue.size(), 0);
+  EXPECT_FALSE(queue.push(&values[0]));
+}
+
+TEST(MPMCQueueTest, close_drains_pending_values) {
+  MPMCQueue<uint64_t*, 16> queue;
+  std::vector<uint64_t> values(5);
+  for (auto& v : values) {
+    EXPECT_TRUE(queue.push(&v));
+  }
+
+  queue.close();
+  EXPECT_TRUE(queue.is_closed());
+  EXPECT_FALSE(queue.push(&values[0]));
+  EXPECT_FALSE(queue.try_push(&values[0]));
+  EXPECT_FALSE(queue.push_n(std::span<uint64_t* const>{}));
+  EXPECT_FALSE(queue.push_for(&values[0], std::chrono::hours{1}));
+  EXPECT_EQ(queue.size(), values.size());
+
+  EXPECT_EQ(queue.pop(), &values[0]);
+  EXPECT_EQ(queue.try_pop(), &values[1]);
+  EXPECT_EQ(queue.pop_for(std::chrono::hours{1}), &values[2]);
+  std::array<uint64_t*, 4> out;
+  EXPECT_EQ(queue.pop_n(out.data(), out.size()), 2);
+  EXPECT_EQ(out[0], &values[3]);
+  EXPECT_EQ(out[1], &values[4]);
+
+  EXPECT_EQ(queue.pop(), std::nullopt);
+  EXPECT_EQ(queue.try_pop(), std::nullopt);
+  EXPECT_EQ(queue.size(), 0);
+}
+
+TEST(MPMCQueueTest, close_finishes_waiting_pushes) {
+  MPMCQueue<uint64_t*, 4> queue;
+  std::vector<uint64_t> values(6);
+  for (size_t i = 0; i < 4; i++) {
+    EXPECT_TRUE(queue.push(&values[i]));
+  }
+
+  std::thread producer{[&]() {
+    EXPECT_TRUE(queue.push(&values[4]));
+  }};
+  std::this_thread::sleep_for(std::chrono::milliseconds{10});
+  queue.close();
+  EXPECT_FALSE(queue.push(&values[5]));
+
+  for (size_t i = 0; i < 5; i++) {
+    EXPECT_EQ(queue.pop(), &values[i]);
+  }
+  producer.join();
+  EXPECT_EQ(queue.pop(), std::nullopt);
+}
+
+TEST(MPMCQueueTest, stop_token) {
+  MPMCQueue<uint64_t, 16> queue;
+  std::atomic<uint64_t> sum{0};
+  {
+    std::jthread worker{[&](std::stop_token stop) {
+      while (auto v = queue.pop(stop)) {
+        sum += v.value();
+      }
+    }};
+    for (uint64_t i = 1; i <= 10; i++) {
+      queue.push(i);
+    }
+    while (queue.size() > 0) {
+      std::this_thread::yield();
+    }
+    // ~jthread requests a stop, which has to wake the worker up.
+  }
+  EXPECT_EQ(sum, 55);
+  EXPECT_FALSE(queue.is_closed());
+  EXPECT_TRUE(queue.push(1));
+}
+
+// Batches larger than the queue have to wake the other side part way through,
+// since it waits for a notify rather than on the slots.
+TEST(MPMCQueueTest, batches_larger_than_capacity) {
+  MPMCQueue<uint64_t, 4> queue;
+  std::vector<uint64_t> in(10);
+  std::iota(in.begin(), in.end(), 1);
+
+  std::atomic<uint64_t> sum{0};
+  {
+    std::jthread consumer{[&](std::stop_token stop) {
+      while (auto v = queue.pop(stop)) {
+        sum += v.value();
+      }
+    }};
+    // Lets the consumer find the queue empty and wait.
+    std::this_thread::sleep_for(std::chrono::milliseconds{10});
+    EXPECT_TRUE(queue.push_n(in));
+    while (queue.size() > 0) {
+      std::this_thread::yield();
+    }
+  }
+  EXPECT_EQ(sum, 55);
+
+  std::thread producer{[&]() {
+    for (uint64_t v : in) {
+      EXPECT_TRUE(queue.push_until(
+          v, std::chrono::steady_clock::now() + std::chrono::seconds{10}));
+    }
+  }};
+  // Lets the producer fill the queue and wait for room.
+  std::this_thread::sleep_for(std::chrono::milliseconds{10});
+  std::vector<uint64_t> out(in.size());
+  EXPECT_EQ(queue.pop_n(out.data(), out.size()), out.size());
+  producer.join();
+  EXPECT_EQ(out, in);
+}
+
+// A coroutine that starts right away and destroys itself when it finishes.
+struct Detached {
+  struct promise_type {
+    Detached get_return_object() { return {}; }
+    std::suspend_never initial_suspend() { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception() { std::terminate(); }
+  };
+};
+
+// Resumes coroutines only when the test says so.
+struct ManualExecutor {
+  void execute(std::coroutine_handle<> h) { ready.push_back(h); }
+
+  size_t run() {
+    size_t n = 0;
+    for (; !ready.empty(); n++) {
+      auto h = ready.front();
+      ready.pop_front();
+      h.resume();
+    }
+    return n;
+  }
+
+  std::deque<std::coroutine_handle<>> ready;
+};
+
+TEST(MPMCQueueTest, async_pop) {
+  MPMCQueue<uint64_t, 16> queue;
+  ManualExecutor executor;
+  std::vector<uint64_t> popped;
+  auto consumer = [&]() -> Detached {
+    while (auto v = co_await queue.async_pop(executor)) {
+      popped.push_back(*v);
+    }
+    popped.push_back(0);
+  };
+
+  EXPECT_TRUE(queue.push(1));
+  consumer();
+  consumer();
+  // The first consumer popped right away and both are now suspended.
+  EXPECT_EQ(popped, std::vector<uint64_t>{1});
+  EXPECT_EQ(executor.run(), 0);
+
+  // Each push completes one suspended pop, oldest first.
+  EXPECT_TRUE(queue.push(2));
+  EXPECT_EQ(queue.size(), 0);
+  uint64_t vals[] = {3, 4};
+  EXPECT_TRUE(queue.push_n(vals));
+  EXPECT_EQ(queue.size(), 1);
+  // The first coroutine to resume pops the 4 before it suspends again.
+  EXPECT_EQ(executor.run(), 2);
+  EXPECT_EQ(queue.size(), 0);
+  std::sort(popped.begin(), popped.end());
+  EXPECT_EQ(popped, (std::vector<uint64_t>{1, 2, 3, 4}));
+
+  // Closing completes every suspended pop.
+  queue.close();
+  EXPECT_EQ(executor.run(), 2);
+  EXPECT_EQ(popped, (std::vector<uint64_t>{1, 2, 3, 4, 0, 0}));
+}
+
+TEST(MPMCQueueTest, async_push) {
+  MPMCQueue<std::unique_ptr<int>, 2> queue;
+  ManualExecutor executor;
+  std::vector<bool> pushed;
+  auto producer = [&](int v) -> Detached {
+    pushed.push_back(co_await queue.async_push(std::make_unique<int>(v),
+                                               executor));
+  };
+
+  for (int i = 0; i < 4; i++) {
+    producer(i);
+  }
+  EXPECT_EQ(pushed.size(), 2);
+
+  // A pop makes room, which completes the oldest suspended push.
+  EXPECT_EQ(*queue.pop().value(), 0);
+  EXPECT_EQ(executor.run(), 1);
+  EXPECT_EQ(*queue.try_pop().value(), 1);
+  EXPECT_EQ(*queue.try_pop().value(), 2);
+  EXPECT_EQ(executor.run(), 1);
+  EXPECT_EQ(pushed, (std::vector<bool>{true, true, true, true}));
+
+  producer(4);
+  producer(5);
+  queue.close();
+  EXPECT_EQ(executor.run(), 1);
+  EXPECT_EQ(pushed.back(), false);
+  EXPECT_EQ(*queue.pop().value(), 3);
+  EXPECT_EQ(*queue.pop().value(), 4);
+}
+
+TEST(MPMCQueueTest, async_many_consumers) {
+  constexpr int kConsumers = 1000;
+  constexpr int kProducers = 4;
+  constexpr uint64_t kPushesPerThread = 10000;
+  MPMCQueue<uint64_t, 64> queue;
+  InlineExecutor executor;
+
+  // Coroutines resume on whichever producer completed their pop, so guard the
+  // totals.
+  std::atomic<uint64_t> sum{0};
+  std::atomic<int> finished{0};
+  auto consumer = [&]() -> Detached {
+    while (auto v = co_await queue.async_pop(executor)) {
+      sum.fetch_add(*v, std::memory_order::relaxed);
+    }
+    finished.fetch_add(1, std::memory_order::relaxed);
+  };
+  for (int i = 0; i < kConsumers; i++) {
+    consumer();
+  }
+
+  std::vector<std::thread> producers;
+  for (int i = 0; i < kProducers; i++) {
+    producers.emplace_back([&]() {
+      for (uint64_t v = 1; v <= kPushesPerThread; v++) {
+        queue.push(v);
+      }
+    });
+  }
+  for (auto& t : producers) {
+    t.join();
+  }
+  queue.close();
+
+  EXPECT_EQ(finished.load(), kConsumers);
+  EXPECT_EQ(sum.load(),
+            kProducers * kPushesPerThread * (kPushesPerThread + 1) / 2);
+}
+
+TEST(MPMCQueueTest, remap_index) {
+  // 16 byte slots, four to a 64 byte cache line.
+  constexpr int kBits = 2;
+  std::vector<bool> seen(64);
+  for (uint64_t i = 0; i < seen.size(); i++) {
+    uint64_t index = remap_index<kBits>(i);
+    ASSERT_LT(index, seen.size());
+    EXPECT_FALSE(seen[index]);
+    seen[index] = true;
+    if (i % 16 != 0) {
+      EXPECT_NE(index / 4, remap_index<kBits>(i - 1) / 4);
+    }
+  }
+}
+
+TEST(MPMCQueueTest, in_place_values) {
+  MPMCQueue<std::string> queue{QueueOpts{}.set_max_size(4)};
+  std::string long_string(100, 'x');
+
+  std::thread producer{[&]() {
+    for (int i = 0; i < 100; i++) {
+      queue.push(long_string + std::to_string(i));
+    }
+  }};
+  for (int i = 0; i < 100; i++) {
+    EXPECT_EQ(queue.pop(), long_string + std::to_string(i));
+  }
+  producer.join();
+
+  EXPECT_TRUE(queue.try_push("a"));
+  EXPECT_EQ(queue.try_pop(), "a");
+  EXPECT_EQ(queue.try_pop(), std::nullopt);
+}
+
+TEST(MPMCQueueTest, move_only_values) {
+  MPMCQueue<std::unique_ptr<uint64_t>, 16> queue;
+  for (uint64_t i = 0; i < 10; i++) {
+    queue.push(std::make_unique<uint64_t>(i));
+  }
+
+  std::array<std::unique_ptr<uint64_t>, 10> out;
+  queue.pop_n(out.data(), out.size());
+  for (uint64_t i = 0; i < out.size(); i++) {
+    EXPECT_EQ(*out[i], i);
+  }
+}
+
+TEST(MPMCQueueTest, destroys_remaining_values) {
+  auto counter = std::make_shared<int>();
+  {
+    MPMCQueue<std::shared_ptr<int>> queue{QueueOpts{}.set_max_size(16)};
+    for (int i = 0; i < 10; i++) {
+      queue.push(counter);
+    }
+    queue.pop();
+    EXPECT_EQ(counter.use_count(), 10);
+  }
+  EXPECT_EQ(counter.use_count(), 1);
+}
+
+TEST(MPSCQueueTest, try_push_n_drain) {
+  MPSCQueue<uint64_t*> queue{QueueOpts{}.set_max_size(16)};
+  const size_t capacity = queue.capacity();
+
+  std::vector<uint64_t> values(capacity + 4);
+  std::vector<uint64_t*> in(values.size());
+  for (size_t i = 0; i < in.size(); i++) {
+    values[i] = i;
+    in[i] = &values[i];
+  }
+
+  std::vector<uint64_t*> out;
+  auto append = [&out](uint64_t* v) { out.push_back(v); };
+
+  for (int j = 0; j < 4; j++) {
+    out.clear();
+    EXPECT_EQ(queue.drain(append), 0);
+
+    EXPECT_EQ(queue.try_push_n(in), capacity);
+    EXPECT_EQ(queue.try_push_n(in), 0);
+    EXPECT_EQ(queue.drain(append, /*max=*/3), 3);
+    EXPECT_EQ(queue.try_push_n(std::span{in}.subspan(capacity)), 3);
+    EXPECT_EQ(queue.size(), capacity);
+    EXPECT_EQ(queue.drain(append), capacity);
+
+    EXPECT_EQ(out, std::vector(in.begin(), in.end() - 1));
+    EXPECT_EQ(queue.size(), 0);
+  }
+}
+
+TEST(MPSCQueueTest, try_pop_n) {
+  MPSCQueue<uint64_t*> queue{QueueOpts{}.set_max_size(16)};
+
+  std::array<uint64_t, 5> values{10, 11, 12, 13, 14};
+  for (auto& v : values) {
+    EXPECT_TRUE(queue.try_push(&v));
+  }
+
+  std::array<uint64_t*, 8> out{};
+  EXPECT_EQ(queue.try_pop_n(out.data(), 2), 2);
+  EXPECT_EQ(queue.try_pop_n(out.data() + 2, out.size() - 2), 3);
+  EXPECT_EQ(queue.try_pop_n(out.data(), out.size()), 0);
+  for (size_t i = 0; i < values.size(); i++) {
+    EXPECT_EQ(out[i], &values[i]);
+  }
+}
+
+// Only the unbounded mode limits the ring to 2^21 slots.
+TEST(MPSCQueueTest, large_bounded) {
+  constexpr size_t kSize = size_t{1} << 22;
+  MPSCQueue<uint64_t*> queue{QueueOpts{}.set_max_size(kSize)};
+  EXPECT_EQ(queue.capacity(), kSize - 1);
+
+  uint64_t value = 0;
+  for (size_t i = 0; i < kSize - 1; i++) {
+    ASSERT_TRUE(queue.try_push(&value));
+  }
+  EXPECT_FALSE(queue.try_push(&value));
+  EXPECT_EQ(queue.size(), kSize - 1);
+  EXPECT_EQ(queue.drain([](uint64_t*) {}), kSize - 1);
+  EXPECT_EQ(queue.size(), 0);
+}
+
+TEST(MPSCQueueTest, timed_push_pop) {
+  using namespace std::chrono_literals;
+  MPSCQueue<uint64_t*> queue{QueueOpts{}.set_max_size(16)};
+
+  EXPECT_EQ(queue.pop_for(10ms), std::nullopt);
+
+  std::vector<uint64_t> values(queue.capacity() + 1);
+  for (size_t i = 0; i < queue.capacity(); i++) {
+    EXPECT_TRUE(queue.push_for(&values[i], 10ms));
+  }
+  EXPECT_FALSE(queue.push_for(&values.back(), 10ms));
+
+  std::thread producer{[&]() {
+    EXPECT_TRUE(queue.push_until(&values.back(),
+                                 std::chrono::steady_clock::now() + 1h));
+  }};
+  std::this_thread::sleep_for(10ms);
+  for (size_t i = 0; i < values.size(); i++) {
+    EXPECT_EQ(queue.pop_for(1h), &values[i]);
+  }
+  producer.join();
+  EXPECT_EQ(queue.size(), 0);
+}
+
+TEST(MPSCQueueTest, unbounded_spill) {
+  MPSCQueue<uint64_t*, /*kUnbounded=*/true> queue{
+      QueueOpts{}.set_max_size(16)};
+
+  std::vector<uint64_t> values(20 * queue.capacity());
+  for (size_t i = 0; i < values.size(); i++) {
+    values[i] = i + 1;
+  }
+
+  // Interleave pushes and pops so that the queue moves in and out of fallback
+  // mode several times.
+  uint64_t expected = 1;
+  size_t next = 0;
+  for (size_t burst : {100, 3, 40, 1, 200, 17}) {
+    for (size_t i = 0; i < burst && next < values.size(); i++) {
+      EXPECT_TRUE(queue.try_push(&values[next++]));
+    }
+    EXPECT_EQ(queue.size(), next + 1 - expected);
+    for (size_t i = 0; i < burst / 2; i++) {
+      auto v = queue.try_pop();
+      ASSERT_TRUE(v.has_value());
+      EXPECT_EQ(*v.value(), expected++);
+    }
+  }
+
+  std::vector<uint64_t*> rest(values.size());
+  size_t n = queue.try_push_n(std::span{rest}.first(0));
+  EXPECT_EQ(n, 0);
+  n = queue.try_pop_n(rest.data(), rest.size());
+  EXPECT_EQ(n, next + 1 - expected);
+  for (size_t i = 0; i < n; i++) {
+    EXPECT_EQ(*rest[i], expected++);
+  }
+  EXPECT_EQ(queue.size(), 0);
+  EXPECT_FALSE(queue.try_pop().has_value());
+}
+
+TEST(MPSCQueueTest, unbounded_multithreaded) {
+  static constexpr uint64_t kPushesPerThread = 100000;
+  static constexpr int kNumThreads = 4;
+
+  MPSCQueue<uint64_t*, /*kUnbounded=*/true> queue{
+      QueueOpts{}.set_max_size(64)};
+  std::vector<std::vector<uint64_t>> values(kNumThreads);
+
+  std::vector<std::thread> producers;
+  for (int tx = 0; tx < kNumThreads; tx++) {
+    values[tx].resize(kPushesPerThread);
+    producers.emplace_back([&, tx]() {
+      for (uint64_t i = 0; i < kPushesPerThread; i++) {
+        values[tx][i] = tx * kPushesPerThread + i;
+        if (i % 7 == 0) {
+          queue.push(&values[tx][i]);
+        } else if (i % 7 == 1) {
+          std::array<uint64_t*, 2> pair{&values[tx][i], &values[tx][i + 1]};
+          values[tx][i + 1] = tx * kPushesPerThread + i + 1;
+          EXPECT_EQ(queue.try_push_n(pair), 2);
+          i++;
+        } else {
+          EXPECT_TRUE(queue.try_push(&values[tx][i]));
+        }
+      }
+    });
+  }
+
+  // Each producer's items must come out in the order they were pushed.
+  std::array<uint64_t, kNumThreads> next{};
+  uint64_t popped = 0;
+  while (popped < kNumThreads * kPushesPerThread) {
+    popped += queue.drain([&](uint64_t* v) {
+      int tx = *v / kPushesPerThread;
+      EXPECT_EQ(*v % kPushesPerThread, next[tx]++);
+    });
+  }
+
+  for (auto& p : producers) {
+    p.join();
+  }
+  EXPECT_EQ(queue.size(), 0);
+}
+
+TEST(LaneMPSCQueueTest, register_producers) {
+  LaneMPSCQueue<int> queue{QueueOpts{}.set_max_size(4).set_max_producers(2)};
+  EXPECT_EQ(queue.capacity(), 4);
+
+  auto a = queue.register_producer();
+  auto b = queue.register_producer();
+  ASSERT_TRUE(a && b);
+  EXPECT_FALSE(queue.register_producer());
+
+  for (int i = 0; i < 4; i++) {
+    EXPECT_TRUE(queue.try_push(*a, i));
+  }
+  EXPECT_FALSE(queue.try_push(*a, 4));
+  EXPECT_TRUE(queue.try_push(*b, 10));
+
+  // Releasing a lane keeps its items, and the next producer appends to them.
+  a.reset();
+  auto c = queue.register_producer();
+  ASSERT_TRUE(c);
+  EXPECT_FALSE(queue.try_push(*c, 4));
+  EXPECT_EQ(queue.size(), 5);
+
+  // The consumer alternates between the lanes.
+  EXPECT_EQ(queue.try_pop(), 0);
+  EXPECT_EQ(queue.try_pop(), 10);
+  EXPECT_EQ(queue.try_pop(), 1);
+  EXPECT_TRUE(queue.try_push(*c, 4));
+
+  std::vector<int> drained;
+  EXPECT_EQ(queue.drain([&](int v) { drained.push_back(v); }), 3);
+  EXPECT_EQ(drained, (std::vector<int>{2, 3, 4}));
+  EXPECT_EQ(queue.try_pop(), std::nullopt);
+}
+
+TEST(LaneMPSCQueueTest, timed_push_pop) {
+  using namespace std::chrono_literals;
+  LaneMPSCQueue<std::unique_ptr<int>> queue{QueueOpts{}.set_max_size(2)};
+  auto token = queue.register_producer();
+  ASSERT_TRUE(token);
+
+  EXPECT_EQ(queue.pop_for(10ms), std::nullopt);
+  EXPECT_TRUE(queue.push_for(*token, std::make_unique<int>(0), 10ms));
+  EXPECT_TRUE(queue.push_for(*token, std::make_unique<int>(1), 10ms));
+  auto last = std::make_unique<int>(2);
+  EXPECT_FALSE(queue.push_for(*token, std::move(last), 10ms));
+  ASSERT_TRUE(last);
+
+  std::thread producer{[&]() {
+    EXPECT_TRUE(queue.push_until(
+        *token, std::move(last), std::chrono::steady_clock::now() + 1h));
+  }};
+  std::this_thread::sleep_for(10ms);
+  for (int i = 0; i < 3; i++) {
+    auto v = queue.pop_for(1h);
+    ASSERT_TRUE(v);
+    EXPECT_EQ(**v, i);
+  }
+  producer.join();
+
+  // Anything left behind is destroyed with the queue.
+  EXPECT_TRUE(queue.try_push(*token, std::make_unique<int>(3)));
+}
+
+TEST(LaneMPSCQueueTest, per_producer_order) {
+  constexpr int kProducers = 4;
+  constexpr uint64_t kPushesPerThread = 10000;
+  LaneMPSCQueue<uint64_t> queue{QueueOpts{}.set_max_size(64)};
+
+  std::vector<std::thread> producers;
+  for (int p = 0; p < kProducers; p++) {
+    producers.emplace_back([&queue, p]() {
+      auto token = queue.register_producer();
+      ASSERT_TRUE(token);
+      for (uint64_t i = 0; i < kPushesPerThread; i++) {
+        while (!queue.try_push(*token, (uint64_t(p) << 32) | i)) {
+          std::this_thread::yield();
+        }
+      }
+    });
+  }
+
+  std::array<uint64_t, kProducers> next{};
+  for (uint64_t popped = 0; popped < kProducers * kPushesPerThread;) {
+    size_t n = queue.drain([&](uint64_t v) {
+      EXPECT_EQ(v & 0xffffffff, next[v >> 32]++);
+    });
+    if (n == 0) {
+      std::this_thread::yield();
+    }
+    popped += n;
+  }
+  for (auto& t : producers) {
+    t.join();
+  }
+  EXPECT_EQ(queue.size(), 0);
+}
+
+TEST(WorkStealingDequeTest, push_pop_steal) {
+  WorkStealingDeque<int> deque{QueueOpts{}.set_max_size(4)};
+  EXPECT_EQ(deque.pop(), std::nullopt);
+  EXPECT_EQ(deque.steal(), std::nullopt);
+
+  // Pushing past the capacity grows the buffer.
+  for (int i = 0; i < 10; i++) {
+    deque.push(i);
+  }
+  EXPECT_EQ(deque.size(), 10);
+  EXPECT_EQ(deque.capacity(), 16);
+
+  // The owner pops the newest items and thieves take the oldest.
+  EXPECT_EQ(deque.pop(), 9);
+  EXPECT_EQ(deque.steal(), 0);
+  std::array<int, 8> out;
+  EXPECT_EQ(deque.steal_half(out.data(), out.size()), 4);
+  EXPECT_EQ(std::vector<int>(out.begin(), out.begin() + 4),
+            (std::vector<int>{1, 2, 3, 4}));
+  EXPECT_EQ(deque.steal_half(out.data(), 1), 1);
+  EXPECT_EQ(out[0], 5);
+
+  for (int i : {8, 7, 6}) {
+    EXPECT_EQ(deque.pop(), i);
+  }
+  EXPECT_EQ(deque.pop(), std::nullopt);
+  EXPECT_EQ(deque.steal_half(out.data(), out.size()), 0);
+}
+
+TEST(WorkStealingDequeTest, concurrent_steal) {
+  constexpr int kThieves = 3;
+  constexpr uint64_t kItems = 100000;
+  WorkStealingDeque<uint64_t> deque{QueueOpts{}.set_max_size(16)};
+
+  std::atomic<bool> done{false};
+  std::vector<std::atomic<int>> taken(kItems);
+  std::vector<std::thread> thieves;
+  for (int i = 0; i < kThieves; i++) {
+    thieves.emplace_back([&, i]() {
+      std::array<uint64_t, 8> out;
+      while (!done.load(std::memory_order::acquire) || !deque.empty()) {
+        size_t n = 0;
+        if (i % 2) {
+          n = deque.steal_half(out.data(), out.size());
+        } else if (auto v = deque.steal()) {
+          out[n++] = *v;
+        }
+        for (size_t j = 0; j < n; j++) {
+          taken[out[j]].fetch_add(1, std::memory_order::relaxed);
+        }
+        if (n == 0) {
+          std::this_thread::yield();
+        }
+      }
+    });
+  }
+
+  // The owner pops about a third of what it pushes, racing with the thieves
+  // for the last items.
+  for (uint64_t i = 0; i < kItems; i++) {
+    deque.push(i);
+    if (i % 3 == 0) {
+      if (auto v = deque.pop()) {
+        taken[*v].fetch_add(1, std::memory_order::relaxed);
+      }
+    }
+  }
+  while (auto v = deque.pop()) {
+    taken[*v].fetch_add(1, std::memory_order::relaxed);
+  }
+  done.store(true, std::memory_order::release);
+  for (auto& t : thieves) {
+    t.join();
+  }
+
+  for (uint64_t i = 0; i < kItems; i++) {
+    ASSERT_EQ(taken[i].load(), 1) << i;
+  }
+}
+
+TEST(PriorityQueueTest, strict) {
+  PriorityQueue<int, 64> queue{QueueOpts{}.set_max_size(4)};
+  EXPECT_EQ(queue.try_pop(), std::nullopt);
+
+  for (int i = 0; i < 4; i++) {
+    EXPECT_TRUE(queue.try_push(63, 630 + i));
+  }
+  EXPECT_FALSE(queue.try_push(63, 634));
+  queue.push(0, 0);
+  queue.push(40, 400);
+  queue.push(40, 401);
+  EXPECT_EQ(queue.size(), 7);
+  EXPECT_EQ(queue.size(40), 2);
+
+  for (int v : {630, 631, 632, 633, 400, 401, 0}) {
+    EXPECT_EQ(queue.try_pop(), v);
+  }
+  EXPECT_EQ(queue.try_pop(), std::nullopt);
+}
+
+TEST(PriorityQueueTest, weighted) {
+  // Lane 2 gets three pops for every one of the lanes below it, and lane 1
+  // gets one for every one of lane 0.
+  PriorityQueue<int, 3> queue{QueueOpts{}.set_max_size(64), {0, 1, 3}};
+  for (int i = 0; i < 16; i++) {
+    queue.push(0, 0);
+    queue.push(1, 1);
+    queue.push(2, 2);
+  }
+
+  std::vector<int> popped;
+  for (int i = 0; i < 12; i++) {
+    popped.push_back(*queue.try_pop());
+  }
+  EXPECT_EQ(popped, (std::vector<int>{2, 2, 2, 1, 2, 2, 2, 0, 2, 2, 2, 1}));
+
+  // A lane that yields to lanes that turn out to be empty still pops.
+  PriorityQueue<int, 2> stale{QueueOpts{}.set_max_size(64), {0, 1}};
+  stale.push(0, 0);
+  EXPECT_EQ(stale.try_pop(), 0);
+  stale.push(1, 1);
+  stale.push(1, 1);
+  EXPECT_EQ(stale.try_pop(), 1);
+  EXPECT_EQ(stale.try_pop(), 1);
+  EXPECT_EQ(stale.try_pop(), std::nullopt);
+  EXPECT_EQ(stale.size(), 0);
+}
+
+TEST(PriorityQueueTest, blocking_pop) {
+  using namespace std::chrono_literals;
+  PriorityQueue<uint64_t, 8> queue;
+  EXPECT_EQ(queue.pop_for(10ms), std::nullopt);
+
+  constexpr int kProducers = 4;
+  constexpr uint64_t kPushesPerThread = 10000;
+  std::vector<std::thread> producers;
+  for (int p = 0; p < kProducers; p++) {
+    producers.emplace_back([&queue, p]() {
+      for (uint64_t i = 1; i <= kPushesPerThread; i++) {
+        queue.push((i + p) % 8, i);
+      }
+    });
+  }
+
+  std::atomic<uint64_t> sum{0};
+  {
+    std::vector<std::jthread> consumers;
+    for (int c = 0; c < 2; c++) {
+      consumers.emplace_back([&](std::stop_token stop) {
+        while (auto v = queue.pop(stop)) {
+          sum.fetch_add(*v, std::memory_order::relaxed);
+        }
+      });
+    }
+    for (auto& t : producers) {
+      t.join();
+    }
+    while (queue.size() > 0) {
+      std::this_thread::yield();
+    }
+    // ~jthread stops the consumers.
+  }
+  EXPECT_EQ(sum.load(),
+            kProducers * kPushesPerThread * (kPushesPerThread + 1) / 2);
+}
+
+TEST(NumaTopologyTest, parse_cpulist) {
+  EXPECT_EQ(NumaTopology::parse_cpulist("0-3,8,10-11"),
+            (std::vector<int>{0, 1, 2, 3, 8, 10, 11}));
+  EXPECT_EQ(NumaTopology::parse_cpulist("5"), std::vector<int>{5});
+  EXPECT_EQ(NumaTopology::parse_cpulist(""), std::vector<int>{});
+}
+
+TEST(NumaTopologyTest, from_sysfs) {
+  auto root = std::filesystem::temp_directory_path()
+            / ("numa_topology_test_" + std::to_string(getpid()));
+  auto write = [&](const std::string& file, const std::string& line) {
+    std::filesystem::create_directories((root / file).parent_path());
+    std::ofstream{root / file} << line << "\n";
+  };
+  write("node0/cpulist", "0-1,4");
+  write("node0/distance", "10 21 31");
+  write("node1/cpulist", "2-3");
+  write("node1/distance", "21 10 21");
+  write("node2/cpulist", "5");
+  write("node2/distance", "31 21 10");
+  write("possible", "0-2");
+
+  NumaTopology topology = NumaTopology::from_sysfs(root);
+  std::filesystem::remove_all(root);
+
+  ASSERT_EQ(topology.num_nodes(), 3);
+  EXPECT_EQ(topology.cpus(0), (std::vector<int>{0, 1, 4}));
+  EXPECT_EQ(topology.node_of(4), 0);
+  EXPECT_EQ(topology.node_of(3), 1);
+  EXPECT_EQ(topology.node_of(5), 2);
+  EXPECT_EQ(topology.steal_order(0), (std::vector<size_t>{1, 2}));
+  EXPECT_EQ(topology.steal_order(2), (std::vector<size_t>{1, 0}));
+
+  // Without a node directory, everything is one node.
+  NumaTopology missing = NumaTopology::from_sysfs(root);
+  EXPECT_EQ(missing.num_nodes(), 1);
+  EXPECT_EQ(missing.current_node(), 0);
+}
+
+TEST(CpuTopologyTest, from_sysfs) {
+  auto root = std::filesystem::temp_directory_path()
+            / ("cpu_topology_test_" + std::to_string(getpid()));
+  auto write = [&](const std::string& file, const std::string& line) {
+    std::filesystem::create_directories((root / file).parent_path());
+    std::ofstream{root / file} << line << "\n";
+  };
+  // Four cores with two siblings each, cpuN and cpuN+4, and two cores under
+  // each L3.
+  write("online", "0-7");
+  for (int cpu = 0; cpu < 8; cpu++) {
+    auto dir = "cpu" + std::to_string(cpu);
+    write(dir + "/topology/physical_package_id", "0");
+    write(dir + "/topology/core_id", std::to_string(cpu % 4));
+    write(dir + "/cache/index2/level", "2");
+    write(dir + "/cache/index2/shared_cpu_list",
+          std::to_string(cpu % 4) + "," + std::to_string(cpu % 4 + 4));
+    write(dir + "/cache/index3/level", "3");
+    write(dir + "/cache/index3/shared_cpu_list",
+          cpu % 4 < 2 ? "0-1,4-5" : "2-3,6-7");
+  }
+
+  CpuTopology topology = CpuTopology::from_sysfs(root);
+  std::filesystem::remove_all(root);
+
+  ASSERT_EQ(topology.cpus().size(), 8);
+  EXPECT_TRUE(topology.supports(Placement::kSmtPairs));
+  EXPECT_TRUE(topology.supports(Placement::kCrossL3));
+  EXPECT_EQ(topology.place(Placement::kNone, 2, 2), std::vector<int>{});
+  EXPECT_EQ(topology.place(Placement::kCompact, 3, 3),
+            (std::vector<int>{0, 4, 1, 5, 2, 6}));
+  EXPECT_EQ(topology.place(Placement::kScatter, 3, 3),
+            (std::vector<int>{0, 2, 1, 3, 4, 6}));
+  EXPECT_EQ(topology.place(Placement::kSmtPairs, 2, 2),
+            (std::vector<int>{0, 1, 4, 5}));
+  EXPECT_EQ(topology.place(Placement::kCrossL3, 2, 2),
+            (std::vector<int>{0, 4, 2, 6}));
+  // Threads beyond the CPUs wrap around.
+  EXPECT_EQ(topology.place(Placement::kCrossL3, 5, 1),
+            (std::vector<int>{0, 4, 1, 5, 0, 2}));
+
+  // Without sysfs, there are no siblings and a single L3.
+  CpuTopology missing = CpuTopology::from_sysfs(root);
+  EXPECT_FALSE(missing.supports(Placement::kCrossL3));
+  EXPECT_EQ(missing.place(Placement::kSmtPairs, 1, 1).size(), 2);
+}
+
+TEST(NumaShardedQueueTest, local_first) {
+  NumaShardedQueue<int> queue{QueueOpts{}.set_max_size(4),
+                              NumaTopology::uniform(2, 1)};
+  EXPECT_EQ(queue.capacity(), 4);
+
+  queue.push(0, 1);
+  queue.push(1, 10);
+  queue.push(1, 11);
+  EXPECT_EQ(queue.size(0), 1);
+  EXPECT_EQ(queue.size(1), 2);
+
+  // Node 0 pops its own value before it steals node 1's.
+  EXPECT_EQ(queue.try_pop(0), 1);
+  EXPECT_EQ(queue.try_pop(0), 10);
+  EXPECT_EQ(queue.try_pop(1), 11);
+  EXPECT_EQ(queue.try_pop(1), std::nullopt);
+
+  for (int i = 0; i < 4; i++) {
+    EXPECT_TRUE(queue.try_push(0, i));
+  }
+  EXPECT_FALSE(queue.try_push(0, 4));
+  EXPECT_TRUE(queue.try_push(1, 4));
+}
+
+TEST(NumaShardedQueueTest, blocking_pop) {
+  using namespace std::chrono_literals;
+  constexpr uint64_t kPushesPerThread = 10000;
+  NumaShardedQueue<uint64_t> queue{QueueOpts{}.set_max_size(64),
+                                   NumaTopology::uniform(4, 1)};
+  EXPECT_EQ(queue.pop_for(0, 10ms), std::nullopt);
+
+  // Consumers only run on nodes 0 and 1, so they have to steal from the rest.
+  std::atomic<uint64_t> sum{0};
+  std::vector<std::thread> consumers;
+  for (size_t node : {0, 1}) {
+    consumers.emplace_back([&, node]() {
+      while (true) {
+        uint64_t v = queue.pop(node).value();
+        if (v == 0) {
+          return;
+        }
+        sum.fetch_add(v, std::memory_order::relaxed);
+      }
+    });
+  }
+
+  std::vector<std::thread> producers;
+  for (size_t node = 0; node < 4; node++) {
+    producers.emplace_back([&, node]() {
+      for (uint64_t i = 1; i <= kPushesPerThread; i++) {
+        queue.push(node, i);
+      }
+    });
+  }
+  for (auto& t : producers) {
+    t.join();
+  }
+  queue.push(2, 0);
+  queue.push(3, 0);
+  for (auto& t : consumers) {
+    t.join();
+  }
+  // Order across shards isn't kept, so values may still be left behind the
+  // sentinels.
+  while (auto v = queue.try_pop(0)) {
+    sum += *v;
+  }
+  EXPECT_EQ(sum.load(), 4 * kPushesPerThread * (kPushesPerThread + 1) / 2);
+}
+
+TEST(SharedMemoryQueueTest, create_attach) {
+  auto queue = SharedMemoryQueue<uint64_t>::create(3);
+  ASSERT_TRUE(queue);
+  EXPECT_EQ(queue->capacity(), 4);
+
+  // A second mapping of the same memfd sees the same queue.
+  auto other = SharedMemoryQueue<uint64_t>::attach(queue->fd());
+  ASSERT_TRUE(other);
+  EXPECT_EQ(other->capacity(), 4);
+  for (uint64_t lap = 0; lap < 3; lap++) {
+    for (uint64_t i = 0; i < 4; i++) {
+      EXPECT_TRUE(queue->try_push(lap * 4 + i));
+    }
+    EXPECT_FALSE(queue->try_push(100));
+    EXPECT_EQ(other->size(), 4);
+    for (uint64_t i = 0; i < 4; i++) {
+      EXPECT_EQ(other->pop(), lap * 4 + i);
+    }
+    EXPECT_EQ(other->try_pop(), std::nullopt);
+  }
+}
+
+TEST(SharedMemoryQueueTest, attach_checks_header) {
+  auto queue = SharedMemoryQueue<uint64_t>::create(8);
+  ASSERT_TRUE(queue);
+  errno = 0;
+  EXPECT_FALSE(SharedMemoryQueue<uint32_t>::attach(queue->fd()));
+  EXPECT_EQ(errno, EINVAL);
+
+  // A mapping that nobody has set up yet.
+  int fd = memfd_create("empty", MFD_CLOEXEC);
+  ASSERT_GE(fd, 0);
+  ASSERT_EQ(ftruncate(fd, SharedMemoryQueue<uint64_t>::mapping_size(8)), 0);
+  errno = 0;
+  EXPECT_FALSE(SharedMemoryQueue<uint64_t>::attach(fd));
+  EXPECT_EQ(errno, EAGAIN);
+  close(fd);
+
+  std::string name = "/theta_test_" + std::to_string(getpid());
+  auto named = SharedMemoryQueue<uint64_t>::create(name, 8);
+  ASSERT_TRUE(named);
+  EXPECT_FALSE(SharedMemoryQueue<uint64_t>::create(name, 8));
+  auto attached = SharedMemoryQueue<uint64_t>::attach(name);
+  ASSERT_TRUE(attached);
+  named->push(42);
+  EXPECT_EQ(attached->pop(), 42);
+  EXPECT_TRUE(SharedMemoryQueue<uint64_t>::unlink(name));
+  EXPECT_FALSE(SharedMemoryQueue<uint64_t>::attach(name));
+}
+
+TEST(SharedMemoryQueueTest, across_processes) {
+  constexpr uint64_t kPushes = 100000;
+  // Small queues, so that both sides keep blocking on each other.
+  auto requests = SharedMemoryQueue<uint64_t>::create(8);
+  auto replies = SharedMemoryQueue<uint64_t>::create(1);
+  ASSERT_TRUE(requests && replies);
+
+  pid_t child = fork();
+  ASSERT_GE(child, 0);
+  if (child == 0) {
+    auto in = SharedMemoryQueue<uint64_t>::attach(requests->fd());
+    auto out = SharedMemoryQueue<uint64_t>::attach(replies->fd());
+    if (!in || !out) {
+      _exit(1);
+    }
+    uint64_t sum = 0;
+    for (uint64_t i = 0; i < kPushes; i++) {
+      sum += in->pop();
+    }
+    out->push(sum);
+    _exit(0);
+  }
+
+  for (uint64_t i = 1; i <= kPushes; i++) {
+    requests->push(i);
+  }
+  EXPECT_EQ(replies->pop(), kPushes * (kPushes + 1) / 2);
+  int status;
+  ASSERT_EQ(waitpid(child, &status, 0), child);
+  EXPECT_TRUE(WIFEXITED(status));
+  EXPECT_EQ(WEXITSTATUS(status), 0);
+}
+
+TEST(SpillingQueueTest, spill_and_refill) {
+  SpillingQueue<uint64_t> queue{QueueOpts{}.set_max_size(4)};
+  EXPECT_EQ(queue.capacity(), 4);
+  for (int round = 0; round < 2; round++) {
+    for (uint64_t i = 0; i < 1000; i++) {
+      queue.push(i);
+    }
+    EXPECT_EQ(queue.size(), 1000);
+    EXPECT_EQ(queue.spilled(), 996);
+    for (uint64_t i = 0; i < 1000; i++) {
+      EXPECT_EQ(queue.try_pop(), i);
+    }
+    EXPECT_EQ(queue.try_pop(), std::nullopt);
+    EXPECT_EQ(queue.spilled(), 0);
+  }
+}
+
+TEST(SpillingQueueTest, max_bytes) {
+  SpillingQueue<uint64_t> queue{
+      QueueOpts{}.set_max_size(2),
+      SpillOpts{}.set_max_bytes(3 * sizeof(uint64_t))};
+  for (uint64_t i = 0; i < 5; i++) {
+    EXPECT_TRUE(queue.try_push(i));
+  }
+  EXPECT_FALSE(queue.try_push(5));
+
+  // Pushes keep going to the spill file until it is drained.
+  EXPECT_EQ(queue.try_pop(), 0);
+  EXPECT_FALSE(queue.try_push(5));
+  for (uint64_t i = 1; i < 5; i++) {
+    EXPECT_EQ(queue.try_pop(), i);
+  }
+  EXPECT_TRUE(queue.try_push(5));
+  EXPECT_EQ(queue.pop(), 5);
+}
+
+TEST(SpillingQueueTest, no_spill_dir) {
+  // Without a spill file this is a plain bounded queue.
+  SpillingQueue<uint64_t> queue{
+      QueueOpts{}.set_max_size(2),
+      SpillOpts{}.set_dir("/nonexistent/theta_spill")};
+  EXPECT_TRUE(queue.try_push(0));
+  EXPECT_TRUE(queue.try_push(1));
+  EXPECT_FALSE(queue.try_push(2));
+  EXPECT_EQ(queue.pop(), 0);
+  EXPECT_EQ(queue.pop(), 1);
+}
+
+// A spill file that runs out of disk space before it holds anything leaves
+// pushes waiting for room in the ring.
+TEST(SpillingQueueTest, out_of_space) {
+  auto dir = std::filesystem::temp_directory_path()
+           / ("theta_spill_" + std::to_string(getpid()));
+  ASSERT_TRUE(std::filesystem::create_directory(dir));
+
+  pid_t child = fork();
+  ASSERT_GE(child, 0);
+  if (child == 0) {
+    // A one-page tmpfs lets the spill file be created and sized, but not
+    // allocated. Keep the mount out of the parent's namespace.
+    if (unshare(CLONE_NEWNS) != 0
+        || mount(nullptr, "/", nullptr, MS_REC | MS_PRIVATE, nullptr) != 0
+        || mount("tmpfs", dir.c_str(), "tmpfs", 0, "size=4k") != 0) {
+      _exit(2);
+    }
+    alarm(10);
+    SpillingQueue<uint64_t> queue{QueueOpts{}.set_max_size(2),
+                                  SpillOpts{}.set_dir(dir)};
+    queue.push(0);
+    queue.push(1);
+    std::thread producer{[&]() { queue.push(2); }};
+    bool in_order = true;
+    for (uint64_t i = 0; i < 3; i++) {
+      in_order &= queue.pop() == i;
+    }
+    producer.join();
+    _exit(in_order && queue.spilled() == 0 ? 0 : 1);
+  }
+
+  int status;
+  ASSERT_EQ(waitpid(child, &status, 0), child);
+  std::filesystem::remove(dir);
+  ASSERT_TRUE(WIFEXITED(status));
+  if (WEXITSTATUS(status) == 2) {
+    GTEST_SKIP() << "can't mount a tmpfs";
+  }
+  EXPECT_EQ(WEXITSTATUS(status), 0);
+}
+
+TEST(SpillingQueueTest, per_producer_order) {
+  constexpr uint64_t kPushesPerThread = 20000;
+  constexpr uint64_t kProducers = 3;
+  SpillingQueue<uint64_t> queue{QueueOpts{}.set_max_size(16)};
+
+  std::vector<std::thread> producers;
+  for (uint64_t p = 0; p < kProducers; p++) {
+    producers.emplace_back([&, p]() {
+      for (uint64_t i = 1; i <= kPushesPerThread; i++) {
+        queue.push(p << 32 | i);
+      }
+    });
+  }
+
+  std::array<uint64_t, kProducers> last{};
+  for (uint64_t n = 0; n < kProducers * kPushesPerThread; n++) {
+    uint64_t v = queue.pop();
+    uint64_t p = v >> 32;
+    ASSERT_LT(p, kProducers);
+    ASSERT_EQ(v & 0xffffffff, last[p] + 1);
+    last[p]++;
+  }
+  for (auto& t : producers) {
+    t.join();
+  }
+  EXPECT_EQ(queue.try_pop(), std::nullopt);
+}
+
+TEST(UnboundedMPMCQueueTest, grows) {
+  using namespace std::chrono_literals;
+  UnboundedMPMCQueue<std::unique_ptr<int>> queue{QueueOpts{}.set_max_size(4)};
+  EXPECT_EQ(queue.ring_size(), 4);
+  EXPECT_EQ(queue.pop_for(1ms), std::nullopt);
+  for (int round = 0; round < 3; round++) {
+    for (int i = 0; i < 100; i++) {
+      queue.push(std::make_unique<int>(i));
+    }
+    EXPECT_EQ(queue.size(), 100);
+    for (int i = 0; i < 100; i++) {
+      EXPECT_EQ(*queue.pop(), i);
+    }
+    EXPECT_EQ(queue.try_pop(), std::nullopt);
+  }
+  // Values still queued are destroyed with the queue.
+  queue.push(std::make_unique<int>(0));
+}
+
+TEST(UnboundedMPMCQueueTest, concurrent) {
+  constexpr uint64_t kPushesPerThread = 20000;
+  constexpr uint64_t kThreads = 3;
+  UnboundedMPMCQueue<uint64_t> queue{QueueOpts{}.set_max_size(8)};
+
+  // Each consumer checks that it sees every producer's values in order.
+  std::atomic<uint64_t> sum{0};
+  std::vector<std::thread> consumers;
+  for (uint64_t c = 0; c < kThreads; c++) {
+    consumers.emplace_back([&]() {
+      std::array<uint64_t, kThreads> last{};
+      while (true) {
+        uint64_t v = queue.pop();
+        if (v == 0) {
+          return;
+        }
+        uint64_t p = v >> 32;
+        EXPECT_GT(v & 0xffffffff, last[p]);
+        last[p] = v & 0xffffffff;
+        sum.fetch_add(v & 0xffffffff, std::memory_order::relaxed);
+      }
+    });
+  }
+  std::vector<std::thread> producers;
+  for (uint64_t p = 0; p < kThreads; p++) {
+    producers.emplace_back([&, p]() {
+      for (uint64_t i = 1; i <= kPushesPerThread; i++) {
+        queue.push(p << 32 | i);
+      }
+    });
+  }
+  for (auto& t : producers) {
+    t.join();
+  }
+  for (uint64_t c = 0; c < kThreads; c++) {
+    queue.push(uint64_t{0});
+  }
+  for (auto& t : consumers) {
+    t.join();
+  }
+  EXPECT_EQ(sum.load(),
+            kThreads * kPushesPerThread * (kPushesPerThread + 1) / 2);
+}
+
+TEST(ObjectPoolTest, reuse) {
+  ObjectPool<std::string> pool;
+  std::string* a = pool.make("hello");
+  EXPECT_EQ(*a, "hello");
+  EXPECT_EQ(pool.capacity(), ObjectPool<std::string>::kBatch);
+  pool.destroy(a);
+  std::string* b = pool.make(3, 'x');
+  EXPECT_EQ(a, b);
+  EXPECT_EQ(*b, "xxx");
+  pool.destroy(b);
+}
+
+TEST(ObjectPoolTest, producer_consumer) {
+  constexpr uint64_t kPushes = 100000;
+  ObjectPool<uint64_t> pool;
+  MPMCQueue<uint64_t*> queue{QueueOpts{}.set_max_size(64)};
+
+  std::thread consumer{[&]() {
+    for (uint64_t i = 0; i < kPushes; i++) {
+      uint64_t* v = *queue.pop();
+      EXPECT_EQ(*v, i);
+      pool.destroy(v);
+    }
+    pool.flush();
+  }};
+  for (uint64_t i = 0; i < kPushes; i++) {
+    queue.push(pool.make(i));
+  }
+  consumer.join();
+
+  // Objects keep going back to the producer, so it only ever needs enough
+  // for the queue and the consumer's batch.
+  EXPECT_LE(pool.capacity(), 8 * ObjectPool<uint64_t>::kBatch);
+}
+
+TEST(ObjectPoolTest, thread_exit) {
+  constexpr size_t kObjects = 1000;
+  ObjectPool<uint64_t> pool;
+  std::thread{[&]() {
+    std::vector<uint64_t*> objects;
+    for (size_t i = 0; i < kObjects; i++) {
+      objects.push_back(pool.make(i));
+    }
+    for (uint64_t* v : objects) {
+      pool.destroy(v);
+    }
+  }}.join();
+  size_t capacity = pool.capacity();
+
+  // The exited thread's objects are reused rather than allocated again.
+  std::vector<uint64_t*> objects;
+  for (size_t i = 0; i < kObjects; i++) {
+    objects.push_back(pool.make(i));
+  }
+  EXPECT_EQ(pool.capacity(), capacity);
+  for (uint64_t* v : objects) {
+    pool.destroy(v);
+  }
+}
+
+TEST(ObjectPoolTest, global_list) {
+  // Every thread makes more objects than its cache keeps, so batches keep
+  // moving through the global list.
+  ObjectPool<uint64_t> pool;
+  std::vector<std::thread> threads;
+  for (uint64_t t = 0; t < 4; t++) {
+    threads.emplace_back([&, t]() {
+      std::vector<uint64_t*> objects;
+      for (int round = 0; round < 50; round++) {
+        for (uint64_t i = 0; i < 500; i++) {
+          objects.push_back(pool.make(t << 32 | i));
+        }
+        for (uint64_t i = 0; i < 500; i++) {
+          EXPECT_EQ(*objects[i], t << 32 | i);
+          pool.destroy(objects[i]);
+        }
+        objects.clear();
+      }
+    });
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+}
+
+TEST(QueueStatsTest, disabled_by_default) {
+  MPMCQueue<uint64_t> queue{QueueOpts{}.set_max_size(8)};
+  for (uint64_t i = 1; i <= 5; i++) {
+    queue.push(i);
+  }
+  for (int i = 0; i < 5; i++) {
+    queue.pop();
+  }
+  QueueStats stats = queue.stats();
+  EXPECT_EQ(stats.waits, 0);
+  EXPECT_EQ(stats.wakes, 0);
+  EXPECT_EQ(stats.reserve_retries, 0);
+  EXPECT_EQ(stats.max_size, 0);
+}
+
+TEST(QueueStatsTest, mpmc_waits_and_wakes) {
+  using namespace std::chrono_literals;
+  MPMCQueue<uint64_t,
+            kRuntimeBufferSize,
+            /*kMinimizeContention=*/false,
+            ParkWait,
+            Cardinality::kMany,
+            Cardinality::kMany,
+            ShardedQueueStats>
+      queue{QueueOpts{}.set_max_size(8)};
+
+  for (uint64_t i = 1; i <= 5; i++) {
+    queue.push(i);
+  }
+  EXPECT_EQ(queue.try_pop_n(std::array<uint64_t, 8>{}.data(), 8), 5);
+  EXPECT_EQ(queue.stats().max_size, 5);
+  EXPECT_EQ(queue.stats().waits, 0);
+
+  // A pop that finds the queue empty parks until a push hands it the slot.
+  std::thread consumer{[&]() { EXPECT_EQ(queue.pop(), 42); }};
+  while (queue.stats().waits == 0) {
+    std::this_thread::yield();
+  }
+  std::this_thread::sleep_for(10ms);
+  queue.push(42);
+  consumer.join();
+
+  QueueStats stats = queue.stats();
+  EXPECT_EQ(stats.waits, 1);
+  EXPECT_EQ(stats.wakes, 1);
+  EXPECT_EQ(stats.max_size, 5);
+}
+
+TEST(QueueStatsTest, mpmc_concurrent) {
+  MPMCQueue<uint64_t,
+            kRuntimeBufferSize,
+            /*kMinimizeContention=*/false,
+            ParkWait,
+            Cardinality::kMany,
+            Cardinality::kMany,
+            ShardedQueueStats>
+      queue{QueueOpts{}.set_max_size(64)};
+  static constexpr uint64_t kPerThread = 5000;
+
+  std::vector<std::thread> threads;
+  std::atomic<uint64_t> popped{0};
+  for (int t = 0; t < 4; t++) {
+    threads.emplace_back([&]() {
+      for (uint64_t i = 1; i <= kPerThread;) {
+        if (queue.try_push(i)) {
+          i++;
+        } else {
+          std::this_thread::yield();
+        }
+      }
+    });
+    threads.emplace_back([&]() {
+      while (popped.load(std::memory_order::relaxed) < 4 * kPerThread) {
+        if (queue.try_pop()) {
+          popped.fetch_add(1, std::memory_order::relaxed);
+        } else {
+          std::this_thread::yield();
+        }
+      }
+    });
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+
+  QueueStats stats = queue.stats();
+  EXPECT_GE(stats.max_size, 1);
+  EXPECT_LE(stats.max_size, queue.capacity());
+  EXPECT_LE(stats.wakes, stats.waits);
+}
+
+TEST(QueueStatsTest, mpsc) {
+  MPSCQueue<uint64_t*, /*kUnbounded=*/false, ShardedQueueStats> queue{
+      QueueOpts{}.set_max_size(16)};
+  std::array<uint64_t, 8> values{};
+  std::array<uint64_t*, 8> in;
+  for (size_t i = 0; i < values.size(); i++) {
+    in[i] = &values[i];
+  }
+
+  EXPECT_TRUE(queue.try_push(in[0]));
+  EXPECT_EQ(queue.try_push_n(std::span{in}.subspan(1)), 7);
+  EXPECT_EQ(queue.stats().max_size, 8);
+  std::array<uint64_t*, 8> out;
+  EXPECT_EQ(queue.try_pop_n(out.data(), out.size()), 8);
+  EXPECT_TRUE(queue.try_push(in[0]));
+
+  QueueStats stats = queue.stats();
+  EXPECT_EQ(stats.max_size, 8);
+  EXPECT_EQ(stats.reserve_retries, 0);
+  EXPECT_EQ(stats.slot_spins, 0);
+}
+
 TYPED_TEST(QueueTests, DISABLED_push_full) {
   static constexpr int kSize = 16;
   auto queue = this->make_uut(QueueOpts{}.set_max_size(kSize));
@@ -58,7 +1697,7 @@ TYPED_TEST(QueueTests, DISABLED_push_full) {
     int expected_size = queue.capacity();
     while (true) {
       EXPECT_EQ(queue.size(), expected_size--);
-      auto v = queue.pop();
+      auto* v = *queue.pop();
       if (!v) {
         break;
       }
@@ -71,8 +1710,8 @@ TYPED_TEST(QueueTests, DISABLED_push_full) {
     // Do everything again, but with a new offset
     v = new uint64_t{1000};
     queue.push(std::move(v));
-    delete queue.pop();
-    EXPECT_EQ(queue.pop(), nullptr);
+    delete *queue.pop();
+    EXPECT_EQ(*queue.pop(), nullptr);
   }
 }
 
@@ -97,7 +1736,7 @@ TYPED_TEST(QueueTests, DISABLED_multithreaded_stress) {
           while (num_pushes < kPushesPerThread) {
             double choice = unif(gen);
             if (choice < 0.5) {
-              auto* v = queue.pop();
+              auto* v = *queue.pop();
               if (v) {
                 sum += *v;
                 delete v;
@@ -105,7 +1744,7 @@ TYPED_TEST(QueueTests, DISABLED_multithreaded_stress) {
             } else {
               uint64_t* v = new uint64_t{num_pushes++};
               while (!queue.try_push(v)) {
-                auto* other = queue.pop();
+                auto* other = *queue.pop();
                 if (other) {
                   sum += *other;
                   delete other;
@@ -126,7 +1765,7 @@ TYPED_TEST(QueueTests, DISABLED_multithreaded_stress) {
   }
 
   while (true) {
-    auto v = queue.pop();
+    auto* v = *queue.pop();
     if (!v) {
       break;
     }
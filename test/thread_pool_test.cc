@@ -0,0 +1,113 @@
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include "thread_pool.h"
+
+namespace theta {
+
+TEST(ThreadPoolTest, packaged_tasks) {
+  ThreadPool pool{ThreadPoolOpts{}.set_num_workers(2)};
+  EXPECT_EQ(pool.num_workers(), 2);
+
+  PackagedTask sum{[]() { return 1 + 2; }};
+  PackagedTask fail{[]() -> int { throw std::runtime_error("fail"); }};
+  pool.submit(sum);
+  pool.submit(fail);
+  EXPECT_EQ(sum.get(), 3);
+  EXPECT_THROW(fail.get(), std::runtime_error);
+  EXPECT_TRUE(sum.is_done());
+
+  // A finished task can be submitted again.
+  pool.submit(sum);
+  EXPECT_EQ(sum.get(), 3);
+}
+
+TEST(ThreadPoolTest, resubmit_after_throw) {
+  ThreadPool pool{ThreadPoolOpts{}.set_num_workers(1)};
+  int runs = 0;
+  PackagedTask flaky{[&runs]() {
+    if (runs++ == 0) {
+      throw std::runtime_error("first run");
+    }
+    return runs;
+  }};
+  pool.submit(flaky);
+  EXPECT_THROW(flaky.get(), std::runtime_error);
+
+  // The next run's result replaces the earlier exception.
+  pool.submit(flaky);
+  EXPECT_EQ(flaky.get(), 2);
+}
+
+TEST(ThreadPoolTest, submit_during_shutdown) {
+  // The tasks have to outlive the pool.
+  std::optional<ThreadPool> pool;
+  PackagedTask late{[]() { return 1; }};
+  std::atomic<bool> submitted{true};
+  PackagedTask early{[&]() {
+    // Gives the destructor time to close the queue.
+    std::this_thread::sleep_for(std::chrono::milliseconds{50});
+    submitted = pool->submit(late);
+  }};
+  pool.emplace(ThreadPoolOpts{}.set_num_workers(1));
+  pool->submit(early);
+  pool.reset();
+  EXPECT_FALSE(submitted.load());
+  EXPECT_TRUE(late.is_done());
+  EXPECT_THROW(late.get(), std::runtime_error);
+}
+
+TEST(ThreadPoolTest, submit_bulk) {
+  std::atomic<int> runs{0};
+  auto count = [&runs]() { runs.fetch_add(1, std::memory_order::relaxed); };
+  using CountTask = PackagedTask<decltype(count)>;
+
+  // More tasks than the queue holds, so submit_bulk() has to wait for the
+  // workers.
+  std::vector<std::unique_ptr<CountTask>> tasks;
+  std::vector<Task*> ptrs;
+  for (int i = 0; i < 100; i++) {
+    tasks.push_back(std::make_unique<CountTask>(count));
+    ptrs.push_back(tasks.back().get());
+  }
+
+  {
+    ThreadPool pool{
+        ThreadPoolOpts{}.set_num_workers(3).set_max_queued(16).set_cpus({0})};
+    pool.submit_bulk(ptrs);
+    tasks.front()->wait();
+    // Destroying the pool runs what is left.
+  }
+  EXPECT_EQ(runs.load(), 100);
+  for (auto& task : tasks) {
+    EXPECT_TRUE(task->is_done());
+  }
+}
+
+TEST(ThreadPoolTest, many_waiters) {
+  ThreadPool pool{ThreadPoolOpts{}.set_num_workers(4)};
+  std::vector<std::thread> submitters;
+  std::atomic<int> sum{0};
+  for (int i = 0; i < 4; i++) {
+    submitters.emplace_back([&, i]() {
+      for (int j = 0; j < 1000; j++) {
+        PackagedTask task{[i, j]() { return i * j; }};
+        pool.submit(task);
+        sum.fetch_add(task.get(), std::memory_order::relaxed);
+      }
+    });
+  }
+  for (auto& t : submitters) {
+    t.join();
+  }
+  EXPECT_EQ(sum.load(), (0 + 1 + 2 + 3) * (999 * 1000 / 2));
+}
+
+}  // namespace theta